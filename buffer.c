@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <errno.h>
+#include <sys/mman.h>
 #ifndef BUFFER_FOR_TUX3
 #include "diskio.h"
 #endif
@@ -8,6 +9,7 @@
 #include "trace.h"
 #include "libklib/err.h"
 #include "libklib/list_sort.h"
+#include "libklib/hash.h"
 
 #define buftrace trace_off
 
@@ -34,16 +36,25 @@
 #define SECTOR_BITS		9
 #define SECTOR_SIZE		(1 << SECTOR_BITS)
 
-#define BUFFER_PARANOIA_DEBUG
 /*
- * 0 - no debug
- * 1 - leak check
+ * 0 - no debug, buffers come from preallocated pool
+ * 1 - leak check, each buffer is allocated and freed on demand
  * 2 - "1" and reclaim buffer early
  */
 static int debug_buffer;
 
-static struct list_head buffers[BUFFER_STATES], lru_buffers;
+static struct list_head buffers[BUFFER_STATES];
+static struct list_head lru_buffers[BUFFER_LRU_LISTS];
+static const struct buffer_policy *policy;
+static struct buffer_stats buffer_stats;
+static void init_buffer_policy(unsigned nr_buffers);
 static unsigned max_buffers = 10000, max_evict = 1000, buffer_count;
+static unsigned buffer_bits;	/* log2 of buffer data size */
+static int buffer_hugepages;	/* back preallocated pool by huge pages */
+static unsigned dirty_count;
+static unsigned buffer_align = SECTOR_SIZE;	/* alignment of buffer data */
+static struct kmem_cache *buffer_head_cachep;	/* on demand buffer_heads */
+static struct kmem_cache *bufvec_iov_cachep;	/* iovec arrays for bufvec_io */
 
 void show_buffer(struct buffer_head *buffer)
 {
@@ -67,7 +78,7 @@ void show_buffers_(map_t *map, int all)
 	struct buffer_head *buffer;
 	unsigned i;
 
-	for (i = 0; i < BUFFER_BUCKETS; i++) {
+	for (i = 0; i < 1U << map->hash_bits; i++) {
 		struct hlist_head *bucket = &map->hash[i];
 		if (hlist_empty(bucket))
 			continue;
@@ -146,15 +157,67 @@ int count_buffers(void)
 	}
 	struct buffer_head *safe, *buffer;
 	int count = 0;
-	list_for_each_entry_safe(buffer, safe, &lru_buffers, lru) {
-		if (buffer->count <= !hlist_unhashed(&buffer->hashlink))
-			continue;
-		trace_off("buffer %Lx has non-zero count %d", (long long)buffer->index, buffer->count);
-		count++;
+	for (int i = 0; i < BUFFER_LRU_LISTS; i++) {
+		list_for_each_entry_safe(buffer, safe, &lru_buffers[i], lru) {
+			if (buffer->count <= !hlist_unhashed(&buffer->hashlink))
+				continue;
+			trace_off("buffer %Lx has non-zero count %d", (long long)buffer->index, buffer->count);
+			count++;
+		}
 	}
 	return count;
 }
 
+unsigned dirty_buffer_count(void)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	return dirty_count;
+}
+
+void get_buffer_stats(struct buffer_stats *stats)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	*stats = buffer_stats;
+	strncpy(stats->policy, policy->name, sizeof(stats->policy) - 1);
+	stats->buffers = buffer_count;
+	stats->max_buffers = max_buffers;
+}
+
+/* Blocks read without blockread(), see tuxread_pin() */
+void count_reads(unsigned blocks)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	buffer_stats.reads += blocks;
+}
+
+/* Blocks read together with the one asked for */
+void count_readahead(unsigned blocks)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	buffer_stats.readahead += blocks;
+}
+
+unsigned max_buffer_count(void)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	return max_buffers;
+}
+
 static int reclaim_buffer(struct buffer_head *buffer)
 {
 	/* If buffer is not dirty and ->count == 1, we can reclaim buffer */
@@ -178,10 +241,8 @@ static inline int reclaim_buffer_early(struct buffer_head *buffer)
 	{
 		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	#ifdef BUFFER_PARANOIA_DEBUG
 	if (debug_buffer >= 2)
 		return reclaim_buffer(buffer);
-#endif
 	return 0;
 }
 
@@ -191,10 +252,8 @@ static inline int is_reclaim_buffer_early(void)
 	{
 		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	#ifdef BUFFER_PARANOIA_DEBUG
 	if (debug_buffer >= 2)
 		return 1;
-#endif
 	return 0;
 }
 
@@ -205,6 +264,12 @@ void set_buffer_state_list(struct buffer_head *buffer, unsigned state, struct li
 		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
 	list_move_tail(&buffer->link, list);
+	dirty_count += tux3_bufsta_has_delta(state) -
+		       tux3_bufsta_has_delta(buffer->state);
+	if (tux3_bufsta_has_delta(buffer->state))
+		buffer_stats.dirty_bytes[tux3_bufsta_get_delta(buffer->state)] -= bufsize(buffer);
+	if (tux3_bufsta_has_delta(state))
+		buffer_stats.dirty_bytes[tux3_bufsta_get_delta(state)] += bufsize(buffer);
 	buffer->state = state;
 	/* state was changed, try to reclaim */
 	reclaim_buffer_early(buffer);
@@ -342,7 +407,6 @@ if(DEBUG_MODE_U==1)
 	set_buffer_empty(buffer);
 }
 
-#ifdef BUFFER_PARANOIA_DEBUG
 static void __free_buffer(struct buffer_head *buffer)
 {
 	if(DEBUG_MODE_U==1)
@@ -351,9 +415,8 @@ static void __free_buffer(struct buffer_head *buffer)
 	}
 	list_del(&buffer->link);
 	free(buffer->data);
-	free(buffer);
+	kmem_cache_free(buffer_head_cachep, buffer);
 }
-#endif
 
 static void free_buffer(struct buffer_head *buffer)
 {
@@ -361,13 +424,11 @@ if(DEBUG_MODE_U==1)
 	{
 		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	#ifdef BUFFER_PARANOIA_DEBUG
 	if (debug_buffer) {
 		__free_buffer(buffer);
 		buffer_count--;
 		return;
 	}
-#endif
 	/* insert at head, not tail? */
 	set_buffer_state(buffer, BUFFER_FREED);
 	buffer->map = NULL;
@@ -444,13 +505,85 @@ void blockput_free_unify(struct sb *sb, struct buffer_head *buffer)
 	__blockput_free(buffer, sb->unify);
 }
 
-unsigned buffer_hash(block_t block)
+unsigned buffer_hash(map_t *map, block_t block)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	return hash_64(block, map->hash_bits);
+}
+
+static struct hlist_head *alloc_buffer_hash(unsigned bits)
 {
 	if(DEBUG_MODE_U==1)
 	{
 		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	return (((block >> 32) ^ (block_t)block) * 978317583) % BUFFER_BUCKETS;
+	struct hlist_head *hash = malloc(sizeof(*hash) << bits);
+	if (hash) {
+		for (unsigned i = 0; i < 1U << bits; i++)
+			INIT_HLIST_HEAD(&hash[i]);
+	}
+	return hash;
+}
+
+/* Rehash to keep chains short: grow above 1 per bucket, shrink below 1/4 */
+static void balance_buffer_hash(map_t *map)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	unsigned bits = map->hash_bits;
+
+	if (map->hash_walk)
+		return;
+	while (map->hash_count > 1U << bits)
+		bits++;
+	while (bits > BUFFER_HASH_MIN_BITS && map->hash_count < 1U << (bits - 2))
+		bits--;
+	if (bits == map->hash_bits)
+		return;
+
+	struct hlist_head *hash = alloc_buffer_hash(bits);
+	if (!hash)
+		return; /* keep the old one, just longer chains */
+
+	for (unsigned i = 0; i < 1U << map->hash_bits; i++) {
+		struct buffer_head *buffer;
+		struct hlist_node *n;
+
+		hlist_for_each_entry_safe(buffer, n, &map->hash[i], hashlink) {
+			hlist_del(&buffer->hashlink);
+			hlist_add_head(&buffer->hashlink,
+				       hash + hash_64(buffer->index, bits));
+		}
+	}
+	free(map->hash);
+	map->hash = hash;
+	map->hash_bits = bits;
+}
+
+/* Pin the hash size while iterating buckets, buffers may come and go */
+static void buffer_hash_walk_begin(map_t *map)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	map->hash_walk++;
+}
+
+static void buffer_hash_walk_end(map_t *map)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	assert(map->hash_walk);
+	if (!--map->hash_walk)
+		balance_buffer_hash(map);
 }
 
 void insert_buffer_hash(struct buffer_head *buffer)
@@ -460,10 +593,12 @@ void insert_buffer_hash(struct buffer_head *buffer)
 		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
 	map_t *map = buffer->map;
-	struct hlist_head *bucket = map->hash + buffer_hash(buffer->index);
+	struct hlist_head *bucket = map->hash + buffer_hash(map, buffer->index);
 	get_bh(buffer); /* get additonal refcount for hashlink */
 	hlist_add_head(&buffer->hashlink, bucket);
-	list_add_tail(&buffer->lru, &lru_buffers);
+	policy->insert(buffer);
+	map->hash_count++;
+	balance_buffer_hash(map);
 }
 
 void remove_buffer_hash(struct buffer_head *buffer)
@@ -472,8 +607,11 @@ void remove_buffer_hash(struct buffer_head *buffer)
 	{
 		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	list_del_init(&buffer->lru);
+	map_t *map = buffer->map;
+	policy->remove(buffer);
 	hlist_del_init(&buffer->hashlink);
+	map->hash_count--;
+	balance_buffer_hash(map);
 	blockput(buffer); /* put additonal refcount for hashlink */
 }
 
@@ -500,37 +638,26 @@ struct buffer_head *new_buffer(map_t *map)
 	struct list_head *freed_list = &buffers[BUFFER_FREED];
 	int err;
 
-	if (!list_empty(freed_list)) {
-		buffer = list_entry(freed_list->next, struct buffer_head, link);
-		goto have_buffer;
-	}
-
 	if (buffer_count >= max_buffers) {
 		buftrace("try to evict buffers");
-		struct buffer_head *safe, *victim;
-		int count = 0;
-	
-		list_for_each_entry_safe(victim, safe, &lru_buffers, lru) {
-			if (reclaim_buffer(victim)) {
-				if (++count == max_evict)
-					break;
-			}
-		}
-
-		if (!list_empty(freed_list)) {
-			buffer = list_entry(freed_list->next, struct buffer_head, link);
-			goto have_buffer;
-		}
+		policy->evict(max_evict);
 	}
 
-	buftrace("expand buffer pool");
-	if (buffer_count == max_buffers) {
+	/* Pool may have been shrunk below buffers in use */
+	if (buffer_count >= max_buffers) {
 		printf("Warning: maximum buffer count exceeded (%i)\n",
 		       buffer_count);
 		return ERR_PTR(-ENOMEM);
 	}
 
-	buffer = malloc(sizeof(struct buffer_head));
+	if (!list_empty(freed_list)) {
+		buffer = list_entry(freed_list->next, struct buffer_head, link);
+		goto have_buffer;
+	}
+
+	buftrace("expand buffer pool");
+
+	buffer = kmem_cache_alloc(buffer_head_cachep, GFP_NOFS);
 	if (!buffer)
 		return ERR_PTR(-ENOMEM);
 	*buffer = (struct buffer_head){
@@ -539,13 +666,13 @@ struct buffer_head *new_buffer(map_t *map)
 		.lru	= LIST_HEAD_INIT(buffer->lru),
 	};
 	INIT_HLIST_NODE(&buffer->hashlink);
-	//Alloc Buffer! 1 << map->dev->bits = 4096b chunk, at align SECTOR_SIZE = 512
+	//Alloc Buffer! 1 << map->dev->bits = 4096b chunk, at align buffer_align
 	//...this is similar to malloc
-	err = posix_memalign(&buffer->data, SECTOR_SIZE, 1 << map->dev->bits);
+	err = posix_memalign(&buffer->data, buffer_align, 1 << map->dev->bits);
 	if (err) {
 		printf("Error: unable to expand buffer pool: %s\n",
 		       strerror(err));
-		free(buffer);
+		kmem_cache_free(buffer_head_cachep, buffer);
 		return ERR_PTR(-err);
 	}
 	printf("\nBuffer Allocated!\nBuffer_Count : %u\n",buffer_count+1);//
@@ -566,7 +693,7 @@ struct buffer_head *peekblk(map_t *map, block_t block)
 	{
 		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	struct hlist_head *bucket = map->hash + buffer_hash(block);
+	struct hlist_head *bucket = map->hash + buffer_hash(map, block);
 	struct buffer_head *buffer;
 
 	hlist_for_each_entry(buffer, bucket, hashlink) {
@@ -584,16 +711,18 @@ struct buffer_head *blockget(map_t *map, block_t block)
 	{
 		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	struct hlist_head *bucket = map->hash + buffer_hash(block);
+	struct hlist_head *bucket = map->hash + buffer_hash(map, block);
 	struct buffer_head *buffer;
 
 	hlist_for_each_entry(buffer, bucket, hashlink) {
 		if (buffer->index == block) {
-			list_move_tail(&buffer->lru, &lru_buffers);
+			policy->access(buffer);
+			buffer_stats.hits++;
 			get_bh(buffer);
 			return buffer;
 		}
 	}
+	buffer_stats.misses++;
 	printf("\nMake buffer [%Lx]\n", block);//
 	buftrace("make buffer [%Lx]", block);
 	buffer = new_buffer(map);
@@ -622,6 +751,7 @@ struct buffer_head *blockread(map_t *map, block_t block)
 		assert(ret == 1);
 
 		buftrace("read buffer %Lx, state %i", buffer->index, buffer->state);
+		buffer_stats.reads++;
 		int err = buffer->map->io(READ, &bufvec);
 		if (err || !buffer_clean(buffer)) {
 			blockput(buffer);
@@ -647,7 +777,8 @@ void truncate_buffers_range(map_t *map, loff_t lstart, loff_t lend)
 
 	assert((lend & (blocksize - 1)) == (blocksize - 1));
 
-	for (i = 0; i < BUFFER_BUCKETS; i++) {
+	buffer_hash_walk_begin(map);
+	for (i = 0; i < 1U << map->hash_bits; i++) {
 		struct hlist_head *bucket = &map->hash[i];
 		struct buffer_head *buffer;
 		struct hlist_node *n;
@@ -671,6 +802,7 @@ void truncate_buffers_range(map_t *map, loff_t lstart, loff_t lend)
 				reclaim_buffer(buffer);
 		}
 	}
+	buffer_hash_walk_end(map);
 }
 
 /* !!! only used for testing */
@@ -681,7 +813,8 @@ void invalidate_buffers(map_t *map)
 		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
 	unsigned i;
-	for (i = 0; i < BUFFER_BUCKETS; i++) {
+	buffer_hash_walk_begin(map);
+	for (i = 0; i < 1U << map->hash_bits; i++) {
 		struct hlist_head *bucket = &map->hash[i];
 		struct buffer_head *buffer;
 		struct hlist_node *n;
@@ -695,28 +828,23 @@ void invalidate_buffers(map_t *map)
 			}
 		}
 	}
+	buffer_hash_walk_end(map);
 }
 
-#ifdef BUFFER_PARANOIA_DEBUG
+/* Leak check at exit, only with debug_buffer */
 static void destroy_buffers(void)
 {
 	if(DEBUG_MODE_U==1)
 	{
 		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	struct buffer_head *buffer, *safe;
+	struct buffer_head *buffer;
 	struct list_head *head;
 
-	/* If debug_buffer, buffer should already be freed */
+	/* With debug_buffer, buffer should already be freed */
 
 	for (int i = 0; i < BUFFER_STATES; i++) {
 		head = buffers + i;
-		if (!debug_buffer) {
-			list_for_each_entry_safe(buffer, safe, head, link) {
-				list_del(&buffer->lru);
-				__free_buffer(buffer);
-			}
-		}
 		if (!list_empty(head)) {
 			printf("Error: state %d: buffer leak, or list corruption?\n", i);
 			list_for_each_entry(buffer, head, link) {
@@ -732,49 +860,117 @@ static void destroy_buffers(void)
 	 * If buffer is dirty, it may not be on buffers state list
 	 * (e.g. buffer may be on map->dirty).
 	 */
-	if (!debug_buffer) {
-		list_for_each_entry_safe(buffer, safe, &lru_buffers, lru) {
-			assert(buffer_dirty(buffer));
-			list_del(&buffer->lru);
-			__free_buffer(buffer);
+	for (int i = 0; i < BUFFER_LRU_LISTS; i++) {
+		head = lru_buffers + i;
+		if (!list_empty(head)) {
+			printf("Error: dirty buffer leak, or list corruption?\n");
+			list_for_each_entry(buffer, head, lru) {
+				if (buffer_dirty(buffer)) {
+					printf("map [%p] ", buffer->map);
+					show_buffer(buffer);
+				}
+			}
+			printf("\n");
+			assert(list_empty(head));
 		}
 	}
-	if (!list_empty(&lru_buffers)) {
-		printf("Error: dirty buffer leak, or list corruption?\n");
-		list_for_each_entry(buffer, &lru_buffers, lru) {
-			if (buffer_dirty(buffer)) {
-				printf("map [%p] ", buffer->map);
-				show_buffer(buffer);
+	policy->exit();
+}
+
+/*
+ * Preallocated buffers come in chunks of at most BUFFER_CHUNK_SIZE bytes,
+ * so a shrunk pool can free the chunks it doesn't need any more.
+ */
+struct buffer_chunk {
+	struct list_head list;
+	struct buffer_head *heads;
+	void *data;
+	size_t mapped;		/* length if data is hugetlb mmap, else 0 */
+	size_t huge;		/* bytes on huge pages */
+	unsigned count;
+};
+
+static LIST_HEAD(buffer_chunks);
+static unsigned prealloc_count;	/* buffers in all chunks */
+
+#define HUGEPAGE_SIZE	(2UL << 20)
+#define BUFFER_CHUNK_SIZE	HUGEPAGE_SIZE
+
+/*
+ * Allocate buffer data of chunk. With buffer_hugepages, try 2MB hugetlb
+ * pages first, then 2MB aligned memory advised for transparent huge
+ * pages, so random block access takes fewer TLB misses.
+ */
+static int alloc_chunk_data(struct buffer_chunk *chunk, size_t size)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	chunk->mapped = chunk->huge = 0;
+	if (buffer_hugepages) {
+		size_t len = ALIGN(size, HUGEPAGE_SIZE);
+		void *data = mmap(NULL, len, PROT_READ | PROT_WRITE,
+				  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+				  -1, 0);
+		if (data != MAP_FAILED) {
+			chunk->data = data;
+			chunk->mapped = chunk->huge = len;
+			buffer_stats.huge_bytes += len;
+			return 0;
+		}
+		if (!posix_memalign(&chunk->data, HUGEPAGE_SIZE, len)) {
+			if (!madvise(chunk->data, len, MADV_HUGEPAGE)) {
+				chunk->huge = len;
+				buffer_stats.huge_bytes += len;
 			}
+			return 0;
 		}
-		printf("\n");
-		assert(list_empty(&lru_buffers));
+		/* Fall back to normal pages */
 	}
+	return posix_memalign(&chunk->data, buffer_align, size);
 }
-#else /* !BUFFER_PARANOIA_DEBUG */
 
-static struct buffer_head *prealloc_heads;
-static void *data_pool;
+static void free_chunk_data(struct buffer_chunk *chunk)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	buffer_stats.huge_bytes -= chunk->huge;
+	if (chunk->mapped)
+		munmap(chunk->data, chunk->mapped);
+	else
+		free(chunk->data);
+}
 
-static int preallocate_buffers(unsigned bufsize)
+static int preallocate_chunk(unsigned count)
 {
 	if(DEBUG_MODE_U==1)
 	{
 		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
+	unsigned bufsize = 1 << buffer_bits;
+	struct buffer_chunk *chunk;
 	int i, err;
 
+	chunk = malloc(sizeof(*chunk));
+	if (!chunk) {
+		err = -ENOMEM;
+		goto error;
+	}
+
 	buftrace("Pre-allocating buffers...");
-	prealloc_heads = malloc(max_buffers * sizeof(*prealloc_heads));
-	if (!prealloc_heads) {
+	chunk->heads = malloc(count * sizeof(*chunk->heads));
+	if (!chunk->heads) {
 		printf("Warning: unable to pre-allocate buffers."
 		       " Using on demand allocation for buffers\n");
 		err = -ENOMEM;
-		goto error;
+		goto error_heads;
 	}
 
 	buftrace("Pre-allocating data for buffers...");
-	err = posix_memalign(&data_pool, SECTOR_SIZE, max_buffers * bufsize);
+	err = alloc_chunk_data(chunk, (size_t)count * bufsize);
 	if (err) {
 		printf("Error: unable to allocate space for buffer data: %s\n",
 		       strerror(err));
@@ -782,51 +978,217 @@ static int preallocate_buffers(unsigned bufsize)
 		goto error_memalign;
 	}
 
-	//memset(data_pool, 0xdd, max_buffers*bufsize); /* first time init to deadly data */
-	for (i = 0; i < max_buffers; i++) {
-		prealloc_heads[i] = (struct buffer_head){
-			.data	= data_pool + i*bufsize,
+	//memset(chunk->data, 0xdd, count*bufsize); /* first time init to deadly data */
+	for (i = 0; i < count; i++) {
+		chunk->heads[i] = (struct buffer_head){
+			.data	= chunk->data + (size_t)i*bufsize,
 			.state	= BUFFER_FREED,
-			.lru	= LIST_HEAD_INIT(prealloc_heads[i].lru),
+			.lru	= LIST_HEAD_INIT(chunk->heads[i].lru),
 		};
-		INIT_HLIST_NODE(&prealloc_heads[i].hashlink);
+		INIT_HLIST_NODE(&chunk->heads[i].hashlink);
 
-		list_add_tail(&prealloc_heads[i].link, buffers + BUFFER_FREED);
+		list_add_tail(&chunk->heads[i].link, buffers + BUFFER_FREED);
 	}
+	chunk->count = count;
+	list_add_tail(&chunk->list, &buffer_chunks);
+	prealloc_count += count;
+	buffer_stats.prealloc = prealloc_count;
 
 	return 0; /* sucess on pre-allocation of buffers */
 
 error_memalign:
-	free(prealloc_heads);
+	free(chunk->heads);
+error_heads:
+	free(chunk);
 error:
 	return err;
 }
-#endif /* !BUFFER_PARANOIA_DEBUG */
 
-void init_buffers(struct dev *dev, unsigned poolsize, int debug)
+static int preallocate_buffers(unsigned count)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	unsigned per_chunk = max(BUFFER_CHUNK_SIZE >> buffer_bits, 1UL);
+
+	while (count) {
+		unsigned some = min_t(unsigned, count, per_chunk);
+		int err = preallocate_chunk(some);
+		if (err)
+			return err;
+		count -= some;
+	}
+	return 0;
+}
+
+static int buffer_in_chunk(struct buffer_head *buffer)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct buffer_chunk *chunk;
+
+	list_for_each_entry(chunk, &buffer_chunks, list) {
+		if (buffer >= chunk->heads && buffer < chunk->heads + chunk->count)
+			return 1;
+	}
+	return 0;
+}
+
+static int chunk_unused(struct buffer_chunk *chunk)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	for (unsigned i = 0; i < chunk->count; i++) {
+		if (chunk->heads[i].state != BUFFER_FREED)
+			return 0;
+	}
+	return 1;
+}
+
+/* Free the newest chunks that are entirely unused and not needed */
+static void release_chunks(void)
 {
 	if(DEBUG_MODE_U==1)
 	{
 		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
+	struct buffer_chunk *chunk, *safe;
+
+	list_for_each_entry_safe_reverse(chunk, safe, &buffer_chunks, list) {
+		if (prealloc_count - chunk->count < max_buffers)
+			break;
+		if (!chunk_unused(chunk))
+			continue;
+		for (unsigned i = 0; i < chunk->count; i++)
+			list_del(&chunk->heads[i].link);
+		prealloc_count -= chunk->count;
+		buffer_stats.prealloc = prealloc_count;
+		list_del(&chunk->list);
+		free_chunk_data(chunk);
+		free(chunk->heads);
+		free(chunk);
+	}
+}
+
+/* Give back memory of freed buffers after the pool was shrunk */
+static void release_freed_buffers(void)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct buffer_head *buffer, *safe;
+
+	release_chunks();
+	list_for_each_entry_safe(buffer, safe, buffers + BUFFER_FREED, link) {
+		if (buffer_in_chunk(buffer))
+			continue;
+		__free_buffer(buffer);
+	}
+}
+
+static int set_buffer_limits(unsigned long poolsize, unsigned bits)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	unsigned min_buffers = 100;
+
+	/* Buffer count has to fit in max_buffers */
+	if (poolsize >> bits > UINT_MAX)
+		return -EINVAL;
+
+	max_buffers = max_t(unsigned long, poolsize >> bits, min_buffers);
+	max_evict = max(max_buffers / 10, 1U);
+	return 0;
+}
+
+/*
+ * Ask for huge page backed pool, before init_buffers(). Only the
+ * preallocated pool of debug level 0 can use huge pages.
+ */
+void set_buffer_hugepages(int enable)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	buffer_hugepages = enable;
+}
+
+int init_buffers(struct dev *dev, unsigned long poolsize, int debug)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	int err = set_buffer_limits(poolsize, dev->bits);
+	if (err)
+		return err;
+
 	debug_buffer = debug;
-	INIT_LIST_HEAD(&lru_buffers);
+	buffer_stats = (struct buffer_stats){};
 	for (int i = 0; i < BUFFER_STATES; i++)
 		INIT_LIST_HEAD(buffers + i);
 
-	unsigned bufsize = 1 << dev->bits;
-	max_buffers = poolsize / bufsize;
-	max_evict = max_buffers / 10;
+	buffer_bits = dev->bits;
+	/* O_DIRECT needs buffers aligned to device logical block */
+	buffer_align = max_t(unsigned, SECTOR_SIZE, dev->align);
+	init_buffer_policy(max_buffers);
+
+	/* Caches outlive the pool, may be called again by tests */
+	if (!buffer_head_cachep)
+		buffer_head_cachep = kmem_cache_create("buffer_head",
+			sizeof(struct buffer_head), 0, SLAB_HWCACHE_ALIGN, NULL);
+	if (!bufvec_iov_cachep)
+		bufvec_iov_cachep = kmem_cache_create("bufvec_iov",
+			sizeof(struct iovec) * BUFVEC_IOV_CACHED, 0,
+			SLAB_HWCACHE_ALIGN, NULL);
+	assert(buffer_head_cachep && bufvec_iov_cachep);
+
+	INIT_LIST_HEAD(&buffer_chunks);
+	prealloc_count = 0;
+	if (debug_buffer)
+		atexit(destroy_buffers);
+	else
+		preallocate_buffers(max_buffers);
+	return 0;
+}
 
-	int min_buffers = 100;
-	if (max_buffers < min_buffers)
-		max_buffers = min_buffers;
+/*
+ * Change pool size while buffers are in use. Shrinking evicts clean
+ * buffers first. Dirty or pinned buffers can't be evicted, so pool may
+ * stay above new size until they are released.
+ */
+int resize_buffers(unsigned long poolsize)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	unsigned old = max_buffers;
+	int err;
 
-#ifdef BUFFER_PARANOIA_DEBUG
-	atexit(destroy_buffers);
-#else
-	preallocate_buffers(bufsize);
-#endif
+	err = set_buffer_limits(poolsize, buffer_bits);
+	if (err)
+		return err;
+	if (max_buffers > old) {
+		/* On failure, new_buffer() still allocates on demand */
+		if (!debug_buffer && prealloc_count < max_buffers)
+			preallocate_buffers(max_buffers - prealloc_count);
+	} else if (max_buffers < old) {
+		if (buffer_count > max_buffers)
+			policy->evict(buffer_count - max_buffers);
+		release_freed_buffers();
+	}
+	policy->resize(max_buffers);
+	return 0;
 }
 
 int __tux3_volmap_io(int rw, struct bufvec *bufvec, block_t block,
@@ -875,10 +1237,14 @@ map_t *new_map(struct dev *dev, blockio_t *io)
 	map_t *map = malloc(sizeof(*map)); // error???
 	*map = (map_t){
 		.dev	= dev,
-		.io	= io ? io : dev_blockio
+		.io	= io ? io : dev_blockio,
+		.hash_bits = BUFFER_HASH_MIN_BITS,
 	};
-	for (int i = 0; i < BUFFER_BUCKETS; i++)
-		INIT_HLIST_HEAD(&map->hash[i]);
+	map->hash = alloc_buffer_hash(map->hash_bits);
+	if (!map->hash) {
+		free(map);
+		return NULL;
+	}
 	return map;
 }
 
@@ -888,7 +1254,8 @@ void free_map(map_t *map)
 	{
 		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	for (int i = 0; i < BUFFER_BUCKETS; i++) {
+	buffer_hash_walk_begin(map);
+	for (unsigned i = 0; i < 1U << map->hash_bits; i++) {
 		struct hlist_head *bucket = &map->hash[i];
 		struct buffer_head *buffer;
 		struct hlist_node *n;
@@ -896,8 +1263,14 @@ void free_map(map_t *map)
 		hlist_for_each_entry_safe(buffer, n, bucket, hashlink)
 			evict_buffer(buffer);
 	}
+	assert(!map->hash_count);
+	/* Ghosts are keyed by map pointer, which may be reused */
+	if (policy)
+		policy->forget(map);
+	free(map->hash);
 	free(map);
 }
 
 #include "buffer_writeback.c"
 #include "buffer_fork.c"
+#include "buffer_policy.c"
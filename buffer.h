@@ -12,6 +12,7 @@ static inline unsigned tux3_delta(unsigned delta);
 #include "kernel/tux3_fork.h"
 #include "libklib/list.h"
 #include <sys/uio.h>
+#include <sys/ioctl.h>
 
 #ifdef BUFFER_FOR_TUX3
 /* Maximum delta number (must be power of 2) */
@@ -34,7 +35,11 @@ enum {
 #define BUFFER_STATE_BITS	order_base_2(BUFFER_STATES)
 TUX3_DEFINE_STATE_FNS(unsigned, buf, BUFFER_DIRTY, BUFFER_STATE_BITS, 0);
 
-#define BUFFER_BUCKETS 999
+/*
+ * Each map has own hash, sized to the number of buffers it holds.
+ * Resize is deferred while hash_walk != 0 (somebody is iterating buckets).
+ */
+#define BUFFER_HASH_MIN_BITS 4
 
 // disk io address range
 #ifdef BUFFER_FOR_TUX3
@@ -50,11 +55,48 @@ typedef signed long long	block_t;
 typedef loff_t			block_t;
 #endif
 
-struct dev { unsigned fd, bits; };
+struct iouring;
+/*
+ * ring is NULL for synchronous pread/pwrite. align is I/O alignment
+ * required by O_DIRECT, or 0 if fd goes through page cache.
+ */
+struct dev { unsigned fd, bits; struct iouring *ring; unsigned align; };
 
 struct buffer_head;
 struct bufvec;
 
+/*
+ * Buffer cache counters. Fixed layout, as this is also what
+ * TUX3_IOC_BUFFER_STATS returns from a tux3fuse mount.
+ */
+struct buffer_stats {
+	char policy[8];			/* replacement policy name */
+	u64 buffers, max_buffers;	/* buffers in use, pool size */
+	u64 hits, misses;		/* blockget() lookups */
+	u64 ghost_hits;			/* misses on recently evicted block */
+	u64 evictions;
+	u64 forks;			/* buffers forked by blockdirty() */
+	u64 reads;			/* blocks read by blockread() */
+	u64 readahead;			/* blocks read ahead by filemap */
+	u64 dirty_bytes[BUFFER_DIRTY_STATES];	/* dirty bytes per delta */
+	u64 huge_bytes;			/* pool bytes on huge pages */
+	u64 prealloc;			/* buffers in preallocated chunks */
+};
+
+/* Decompressed stride cache counters, TUX3_IOC_STRIDE_STATS */
+struct stride_cache_stats {
+	u64 bytes, max_bytes;		/* cached stride bytes, limit */
+	u64 hits, misses;		/* lookups of compressed strides */
+	u64 evictions;
+	u64 invalidations;		/* dropped by write or truncate */
+};
+
+#define TUX3_IOC_BUFFER_STATS	_IOR('t', 0x80, struct buffer_stats)
+#define TUX3_IOC_RESIZE_BUFFERS	_IOW('t', 0x81, u64)	/* pool bytes */
+#define TUX3_IOC_STRIDE_STATS	_IOR('t', 0x82, struct stride_cache_stats)
+#define TUX3_IOC_GET_CODEC	_IOR('t', 0x83, u32)	/* TUX3_CODEC_* */
+#define TUX3_IOC_SET_CODEC	_IOW('t', 0x84, u32)
+
 typedef int (blockio_t)(int rw, struct bufvec *bufvec);
 
 struct map {
@@ -63,7 +105,9 @@ struct map {
 #endif
 	struct dev *dev;
 	blockio_t *io;
-	struct hlist_head hash[BUFFER_BUCKETS];
+	struct hlist_head *hash;
+	unsigned hash_bits, hash_count, hash_walk;
+	unsigned ghost_count;	/* policy ghosts remembering this map */
 };
 
 typedef struct map map_t;
@@ -74,6 +118,7 @@ struct buffer_head {
 	struct list_head link;
 	struct list_head lru; /* used for LRU list and the free list */
 	unsigned count, state;
+	unsigned lru_list; /* which replacement policy list lru is on */
 	block_t index;
 	void *data;
 };
@@ -154,7 +199,7 @@ void get_bh(struct buffer_head *buffer);
 void blockput_free(struct sb *sb, struct buffer_head *buffer);
 void blockput_free_unify(struct sb *sb, struct buffer_head *buffer);
 void blockput(struct buffer_head *buffer);
-unsigned buffer_hash(block_t block);
+unsigned buffer_hash(map_t *map, block_t block);
 struct buffer_head *peekblk(map_t *map, block_t block);
 struct buffer_head *blockget(map_t *map, block_t block);
 struct buffer_head *blockread(map_t *map, block_t block);
@@ -162,29 +207,59 @@ void insert_buffer_hash(struct buffer_head *buffer);
 void remove_buffer_hash(struct buffer_head *buffer);
 void truncate_buffers_range(map_t *map, loff_t lstart, loff_t lend);
 void invalidate_buffers(map_t *map);
-void init_buffers(struct dev *dev, unsigned poolsize, int debug);
+int init_buffers(struct dev *dev, unsigned long poolsize, int debug);
+int resize_buffers(unsigned long poolsize);
+void set_buffer_hugepages(int enable);
+unsigned dirty_buffer_count(void);
+void get_buffer_stats(struct buffer_stats *stats);
+void count_reads(unsigned blocks);
+void count_readahead(unsigned blocks);
+unsigned max_buffer_count(void);
 int __tux3_volmap_io(int rw, struct bufvec *bufvec, block_t block,
 		     unsigned count);
 int dev_errio(int rw, struct bufvec *bufvec);
 map_t *new_map(struct dev *dev, blockio_t *io);
 void free_map(map_t *map);
 
+/* buffer_policy.c */
+#define BUFFER_LRU_LISTS	2	/* resident lists a policy can use */
+
+/* Replacement policy, chooses which clean buffers to reclaim */
+struct buffer_policy {
+	const char *name;
+	void (*init)(unsigned nr_buffers);
+	void (*insert)(struct buffer_head *buffer);	/* hashed on miss */
+	void (*access)(struct buffer_head *buffer);	/* hit by blockget */
+	void (*remove)(struct buffer_head *buffer);	/* unhashed */
+	unsigned (*evict)(unsigned nr);		/* reclaim up to nr */
+	void (*resize)(unsigned nr_buffers);	/* pool was resized */
+	void (*forget)(map_t *map);		/* map is about to be freed */
+	void (*exit)(void);
+};
+
+int set_buffer_policy(const char *name);
+
 /* buffer_writeback.c */
-/* Helper for waiting I/O (stub) */
+/* Helper for waiting I/O (only dev->ring I/O is asynchronous) */
 struct iowait {
+	struct iouring *ring;	/* ring I/O was queued to */
+	unsigned inflight;	/* count of in-flight I/O */
+	int err;		/* first I/O error */
 };
 
 /* I/O completion callback */
 typedef void (*bufvec_end_io_t)(struct buffer_head *buffer, int err);
 
+/* bufvec_io() takes iovec arrays up to this size from a slab cache */
+#define BUFVEC_IOV_CACHED	64
+
 /* Helper for buffer vector I/O */
 struct bufvec {
 	struct list_head *buffers;	/* The dirty buffers for this delta */
 	struct list_head contig;	/* One logical contiguous range */
 	unsigned contig_count;		/* Count of contiguous buffers */
-	struct list_head compress;
+	struct list_head compress;	/* Stride blocks freed by compression */
 	unsigned compress_count;
-	block_t global_index;
 	struct tux3_iattr_data *idata;	/* inode attrs for write */
 	map_t *map;			/* map for dirty buffers */
 
@@ -193,6 +268,37 @@ struct bufvec {
 	bufvec_end_io_t end_io;
 };
 
+/* Stride handed to the compression thread pool (compression.c) */
+struct compress_job {
+	struct list_head buffers;	/* stride buffers, in index order */
+	unsigned count;			/* count of stride buffers */
+	block_t index;			/* first block of stride */
+	struct sb *sb;
+	struct workspace *workspace;	/* compressed output, once done */
+	unsigned out_len;		/* compressed bytes */
+	unsigned out_blocks;		/* blocks to write, 0 to write raw */
+	unsigned codec;			/* TUX3_CODEC_* to compress with */
+	int level;			/* codec level */
+	int skip;			/* backing off, don't try to compress */
+	int err;
+	int done;			/* set under pool lock */
+	struct list_head queue;		/* link of pool queue */
+};
+
+int compress_stride(struct bufvec *bufvec);
+int compress_job_init(struct compress_job *job, struct bufvec *bufvec);
+void queue_compress_job(struct compress_job *job);
+int finish_compress_job(struct compress_job *job, struct bufvec *bufvec);
+void cancel_compress_job(struct compress_job *job, struct bufvec *bufvec);
+void set_compress_threads(int nr);
+void set_compress_min_saving(unsigned percent);
+int set_compress_codec(const char *name, int level);
+int compress_codec_id(const char *name);
+const char *compress_codec_name(unsigned codec);
+int compress_threads(void);
+void set_stride_cache_size(unsigned long bytes);
+void get_stride_cache_stats(struct stride_cache_stats *stats);
+
 static inline struct inode *bufvec_inode(struct bufvec *bufvec)
 {
 	return bufvec->map->inode;
@@ -234,6 +340,8 @@ void bufvec_complete_without_io(struct bufvec *bufvec, unsigned count);
 int bufvec_contig_add(struct bufvec *bufvec, struct buffer_head *buffer);
 int flush_list(map_t *map, struct tux3_iattr_data *idata,
 	       struct list_head *head);
+int dev_init_uring(struct dev *dev, unsigned depth);
+void dev_exit_uring(struct dev *dev);
 
 /* block_fork.c */
 static inline int buffer_forked(struct buffer_head *buffer)
@@ -35,6 +35,7 @@ struct buffer_head *blockdirty(struct buffer_head *buffer, unsigned newdelta)
 		struct buffer_head *clone = new_buffer(map);
 		if (IS_ERR(clone))
 			return clone;
+		buffer_stats.forks++;
 		/* Create the cloned buffer */
 		memcpy(bufdata(clone), bufdata(buffer), bufsize(buffer));
 		clone->index = buffer->index;
@@ -61,11 +62,18 @@ int bufferfork_to_invalidate(map_t *map, struct buffer_head *buffer)
 		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
 	unsigned delta = tux3_inode_delta(map->inode);
+
+	if (buffer_can_modify(buffer, delta))
+		return 0;
+
 	/*
-	 * The userland shouldn't need to buffer fork on truncate
-	 * path, because no async backend.  So, just make sure it.
+	 * The buffer is dirty for the delta the flusher thread is
+	 * writing. Like blockdirty(), just remove it from the hash, and
+	 * the backend frees it at I/O completion with the refcount taken
+	 * here. See clear_buffer_dirty_for_endio().
 	 */
-	assert(buffer_can_modify(buffer, delta));
+	get_bh(buffer);
+	remove_buffer_hash(buffer);
 
-	return 0;
+	return 1;
 }
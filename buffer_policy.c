@@ -0,0 +1,453 @@
+/*
+ * Buffer replacement policy
+ *
+ * Picks which clean, unpinned buffers to reclaim when the pool is full.
+ * "lru" is the old single list. "arc" is Adaptive Replacement Cache
+ * (Megiddo & Modha): T1 holds buffers seen once, T2 buffers seen twice
+ * or more, and ghost lists B1/B2 remember recently evicted blocks to
+ * adapt target size of T1. So a big sequential scan only cycles
+ * through T1 and leaves the hot working set in T2 alone.
+ *
+ * Metadata (inum < TUX_NORMAL_INO: bitmap, volmap with itree/dtree
+ * nodes, etc.) goes to T2 directly, so it is only pushed out by other
+ * frequently used blocks, not by a streaming file read.
+ */
+
+static int buffer_is_metadata(struct buffer_head *buffer)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct inode *inode = buffer->map->inode;
+	return inode && tux_inode(inode)->inum < TUX_NORMAL_INO;
+}
+
+/* Reclaim up to nr buffers from head (LRU end) of list */
+static unsigned evict_list(struct list_head *list, unsigned nr,
+			   void (*evicted)(map_t *map, block_t index))
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct buffer_head *victim, *safe;
+	unsigned count = 0;
+
+	if (!nr)
+		return 0;
+	list_for_each_entry_safe(victim, safe, list, lru) {
+		map_t *map = victim->map;
+		block_t index = victim->index;
+
+		if (reclaim_buffer(victim)) {
+			/* victim may be freed already */
+			if (evicted)
+				evicted(map, index);
+			if (++count == nr)
+				break;
+		}
+	}
+	buffer_stats.evictions += count;
+	return count;
+}
+
+/*
+ * LRU policy
+ */
+
+static void lru_init(unsigned nr_buffers)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+}
+
+static void lru_insert(struct buffer_head *buffer)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	list_add_tail(&buffer->lru, &lru_buffers[0]);
+}
+
+static void lru_access(struct buffer_head *buffer)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	list_move_tail(&buffer->lru, &lru_buffers[0]);
+}
+
+static void lru_remove(struct buffer_head *buffer)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	list_del_init(&buffer->lru);
+}
+
+static unsigned lru_evict(unsigned nr)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	return evict_list(&lru_buffers[0], nr, NULL);
+}
+
+static void lru_forget(map_t *map)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+}
+
+static void lru_exit(void)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+}
+
+static const struct buffer_policy lru_policy = {
+	.name	= "lru",
+	.init	= lru_init,
+	.insert	= lru_insert,
+	.access	= lru_access,
+	.remove	= lru_remove,
+	.evict	= lru_evict,
+	.resize	= lru_init,
+	.forget	= lru_forget,
+	.exit	= lru_exit,
+};
+
+/*
+ * ARC policy
+ */
+
+enum { ARC_T1, ARC_T2, ARC_B1, ARC_B2, ARC_LISTS };
+
+/* Remembers (map, index) of evicted buffer. map is only used as key. */
+struct arc_ghost {
+	struct hlist_node hashlink;
+	struct list_head lru;
+	map_t *map;
+	block_t index;
+	unsigned list;
+};
+
+static struct {
+	unsigned size[ARC_LISTS];	/* length of T1, T2, B1, B2 */
+	unsigned target;		/* target size of T1 ("p") */
+	unsigned cache;			/* number of buffers ("c") */
+	struct list_head ghost[2];	/* B1, B2 */
+	struct list_head ghost_free;
+	struct arc_ghost *ghosts;
+	struct hlist_head *hash;
+	unsigned hash_bits;
+} arc;
+
+static unsigned arc_ghost_hash(map_t *map, block_t index)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	return hash_64(index ^ (unsigned long)map, arc.hash_bits);
+}
+
+static struct arc_ghost *arc_ghost_lookup(map_t *map, block_t index)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct hlist_head *bucket = arc.hash + arc_ghost_hash(map, index);
+	struct arc_ghost *ghost;
+
+	hlist_for_each_entry(ghost, bucket, hashlink) {
+		if (ghost->map == map && ghost->index == index)
+			return ghost;
+	}
+	return NULL;
+}
+
+static void arc_ghost_del(struct arc_ghost *ghost)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	arc.size[ghost->list]--;
+	ghost->map->ghost_count--;
+	hlist_del_init(&ghost->hashlink);
+	list_move(&ghost->lru, &arc.ghost_free);
+}
+
+/* Remember evicted buffer in B1 or B2, |T1|+|B1| and |B1|+|B2| <= c */
+static void arc_ghost_add(map_t *map, block_t index, unsigned list)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct list_head *ghosts = &arc.ghost[list - ARC_B1];
+	struct arc_ghost *ghost;
+
+	if (list == ARC_B1 && arc.size[ARC_T1] + arc.size[ARC_B1] >= arc.cache) {
+		if (list_empty(ghosts))
+			return;
+		arc_ghost_del(list_entry(ghosts->next, struct arc_ghost, lru));
+	}
+	if (list_empty(&arc.ghost_free)) {
+		/* Drop oldest ghost from the longer list */
+		unsigned from = arc.size[ARC_B1] > arc.size[ARC_B2] ? 0 : 1;
+		arc_ghost_del(list_entry(arc.ghost[from].next, struct arc_ghost, lru));
+	}
+
+	ghost = list_entry(arc.ghost_free.next, struct arc_ghost, lru);
+	ghost->map = map;
+	ghost->index = index;
+	ghost->list = list;
+	map->ghost_count++;
+	hlist_add_head(&ghost->hashlink, arc.hash + arc_ghost_hash(map, index));
+	list_move_tail(&ghost->lru, ghosts);
+	arc.size[list]++;
+}
+
+static void arc_evicted_t1(map_t *map, block_t index)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	arc_ghost_add(map, index, ARC_B1);
+}
+
+static void arc_evicted_t2(map_t *map, block_t index)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	arc_ghost_add(map, index, ARC_B2);
+}
+
+/* Drop ghosts of map, or all ghosts if map is NULL */
+static void arc_ghosts_drop(map_t *map)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct arc_ghost *ghost, *safe;
+
+	for (int i = 0; i < 2; i++) {
+		list_for_each_entry_safe(ghost, safe, &arc.ghost[i], lru) {
+			if (!map || ghost->map == map)
+				arc_ghost_del(ghost);
+		}
+	}
+}
+
+static void arc_forget(map_t *map)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	if (map->ghost_count)
+		arc_ghosts_drop(map);
+	assert(!map->ghost_count);
+}
+
+static void arc_exit(void)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	if (arc.ghosts)
+		arc_ghosts_drop(NULL);
+	free(arc.ghosts);
+	free(arc.hash);
+	arc.ghosts = NULL;
+	arc.hash = NULL;
+}
+
+static void arc_init(unsigned nr_buffers)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	arc_exit();
+	memset(arc.size, 0, sizeof(arc.size));
+	arc.target = 0;
+	arc.cache = nr_buffers;
+	INIT_LIST_HEAD(&arc.ghost[0]);
+	INIT_LIST_HEAD(&arc.ghost[1]);
+	INIT_LIST_HEAD(&arc.ghost_free);
+
+	/* Without ghosts, this is still scan resistant, just not adaptive */
+	arc.hash_bits = order_base_2(nr_buffers);
+	arc.ghosts = malloc(nr_buffers * sizeof(*arc.ghosts));
+	arc.hash = malloc(sizeof(*arc.hash) << arc.hash_bits);
+	if (!arc.ghosts || !arc.hash) {
+		printf("Warning: unable to allocate ARC ghost lists\n");
+		arc_exit();
+		return;
+	}
+	for (unsigned i = 0; i < 1U << arc.hash_bits; i++)
+		INIT_HLIST_HEAD(&arc.hash[i]);
+	for (unsigned i = 0; i < nr_buffers; i++) {
+		INIT_HLIST_NODE(&arc.ghosts[i].hashlink);
+		list_add_tail(&arc.ghosts[i].lru, &arc.ghost_free);
+	}
+}
+
+static void arc_insert(struct buffer_head *buffer)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct arc_ghost *ghost = NULL;
+	unsigned list = ARC_T1;
+
+	if (arc.ghosts)
+		ghost = arc_ghost_lookup(buffer->map, buffer->index);
+	if (ghost) {
+		/* Recently evicted: adapt T1 target towards the list it hit */
+		unsigned b1 = max(arc.size[ARC_B1], 1U);
+		unsigned b2 = max(arc.size[ARC_B2], 1U);
+
+		if (ghost->list == ARC_B1)
+			arc.target = min(arc.target + max(b2 / b1, 1U), arc.cache);
+		else
+			arc.target -= min(arc.target, max(b1 / b2, 1U));
+		arc_ghost_del(ghost);
+		buffer_stats.ghost_hits++;
+		list = ARC_T2;
+	} else if (buffer_is_metadata(buffer))
+		list = ARC_T2;
+
+	buffer->lru_list = list;
+	list_add_tail(&buffer->lru, &lru_buffers[list]);
+	arc.size[list]++;
+}
+
+static void arc_access(struct buffer_head *buffer)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	/* Second hit promotes to frequent list */
+	arc.size[buffer->lru_list]--;
+	buffer->lru_list = ARC_T2;
+	arc.size[ARC_T2]++;
+	list_move_tail(&buffer->lru, &lru_buffers[ARC_T2]);
+}
+
+static void arc_remove(struct buffer_head *buffer)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	arc.size[buffer->lru_list]--;
+	list_del_init(&buffer->lru);
+}
+
+/* Ghosts are sized by pool, so resize forgets them and starts over */
+static void arc_resize(unsigned nr_buffers)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	unsigned t1 = arc.size[ARC_T1], t2 = arc.size[ARC_T2];
+	unsigned target = min(arc.target, nr_buffers);
+
+	arc_init(nr_buffers);
+	arc.size[ARC_T1] = t1;
+	arc.size[ARC_T2] = t2;
+	arc.target = target;
+}
+
+static unsigned arc_evict(unsigned nr)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	void (*evicted_t1)(map_t *, block_t) = NULL;
+	void (*evicted_t2)(map_t *, block_t) = NULL;
+	unsigned from_t1 = 0, count;
+
+	if (arc.ghosts) {
+		evicted_t1 = arc_evicted_t1;
+		evicted_t2 = arc_evicted_t2;
+	}
+	if (arc.size[ARC_T1] > arc.target)
+		from_t1 = min(nr, arc.size[ARC_T1] - arc.target);
+
+	/* Shrink T1 to target, then T2, then T1 if T2 was all pinned */
+	count = evict_list(&lru_buffers[ARC_T1], from_t1, evicted_t1);
+	count += evict_list(&lru_buffers[ARC_T2], nr - count, evicted_t2);
+	count += evict_list(&lru_buffers[ARC_T1], nr - count, evicted_t1);
+	return count;
+}
+
+static const struct buffer_policy arc_policy = {
+	.name	= "arc",
+	.init	= arc_init,
+	.insert	= arc_insert,
+	.access	= arc_access,
+	.remove	= arc_remove,
+	.evict	= arc_evict,
+	.resize	= arc_resize,
+	.forget	= arc_forget,
+	.exit	= arc_exit,
+};
+
+static const struct buffer_policy *buffer_policies[] = {
+	&arc_policy, &lru_policy,
+};
+
+/* Select replacement policy by name, before init_buffers() */
+int set_buffer_policy(const char *name)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	for (int i = 0; i < ARRAY_SIZE(buffer_policies); i++) {
+		if (!strcmp(buffer_policies[i]->name, name)) {
+			policy = buffer_policies[i];
+			return 0;
+		}
+	}
+	return -EINVAL;
+}
+
+static void init_buffer_policy(unsigned nr_buffers)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	if (!policy)
+		policy = buffer_policies[0];
+	for (int i = 0; i < BUFFER_LRU_LISTS; i++)
+		INIT_LIST_HEAD(&lru_buffers[i]);
+	policy->init(nr_buffers);
+}
@@ -1,9 +1,9 @@
 /*
  * Write back buffers
  */
-extern int compress_stride(struct bufvec*);
+#include "diskio.h"
 /*
- * Helper for waiting I/O (stub)
+ * Helper for waiting I/O
  */
 
 void tux3_iowait_init(struct iowait *iowait)
@@ -12,7 +12,7 @@ void tux3_iowait_init(struct iowait *iowait)
 	{
 		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	
+	*iowait = (struct iowait){};
 }
 
 void tux3_iowait_wait(struct iowait *iowait)
@@ -21,7 +21,74 @@ void tux3_iowait_wait(struct iowait *iowait)
 	{
 		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	
+	while (iowait->inflight) {
+		/* Wait without sb->fs_lock, but ->end_io runs under it */
+		struct sb *sb = tux3_flusher_unlock();
+		int err = iouring_wait(iowait->ring);
+		tux3_flusher_relock(sb);
+		if (!err)
+			err = iouring_reap(iowait->ring, 0);
+		if (err < 0) {
+			tux3_err(NULL, "io_uring reap failed: %d", err);
+			break;
+		}
+	}
+	/* FIXME: error handling */
+	if (iowait->err)
+		tux3_err(NULL, "async write failed: %d", iowait->err);
+}
+
+/* In-flight write of contiguous buffers */
+struct bufvec_async {
+	struct iowait *iowait;
+	bufvec_end_io_t end_io;
+	unsigned count;
+	size_t bytes;
+	struct buffer_head **buffers;
+	struct iovec iov[];
+};
+
+static void bufvec_async_done(void *data, int res)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct bufvec_async *async = data;
+	int err = res < 0 ? res : (res != async->bytes ? -EIO : 0);
+	unsigned i;
+
+	for (i = 0; i < async->count; i++)
+		async->end_io(async->buffers[i], err);
+
+	if (err && !async->iowait->err)
+		async->iowait->err = err;
+	async->iowait->inflight--;
+	free(async);
+}
+
+int dev_init_uring(struct dev *dev, unsigned depth)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	dev->ring = iouring_init(depth, bufvec_async_done);
+	if (!dev->ring)
+		return -errno;
+	return 0;
+}
+
+void dev_exit_uring(struct dev *dev)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	if (dev->ring) {
+		iouring_exit(dev->ring);
+		dev->ring = NULL;
+	}
 }
 
 /*
@@ -43,7 +110,6 @@ void bufvec_init(struct bufvec *bufvec, map_t *map,
 	INIT_LIST_HEAD(&bufvec->contig);
 	INIT_LIST_HEAD(&bufvec->compress);
 	INIT_LIST_HEAD(&bufvec->for_io);
-	bufvec->global_index = 0;
 	bufvec->buffers		= head;
 	bufvec->contig_count	= 0;
 	bufvec->compress_count  = 0;
@@ -127,6 +193,61 @@ static struct buffer_head *bufvec_next_buffer(struct bufvec *bufvec)
 	return NULL;
 }
 
+/* Is this a file data whose strides are written by compress_stride()? */
+static inline int bufvec_compressed(struct bufvec *bufvec)
+{
+	return is_compressed_file(bufvec_inode(bufvec));
+}
+
+/*
+ * Queue write of count buffers from contig to dev->ring. Buffers are
+ * off any list until the completion calls ->end_io.
+ */
+static int bufvec_io_async(struct bufvec *bufvec, block_t physical,
+			   unsigned count)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct sb *sb = tux_sb(bufvec_inode(bufvec)->i_sb);
+	struct iowait *iowait = sb->iowait;
+	struct bufvec_async *async;
+	unsigned i;
+	int err;
+
+	async = malloc(sizeof(*async) +
+		       count * (sizeof(struct iovec) + sizeof(struct buffer_head *)));
+	if (async == NULL)
+		return -ENOMEM;
+	async->iowait = iowait;
+	async->end_io = bufvec->end_io;
+	async->count = count;
+	async->bytes = 0;
+	async->buffers = (void *)(async->iov + count);
+
+	for (i = 0; i < count; i++) {
+		struct buffer_head *buffer = bufvec_contig_buf(bufvec);
+
+		list_del_init(&buffer->link);
+		bufvec->contig_count--;
+
+		async->buffers[i] = buffer;
+		async->iov[i].iov_base = bufdata(buffer);
+		async->iov[i].iov_len = bufsize(buffer);
+		async->bytes += bufsize(buffer);
+	}
+
+	iowait->ring = sb_dev(sb)->ring;
+	iowait->inflight++;
+	err = iouring_queue(sb_dev(sb)->ring, sb_dev(sb)->fd, async->iov, count,
+			    1, physical << sb->blockbits, async);
+	if (err)
+		bufvec_async_done(async, err);
+
+	return err;
+}
+
 /*
  * Prepare and submit I/O for specified range.
  *
@@ -144,13 +265,36 @@ int bufvec_io(int rw, struct bufvec *bufvec, block_t physical, unsigned count)
 		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
 	struct sb *sb = tux_sb(bufvec_inode(bufvec)->i_sb);
+	struct sb *unlocked = NULL;
 	struct iovec *iov;
 	unsigned i, iov_count;
 	int err;
 
 	assert(count <= bufvec_contig_count(bufvec));
 
-	iov = malloc(sizeof(*iov) * count);
+	/*
+	 * Backend writes go to dev->ring if there is one, and are waited
+	 * by tux3_iowait_wait() before the commit block. Reads and
+	 * compressed strides stay synchronous.
+	 */
+	if ((rw & WRITE) && sb_dev(sb)->ring && sb->iowait &&
+	    tux3_under_backend(sb) && !bufvec_compressed(bufvec)) {
+		while (count) {
+			unsigned chunk = min(count, (unsigned)UIO_MAXIOV);
+			err = bufvec_io_async(bufvec, physical, chunk);
+			if (err)
+				return err;
+			physical += chunk;
+			count -= chunk;
+		}
+		return 0;
+	}
+
+	/* Usual extent fits in a cached array, huge ones go to malloc */
+	if (count <= BUFVEC_IOV_CACHED)
+		iov = kmem_cache_alloc(bufvec_iov_cachep, GFP_NOFS);
+	else
+		iov = malloc(sizeof(*iov) * count);
 	if (iov == NULL)
 		return -ENOMEM;
 	iov_count = 0;
@@ -169,11 +313,23 @@ int bufvec_io(int rw, struct bufvec *bufvec, block_t physical, unsigned count)
 	}
 	assert(i > 0);
 
+	/*
+	 * The flusher writes without sb->fs_lock. Buffers on ->for_io
+	 * are dirty in the frozen delta, so frontend forks them instead
+	 * of modifying. Compressed strides are excluded, because the
+	 * cached buffers hold compressed data until ->end_io.
+	 */
+	if ((rw & WRITE) && !bufvec_compressed(bufvec))
+		unlocked = tux3_flusher_unlock();
 	err = devio_vec(rw, sb_dev(sb), physical << sb->blockbits,
 			iov, iov_count);
+	tux3_flusher_relock(unlocked);
 	bufvec_io_done(bufvec, err);
 
-	free(iov);
+	if (count <= BUFVEC_IOV_CACHED)
+		kmem_cache_free(bufvec_iov_cachep, iov);
+	else
+		free(iov);
 
 	return 0;
 }
@@ -304,9 +460,6 @@ static int bufvec_contig_collect(struct bufvec *bufvec)
 	}
 
 	do {
-		/* Check contig_count limit */
-		if (bufvec_contig_count(bufvec) == (is_compressed_file(bufvec_inode(bufvec))?COMPRESSION_STRIDE_LEN:UINT_MAX))
-			break;
 		bufvec_buffer_move_to_contig(bufvec, buffer);
 
 		if (list_empty(bufvec->buffers))
@@ -315,29 +468,16 @@ static int bufvec_contig_collect(struct bufvec *bufvec)
 		buffer = buffers_entry(bufvec->buffers->next);
 		last_index = next_index;
 		next_index = bufindex(buffer);
-/*		if(tux_inode(bufvec_inode(bufvec))->inum >= 64)
-		{
-			int i;
-			printf("DO YOU WANT TO COMPRESS?");
-			scanf("%d",&i);
-			if(i==1)
-			{
-				(tux_inode(bufvec_inode(bufvec)))->is_compressed=1;
-				tux3_mark_inode_dirty(bufvec_inode(bufvec));
-				//iput(bufvec_inode(bufvec));
-			}
-		}
-*/
+		/* Compressed range never crosses a stride */
+		if (bufvec_compressed(bufvec) &&
+		    next_index % COMPRESSION_STRIDE_LEN == 0)
+			break;
 	/* If next buffer is fully outside i_size, clear dirty */
 		if (next_index >= outside_block) {
 			bufvec_cancel_dirty_outside(bufvec);
 			break;
 		}
 	} while (last_index == next_index - 1);
-	
-		
-	if(tux_inode(bufvec_inode(bufvec))->inum >= 64 && is_compressed_file(bufvec_inode(bufvec)))
-	        compress_stride(bufvec);
 
         return !!bufvec_contig_count(bufvec);
 }
@@ -359,6 +499,72 @@ static int buffer_index_cmp(void *priv, struct list_head *a,
 	return 0;
 }
 
+/*
+ * Flush strides of compressed file. Up to depth strides are queued to
+ * compression threads ahead of the one being written, and written in
+ * index order as they complete. A stride compress_job_init() refuses is
+ * held on raw until the strides before it are written.
+ */
+#define COMPRESS_INFLIGHT	64
+
+static int flush_compressed(map_t *map, struct bufvec *bufvec)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct compress_job jobs[COMPRESS_INFLIGHT];
+	unsigned depth = min(2 * compress_threads() + 1, COMPRESS_INFLIGHT);
+	unsigned head = 0, tail = 0, raw_count = 0;
+	LIST_HEAD(raw);
+	int err = 0;
+
+	while (1) {
+		/* Queue strides ahead */
+		while (!raw_count && tail - head < depth &&
+		       !list_empty(bufvec->buffers)) {
+			struct compress_job *job = &jobs[tail % COMPRESS_INFLIGHT];
+
+			if (!bufvec_contig_collect(bufvec))
+				continue;
+			if (compress_job_init(job, bufvec)) {
+				list_splice_init(&bufvec->contig, &raw);
+				raw_count = bufvec->contig_count;
+				bufvec->contig_count = 0;
+				break;
+			}
+			queue_compress_job(job);
+			tail++;
+		}
+
+		/* Oldest stride, then the one compress_job_init() refused */
+		if (head != tail) {
+			err = finish_compress_job(&jobs[head++ % COMPRESS_INFLIGHT],
+						  bufvec);
+			if (err)
+				goto error;
+		} else if (raw_count) {
+			list_splice_init(&raw, &bufvec->contig);
+			bufvec->contig_count = raw_count;
+			raw_count = 0;
+		} else if (!bufvec_contig_count(bufvec))
+			break;
+
+		while (bufvec_contig_count(bufvec)) {
+			err = map->io(WRITE, bufvec);
+			if (err)
+				goto error;
+		}
+	}
+	return 0;
+
+error:
+	while (head != tail)
+		cancel_compress_job(&jobs[head++ % COMPRESS_INFLIGHT], bufvec);
+	list_splice_init(&raw, bufvec->buffers);
+	return err;
+}
+
 /*
  * Flush buffers in head
  */
@@ -382,6 +588,11 @@ int flush_list(map_t *map, struct tux3_iattr_data *idata,
 	/* Sort by bufindex() */
 	list_sort(NULL, head, buffer_index_cmp);
 
+	if (bufvec_compressed(&bufvec)) {
+		err = flush_compressed(map, &bufvec);
+		goto out;
+	}
+
 	while (bufvec_next_buffer(&bufvec)) {
 		/* Collect contiguous buffer range */
 		if (bufvec_contig_collect(&bufvec)) {
@@ -391,7 +602,7 @@ int flush_list(map_t *map, struct tux3_iattr_data *idata,
 				break;
 		}
 	}
-
+out:
 	bufvec_free(&bufvec);
 
 	return err;
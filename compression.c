@@ -3,162 +3,1379 @@
 
 //#include "RLE.h"
 #include <lzo/lzo1x.h>
+#include <zlib.h>
 
+/* Worst case of lzo1x output, same as linux/lzo.h */
+#define lzo1x_worst_compress(x) ((x) + ((x) / 16) + 64 + 3)
+
+/*
+ * Strides of a compressed file. Stride s covers the logical blocks
+ * [s * COMPRESSION_STRIDE_LEN, (s + 1) * COMPRESSION_STRIDE_LEN) and is
+ * mapped by the dtree at that same range, so the dtree is the stride
+ * map and any stride is found by one btree lookup. By the blocks the
+ * dtree maps from the start of the stride:
+ *
+ *   none            - hole, reads as zeros
+ *   all             - raw, stored as is
+ *   some            - compressed, the first block starts with a
+ *                     stride_header and the rest of range is a hole
+ *
+ * Blocks of a stride are counted up to i_size, so a stride is always
+ * rewritten as a whole when write or truncate changes it (see
+ * tux3_prepare_write()).
+ */
+#define STRIDE_MAGIC	0x7353	/* "sS" */
+
+struct stride_header {
+	__be16 magic;
+	u8 codec;		/* TUX3_CODEC_* */
+	u8 flags;
+	__be32 bytes;		/* compressed bytes after header */
+} __packed;
+
+/*
+ * Stride codecs. Strides record the codec they were compressed with,
+ * so a file may mix codecs and a codec can be added without format
+ * change. Compressors get workspace->mem of workspace_size() bytes and
+ * return -ENOSPC if output doesn't fit in *out_len, which leaves the
+ * stride raw. Codec of new strides is the inode one, or the mount
+ * default (compress_codec, compress_level).
+ */
+struct stride_codec {
+	const char *name;
+	size_t (*workspace_size)(size_t bytes);
+	size_t (*bound)(size_t bytes);		/* worst case output */
+	int (*compress)(const void *in, size_t in_len, void *out,
+			size_t *out_len, void *mem, int level);
+	int (*decompress)(const void *in, size_t in_len, void *out,
+			  size_t *out_len, void *mem);
+};
+
+static size_t lzo_workspace_size(size_t bytes)
+{
+	return LZO1X_MEM_COMPRESS;
+}
+
+static size_t lzo_bound(size_t bytes)
+{
+	return lzo1x_worst_compress(bytes);
+}
+
+static int lzo_compress(const void *in, size_t in_len, void *out,
+			size_t *out_len, void *mem, int level)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printf("%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	lzo_uint len = 0;
+
+	/* Output is only bounded by the worst case */
+	if (*out_len < lzo1x_worst_compress(in_len))
+		return -ENOSPC;
+	if (lzo1x_1_compress(in, in_len, out, &len, mem) != LZO_E_OK)
+		return -EIO;
+	*out_len = len;
+	return 0;
+}
+
+static int lzo_decompress(const void *in, size_t in_len, void *out,
+			  size_t *out_len, void *mem)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printf("%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	lzo_uint len = *out_len;
+
+	if (lzo1x_decompress_safe(in, in_len, out, &len, NULL) != LZO_E_OK)
+		return -EIO;
+	*out_len = len;
+	return 0;
+}
+
+/*
+ * Raw deflate, without zlib header and checksum. zlib allocates from
+ * workspace->mem instead of malloc, sized for these parameters.
+ */
+#define DEFLATE_WINDOW_BITS	15
+#define DEFLATE_MEM_LEVEL	8
+
+struct zlib_arena {
+	char *next, *end;
+};
+
+static voidpf zlib_alloc(voidpf opaque, uInt items, uInt size)
+{
+	struct zlib_arena *arena = opaque;
+	size_t bytes = ALIGN((size_t)items * size, 16);
+	void *p;
+
+	if (bytes > arena->end - arena->next)
+		return Z_NULL;
+	p = arena->next;
+	arena->next += bytes;
+	return p;
+}
+
+static void zlib_free(voidpf opaque, voidpf address)
+{
+}
+
+static size_t deflate_workspace_size(size_t bytes)
+{
+	/* window, prev, head, pending_buf and slack for state */
+	return (1 << (DEFLATE_WINDOW_BITS + 2)) +
+		(1 << (DEFLATE_MEM_LEVEL + 9)) + (32 << 10);
+}
+
+static size_t deflate_bound(size_t bytes)
+{
+	return compressBound(bytes);
+}
+
+static int deflate_compress(const void *in, size_t in_len, void *out,
+			    size_t *out_len, void *mem, int level)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printf("%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct zlib_arena arena = {
+		.next	= mem,
+		.end	= mem + deflate_workspace_size(in_len),
+	};
+	z_stream strm = {
+		.next_in	= (Bytef *)in,
+		.avail_in	= in_len,
+		.next_out	= out,
+		.avail_out	= *out_len,
+		.zalloc		= zlib_alloc,
+		.zfree		= zlib_free,
+		.opaque		= &arena,
+	};
+	int ret;
+
+	ret = deflateInit2(&strm, level, Z_DEFLATED, -DEFLATE_WINDOW_BITS,
+			   DEFLATE_MEM_LEVEL, Z_DEFAULT_STRATEGY);
+	if (ret != Z_OK)
+		return ret == Z_MEM_ERROR ? -ENOMEM : -EINVAL;
+	ret = deflate(&strm, Z_FINISH);
+	*out_len = strm.total_out;
+	deflateEnd(&strm);
+
+	if (ret == Z_STREAM_END)
+		return 0;
+	return ret == Z_OK || ret == Z_BUF_ERROR ? -ENOSPC : -EIO;
+}
+
+static int deflate_decompress(const void *in, size_t in_len, void *out,
+			      size_t *out_len, void *mem)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printf("%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct zlib_arena arena = {
+		.next	= mem,
+		.end	= mem + deflate_workspace_size(*out_len),
+	};
+	z_stream strm = {
+		.next_in	= (Bytef *)in,
+		.avail_in	= in_len,
+		.next_out	= out,
+		.avail_out	= *out_len,
+		.zalloc		= zlib_alloc,
+		.zfree		= zlib_free,
+		.opaque		= &arena,
+	};
+	int ret;
+
+	if (inflateInit2(&strm, -DEFLATE_WINDOW_BITS) != Z_OK)
+		return -ENOMEM;
+	ret = inflate(&strm, Z_FINISH);
+	*out_len = strm.total_out;
+	inflateEnd(&strm);
+
+	return ret == Z_STREAM_END ? 0 : -EIO;
+}
+
+static const struct stride_codec stride_codecs[TUX3_CODECS] = {
+	[TUX3_CODEC_LZO1X] = {
+		.name		= "lzo",
+		.workspace_size	= lzo_workspace_size,
+		.bound		= lzo_bound,
+		.compress	= lzo_compress,
+		.decompress	= lzo_decompress,
+	},
+	[TUX3_CODEC_DEFLATE] = {
+		.name		= "deflate",
+		.workspace_size	= deflate_workspace_size,
+		.bound		= deflate_bound,
+		.compress	= deflate_compress,
+		.decompress	= deflate_decompress,
+	},
+};
+
+static unsigned compress_codec = TUX3_CODEC_LZO1X;
+static int compress_level = Z_DEFAULT_COMPRESSION;
+
+/* Codec id of name, "default" is TUX3_CODEC_DEFAULT */
+int compress_codec_id(const char *name)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printf("%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	if (!strcmp(name, "default"))
+		return TUX3_CODEC_DEFAULT;
+	for (int i = 0; i < TUX3_CODECS; i++) {
+		if (stride_codecs[i].name && !strcmp(name, stride_codecs[i].name))
+			return i;
+	}
+	return -EINVAL;
+}
+
+const char *compress_codec_name(unsigned codec)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printf("%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	if (codec == TUX3_CODEC_DEFAULT)
+		return "default";
+	if (codec >= TUX3_CODECS || !stride_codecs[codec].name)
+		return NULL;
+	return stride_codecs[codec].name;
+}
+
+/* Default codec and level, for inodes without a codec of their own */
+int set_compress_codec(const char *name, int level)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printf("%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	int codec = compress_codec_id(name);
+
+	if (codec <= TUX3_CODEC_DEFAULT)
+		return -EINVAL;
+	if (level < Z_DEFAULT_COMPRESSION || level > Z_BEST_COMPRESSION)
+		return -EINVAL;
+	compress_codec = codec;
+	compress_level = level;
+	return 0;
+}
+
+/*
+ * Compression workspaces are kept on sb->idle_workspaces and reused
+ * across strides. One is taken per compressing task, so concurrent
+ * compressors never share buffers. Released by put_super().
+ */
 struct workspace
 {
+	struct workspace *next;	//link of sb->idle_workspaces
+	unsigned blocks;	//stride length buffers can hold
 	void *mem;		//memory required for compression
 	void *c_buf;	//memory where compressed buffer goes
 	void *d_buf;	//memory where decompressed buffer goes
 };
 
-static struct workspace *init_workspace(unsigned stride_len)
+/* Size of c_buf, output is padded up to a whole block */
+static size_t workspace_cbuf_size(struct sb *sb, unsigned blocks)
+{
+	size_t bytes = (size_t)blocks << sb->blockbits, bound = 0;
+
+	for (int i = 0; i < TUX3_CODECS; i++) {
+		if (stride_codecs[i].bound)
+			bound = max(bound, stride_codecs[i].bound(bytes));
+	}
+	return ALIGN(sizeof(struct stride_header) + bound, sb->blocksize);
+}
+
+/* Size of mem, enough for any codec */
+static size_t workspace_mem_size(struct sb *sb, unsigned blocks)
+{
+	size_t bytes = (size_t)blocks << sb->blockbits, size = 0;
+
+	for (int i = 0; i < TUX3_CODECS; i++) {
+		if (stride_codecs[i].workspace_size)
+			size = max(size, stride_codecs[i].workspace_size(bytes));
+	}
+	return size;
+}
+
+static void free_workspace(struct workspace *workspace)
 {
 	if(DEBUG_MODE_K==1)
 	{
 		printf("%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	struct workspace *workspace;
+	
+	free(workspace->mem);
+	free(workspace->c_buf);
+	free(workspace->d_buf);
+	free(workspace);
+}
+
+/* Make buffers of workspace big enough for a stride of blocks */
+static int grow_workspace(struct sb *sb, struct workspace *workspace,
+			  unsigned blocks)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printf("%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	void *mem, *c_buf, *d_buf;
 
-	workspace = malloc(sizeof(*workspace));
-	if(!workspace)
-		return ERR_PTR(-ENOMEM);
+	if (blocks <= workspace->blocks)
+		return 0;
 
-	workspace->mem = malloc(LZO1X_MEM_COMPRESS);
-	workspace->c_buf = malloc(PAGE_SIZE_1*stride_len);
-	workspace->d_buf = malloc(PAGE_SIZE_1*stride_len);
+	mem = malloc(workspace_mem_size(sb, blocks));
+	c_buf = malloc(workspace_cbuf_size(sb, blocks));
+	d_buf = malloc((size_t)blocks << sb->blockbits);
+	if (!mem || !c_buf || !d_buf) {
+		free(mem);
+		free(c_buf);
+		free(d_buf);
+		return -ENOMEM;
+	}
+	free(workspace->mem);
+	free(workspace->c_buf);
+	free(workspace->d_buf);
+	workspace->mem = mem;
+	workspace->c_buf = c_buf;
+	workspace->d_buf = d_buf;
+	workspace->blocks = blocks;
+	return 0;
+}
 
-	if (!workspace->mem || !workspace->d_buf || !workspace->c_buf)
+static struct workspace *get_workspace(struct sb *sb, unsigned stride_len)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printf("%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct workspace *workspace;
+
+	pthread_mutex_lock(&sb->workspace_lock);
+	workspace = sb->idle_workspaces;
+	if (workspace)
+		sb->idle_workspaces = workspace->next;
+	pthread_mutex_unlock(&sb->workspace_lock);
+
+	if (!workspace) {
+		workspace = calloc(1, sizeof(*workspace));
+		if (!workspace)
+			return ERR_PTR(-ENOMEM);
+	}
+	if (grow_workspace(sb, workspace, stride_len))
 		goto fail;
 
 	return workspace;
 	
 	fail:
+	free_workspace(workspace);
 	return ERR_PTR(-ENOMEM);
 }
 
-static void free_workspace(struct workspace *workspace)
+static void put_workspace(struct sb *sb, struct workspace *workspace)
 {
 	if(DEBUG_MODE_K==1)
 	{
 		printf("%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	
-	free(workspace->mem);
-	free(workspace->c_buf);
-	free(workspace->d_buf);
-	free(workspace);
+	pthread_mutex_lock(&sb->workspace_lock);
+	workspace->next = sb->idle_workspaces;
+	sb->idle_workspaces = workspace;
+	pthread_mutex_unlock(&sb->workspace_lock);
 }
 
-int compress_stride(struct bufvec *bufvec)
+void free_compress_workspaces(struct sb *sb)
 {
 	if(DEBUG_MODE_K==1)
 	{
 		printf("%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	struct inode *inode = bufvec_inode(bufvec);
-	struct buffer_head *buffer;
+	while (sb->idle_workspaces) {
+		struct workspace *workspace = sb->idle_workspaces;
+		sb->idle_workspaces = workspace->next;
+		free_workspace(workspace);
+	}
+}
+
+/*
+ * Compression thread pool. flush_compressed() queues strides ahead and
+ * finishes them in index order, so compressing later strides overlaps
+ * with I/O of earlier ones. Without threads, jobs run inline.
+ */
+#define COMPRESS_MAX_THREADS	32
+
+static struct compress_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t work;		/* wakes workers */
+	pthread_cond_t done;		/* wakes waiters of a job */
+	struct list_head queue;		/* queued jobs */
+	int threads;			/* -1: not started yet */
+} compress_pool = {
+	.lock	= PTHREAD_MUTEX_INITIALIZER,
+	.work	= PTHREAD_COND_INITIALIZER,
+	.done	= PTHREAD_COND_INITIALIZER,
+	.queue	= LIST_HEAD_INIT(compress_pool.queue),
+	.threads = -1,
+};
+
+static pthread_once_t compression_once = PTHREAD_ONCE_INIT;
+static int lzo_init_err, compress_nr_threads = -1;
+
+/* Number of compression threads, before the first compressed write */
+void set_compress_threads(int nr)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printf("%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	compress_nr_threads = min(nr, COMPRESS_MAX_THREADS);
+}
+
+/*
+ * Incompressible data (media, archives) is stored raw. A stride is
+ * compressed only if that saves at least compress_min_saving percent
+ * of its blocks, and always at least one block; otherwise it is
+ * written raw, which the stride map tells by all blocks being mapped.
+ * Before the compressor runs, a sample of the stride is checked for
+ * entropy, so that high entropy data costs little CPU.
+ *
+ * A file whose strides keep failing backs off: after
+ * COMPRESS_BACKOFF_START failures in a row, the next 1, 2, 4 ... up to
+ * COMPRESS_BACKOFF_MAX strides are stored raw without trying.
+ */
+#define ENTROPY_SAMPLE_BYTES	32	/* bytes per sample */
+#define ENTROPY_MAX_SAMPLED	4096	/* bytes sampled per stride */
+#define ENTROPY_MAX_PERCENT	90	/* of 8 bits per byte */
+#define COMPRESS_BACKOFF_START	4
+#define COMPRESS_BACKOFF_MAX	256
+
+static unsigned compress_min_saving;
+
+/* Percent of a stride compression must save to be kept */
+void set_compress_min_saving(unsigned percent)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printf("%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	compress_min_saving = min(percent, 100U);
+}
+
+/*
+ * Estimate Shannon entropy of data from samples, and tell if it is too
+ * high for compression to pay. Logs are in quarter bits, as bit length
+ * of the fourth power.
+ */
+static int stride_incompressible(const unsigned char *data, unsigned len)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printf("%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	unsigned step = max_t(unsigned, ENTROPY_SAMPLE_BYTES,
+			      len / (ENTROPY_MAX_SAMPLED / ENTROPY_SAMPLE_BYTES));
+	unsigned count[256] = { }, samples = 0, distinct = 0;
+	u64 sum = 0;
+
+	for (unsigned pos = 0; pos + ENTROPY_SAMPLE_BYTES <= len; pos += step) {
+		for (unsigned i = 0; i < ENTROPY_SAMPLE_BYTES; i++)
+			count[data[pos + i]]++;
+		samples += ENTROPY_SAMPLE_BYTES;
+	}
+	if (!samples)
+		return 0;
+
+	unsigned log_samples = ilog2((u64)samples * samples * samples * samples);
+	for (int c = 0; c < 256; c++) {
+		u64 n = count[c];
+		if (!n)
+			continue;
+		distinct++;
+		sum += n * (log_samples - ilog2(n * n * n * n));
+	}
+	/* Few byte values, e.g. text, compresses whatever the entropy */
+	if (distinct < 64)
+		return 0;
+	/* sum / samples is quarter bits per byte, 32 is random */
+	return sum * 100 >= (u64)samples * 32 * ENTROPY_MAX_PERCENT;
+}
+
+/* Blocks of stride in a file of size */
+static unsigned stride_blocks(struct sb *sb, loff_t size, block_t stride)
+{
+	block_t blocks = (size + sb->blockmask) >> sb->blockbits;
+	block_t start = stride * COMPRESSION_STRIDE_LEN;
+
+	if (blocks <= start)
+		return 0;
+	return min_t(block_t, blocks - start, COMPRESSION_STRIDE_LEN);
+}
+
+/*
+ * Compress stride into workspace, with header. If it doesn't save
+ * enough, out_blocks is left 0 and stride is written raw. No list is
+ * touched here.
+ */
+static void compress_job_run(struct compress_job *job)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printf("%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	const struct stride_codec *codec = &stride_codecs[job->codec];
+	struct sb *sb = job->sb;
+	struct stride_header *head;
 	struct workspace *workspace;
-	struct list_head *list;
-	unsigned offset, out_blocks;
-	unsigned len = bufvec_contig_count(bufvec);
-	unsigned in_len, tail, out_len;
-	char *data;
-	int ret = 0;
-	
-	workspace = init_workspace(len);
-	printf("\n[C]inode : %Lu", tux_inode(inode)->inum);
-	
-	in_len = bufvec_contig_count(bufvec)*PAGE_SIZE_1;
-	out_len = 0;
+	struct buffer_head *buffer;
+	unsigned offset = 0, bytes, saving;
+	size_t out_len;
+	char *c_buf;
+	int err;
+
+	if (job->skip)
+		return;
+
+	workspace = get_workspace(sb, job->count);
+	if (IS_ERR(workspace)) {
+		job->err = PTR_ERR(workspace);
+		return;
+	}
+	job->workspace = workspace;
+
+	list_for_each_entry(buffer, &job->buffers, link) {
+		memcpy((char *)workspace->d_buf + offset, buffer->data, sb->blocksize);
+		offset += sb->blocksize;
+	}
+	if (stride_incompressible(workspace->d_buf, offset))
+		return;
+	c_buf = workspace->c_buf;
+	out_len = workspace_cbuf_size(sb, workspace->blocks) - sizeof(*head);
+	err = codec->compress(workspace->d_buf, offset, c_buf + sizeof(*head),
+			      &out_len, workspace->mem, job->level);
+	if (err) {
+		/* Didn't fit, write raw */
+		if (err != -ENOSPC)
+			job->err = err;
+		return;
+	}
+	job->out_len = out_len;
+
+	bytes = sizeof(*head) + out_len;
+	job->out_blocks = (bytes + sb->blockmask) >> sb->blockbits;
+	saving = max(1U, DIV_ROUND_UP(job->count * compress_min_saving, 100));
+	if (job->out_blocks + saving > job->count) {
+		job->out_blocks = 0;
+		return;
+	}
+	head = (struct stride_header *)c_buf;
+	*head = (struct stride_header){
+		.magic	= cpu_to_be16(STRIDE_MAGIC),
+		.codec	= job->codec,
+		.bytes	= cpu_to_be32(out_len),
+	};
+	memset(c_buf + bytes, 0, (job->out_blocks << sb->blockbits) - bytes);
+}
 
-	offset = 0;
-	while(len)
+static void *compress_worker(void *data)
+{
+	if(DEBUG_MODE_K==1)
 	{
-		list = bufvec->contig.next;
-		buffer = list_entry(list, struct buffer_head, link);
+		printf("%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct compress_pool *pool = data;
+
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		struct compress_job *job;
 
-		data = (char *)buffer->data;		
-		memcpy((char *)workspace->d_buf + offset, data, PAGE_SIZE_1);
-		offset += PAGE_SIZE_1;
-		
-		list_move_tail(&buffer->link, &bufvec->compress);
-		bufvec->contig_count--;
-		bufvec->compress_count++;
-		len--;
+		while (list_empty(&pool->queue))
+			pthread_cond_wait(&pool->work, &pool->lock);
+		job = list_entry(pool->queue.next, struct compress_job, queue);
+		list_del_init(&job->queue);
+		pthread_mutex_unlock(&pool->lock);
+
+		compress_job_run(job);
+
+		pthread_mutex_lock(&pool->lock);
+		job->done = 1;
+		pthread_cond_broadcast(&pool->done);
 	}
-	
-	if (lzo_init() != LZO_E_OK)
+	return NULL;
+}
+
+static void init_compression(void)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printf("%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct compress_pool *pool = &compress_pool;
+	int nr = compress_nr_threads;
+
+	lzo_init_err = lzo_init();
+
+	/* Default leaves one cpu to the flusher */
+	if (nr < 0)
+		nr = min((int)sysconf(_SC_NPROCESSORS_ONLN) - 1,
+			 COMPRESS_MAX_THREADS);
+	pool->threads = 0;
+	while (pool->threads < nr) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, compress_worker, pool))
+			break;
+		pthread_detach(thread);
+		pool->threads++;
+	}
+}
+
+/* Number of running compression threads */
+int compress_threads(void)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printf("%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	pthread_once(&compression_once, init_compression);
+	return compress_pool.threads;
+}
+
+/*
+ * Take the stride in bufvec->contig into job. On error, stride is left
+ * in bufvec->contig to be written uncompressed.
+ */
+int compress_job_init(struct compress_job *job, struct bufvec *bufvec)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printf("%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct tux3_inode *tuxnode = tux_inode(bufvec_inode(bufvec));
+	struct sb *sb = tux_sb(bufvec_inode(bufvec)->i_sb);
+	block_t index = bufvec_contig_index(bufvec);
+
+	pthread_once(&compression_once, init_compression);
+	if (lzo_init_err != LZO_E_OK)
     {
         printf("internal error - lzo_init() failed !!!\n");
         printf("(this usually indicates a compiler bug - try recompiling\nwithout optimizations, and enable '-DLZO_DEBUG' for diagnostics)\n");
-        return 3;
+        return -EINVAL;
     }
 
-	ret =  lzo1x_1_compress(workspace->d_buf, in_len, workspace->c_buf, (lzo_uint *)&out_len, workspace->mem);
-	if (ret == LZO_E_OK)
-		printf("\nSTRIDE SUCCESSFULLY COMPRESSED !");
-		
-	out_blocks = out_len / PAGE_SIZE_1 + 1;
-	tail = PAGE_SIZE_1 - (out_len % PAGE_SIZE_1);
-	printf("\n\nCompressed from %u to %u | Compressed blocks : %u | tail : %u\n", in_len, (unsigned)out_len, out_blocks, tail);
-	memset((char *)workspace->c_buf + out_len, 0, tail);
-	
-	offset = 0;
-	while(out_blocks > 0)
+	/* Whole stride must be dirty, see tux3_prepare_write() */
+	assert(!(index & (COMPRESSION_STRIDE_LEN - 1)));
+	assert(bufvec_contig_count(bufvec) ==
+	       stride_blocks(sb, bufvec->idata->i_size,
+			     index / COMPRESSION_STRIDE_LEN));
+
+	*job = (struct compress_job){
+		.sb	= sb,
+		.index	= index,
+		.count	= bufvec_contig_count(bufvec),
+		.codec	= compress_codec,
+		.level	= compress_level,
+	};
+	if (tuxnode->i_codec < TUX3_CODECS &&
+	    stride_codecs[tuxnode->i_codec].compress)
+		job->codec = tuxnode->i_codec;
+	/* File backing off, store raw without trying */
+	if (tuxnode->compress_skip) {
+		tuxnode->compress_skip--;
+		job->skip = 1;
+	}
+	INIT_LIST_HEAD(&job->buffers);
+	INIT_LIST_HEAD(&job->queue);
+	list_splice_init(&bufvec->contig, &job->buffers);
+	bufvec->contig_count = 0;
+	return 0;
+}
+
+void queue_compress_job(struct compress_job *job)
+{
+	if(DEBUG_MODE_K==1)
 	{
-		list = bufvec->compress.next;
-		buffer = list_entry(list, struct buffer_head, link);
-		//printk(KERN_INFO "Move_to_contig : %Lu",bufindex(buffer));
+		printf("%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct compress_pool *pool = &compress_pool;
 
-		data = (char *)buffer->data;
-		memcpy(data, (char *)workspace->c_buf + offset, PAGE_SIZE_1);
-		buffer->index = bufvec->global_index++;
-		offset += PAGE_SIZE_1;
-		
-		list_move_tail(&buffer->link, &bufvec->contig);
-		bufvec->contig_count++;
-		bufvec->compress_count--;
-		
-		out_blocks--;
+	if (!compress_threads()) {
+		compress_job_run(job);
+		job->done = 1;
+		return;
 	}
+	pthread_mutex_lock(&pool->lock);
+	list_add_tail(&job->queue, &pool->queue);
+	pthread_cond_signal(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+}
 
-	free_workspace(workspace);
-	return ret;
+static void wait_compress_job(struct compress_job *job)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printf("%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct compress_pool *pool = &compress_pool;
+
+	pthread_mutex_lock(&pool->lock);
+	while (!job->done)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* Wait job and give its stride back to bufvec->buffers, still dirty */
+void cancel_compress_job(struct compress_job *job, struct bufvec *bufvec)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printf("%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	wait_compress_job(job);
+	list_splice_init(&job->buffers, bufvec->buffers);
+	if (job->workspace)
+		put_workspace(job->sb, job->workspace);
+}
+
+/* Unmap blocks of inode, the range reads as hole after this */
+static int tux3_punch_blocks(struct inode *inode, block_t start, unsigned count)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printf("%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct block_segment seg[COMPRESSION_STRIDE_LEN];
+
+	while (count) {
+		int segs = map_region(inode, start, count, seg, ARRAY_SIZE(seg),
+				      MAP_PUNCH);
+		unsigned done;
+
+		if (segs < 0)
+			return segs;
+		/* Might be partial */
+		done = seg_total_count(seg, segs);
+		start += done;
+		count -= done;
+	}
+	return 0;
+}
+
+/* Track strides of inode failing to compress, see compress_min_saving */
+static void compress_backoff(struct inode *inode, struct compress_job *job)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printf("%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct tux3_inode *tuxnode = tux_inode(inode);
+	unsigned shift;
+
+	if (job->skip || job->err)
+		return;
+	if (job->out_blocks) {
+		tuxnode->compress_fails = 0;
+		return;
+	}
+	if (++tuxnode->compress_fails < COMPRESS_BACKOFF_START)
+		return;
+	shift = min_t(unsigned, tuxnode->compress_fails - COMPRESS_BACKOFF_START,
+		      ilog2(COMPRESS_BACKOFF_MAX));
+	tuxnode->compress_skip = 1 << shift;
+}
+
+/*
+ * Wait job, then put the stride into bufvec->contig for map->io. A
+ * compressed stride is copied over its first blocks, the rest of stride
+ * is unmapped and waits on bufvec->compress for completion. Raw stride
+ * goes as is, also if compression failed.
+ *
+ * If the tail can't be unmapped, the stride would read as raw, so it is
+ * given back to bufvec->buffers untouched and the error returned.
+ */
+int finish_compress_job(struct compress_job *job, struct bufvec *bufvec)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printf("%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct inode *inode = bufvec_inode(bufvec);
+	struct sb *sb = job->sb;
+	struct workspace *workspace;
+	struct buffer_head *buffer, *safe;
+	unsigned offset = 0, i = 0;
+	int err;
+
+	wait_compress_job(job);
+	compress_backoff(inode, job);
+	workspace = job->workspace;
+	if (job->err || !job->out_blocks) {
+		if (job->err)
+			tux3_warn(sb, "stride compression failed (%d), "
+				  "writing raw", job->err);
+		/* Write stride raw */
+		list_splice_tail_init(&job->buffers, &bufvec->contig);
+		bufvec->contig_count += job->count;
+		if (workspace)
+			put_workspace(sb, workspace);
+		return 0;
+	}
+
+	err = tux3_punch_blocks(inode, job->index + job->out_blocks,
+				job->count - job->out_blocks);
+	if (err) {
+		list_splice_init(&job->buffers, bufvec->buffers);
+		put_workspace(sb, workspace);
+		return err;
+	}
+	printf("\n[C]inode : %Lu", tux_inode(inode)->inum);
+	printf("\n\nCompressed from %u to %u | Compressed blocks : %u\n",
+	       job->count << sb->blockbits, job->out_len, job->out_blocks);
+
+	list_for_each_entry_safe(buffer, safe, &job->buffers, link) {
+		if (i++ < job->out_blocks) {
+			memcpy(buffer->data, (char *)workspace->c_buf + offset,
+			       sb->blocksize);
+			offset += sb->blocksize;
+			list_move_tail(&buffer->link, &bufvec->contig);
+			bufvec->contig_count++;
+		} else {
+			/* Cached as the hole it becomes */
+			memset(buffer->data, 0, sb->blocksize);
+			list_move_tail(&buffer->link, &bufvec->compress);
+			bufvec->compress_count++;
+		}
+	}
+	put_workspace(sb, workspace);
+
+	return 0;
+}
+
+/* Compress the stride in bufvec->contig in place, without waiting on pool */
+int compress_stride(struct bufvec *bufvec)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printf("%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct compress_job job;
+	int err;
+
+	err = compress_job_init(&job, bufvec);
+	if (err)
+		return err;
+	compress_job_run(&job);
+	job.done = 1;
+	return finish_compress_job(&job, bufvec);
+}
+
+/*
+ * Cache of decompressed strides, so a compressed stride read in pieces
+ * is decompressed once. Entries are keyed by (inode, stride) in one
+ * hash, linked on the inode to be dropped by write, truncate and inode
+ * eviction, and recycled in LRU order past max_bytes. Only clean
+ * compressed strides are cached, dirty ones are read from buffers.
+ */
+#define STRIDE_HASH_BITS	10
+
+struct cached_stride {
+	struct hlist_node hashlink;
+	struct list_head lru;		/* link of stride_cache.lru */
+	struct list_head link;		/* link of tux3_inode->strides */
+	struct inode *inode;
+	block_t stride;
+	unsigned size, len;		/* allocated, decompressed bytes */
+	char data[];
+};
+
+static struct stride_cache {
+	pthread_mutex_t lock;
+	struct hlist_head hash[1 << STRIDE_HASH_BITS];
+	struct list_head lru;		/* least recently used first */
+	struct stride_cache_stats stats;
+} stride_cache = {
+	.lock	= PTHREAD_MUTEX_INITIALIZER,
+	.lru	= LIST_HEAD_INIT(stride_cache.lru),
+	.stats	= { .max_bytes = 8 << 20, },
+};
+
+static struct hlist_head *stride_hash(struct inode *inode, block_t stride)
+{
+	u64 key = (unsigned long)inode ^ ((u64)stride << 24);
+	return &stride_cache.hash[hash_64(key, STRIDE_HASH_BITS)];
+}
+
+static struct cached_stride *lookup_stride(struct inode *inode, block_t stride)
+{
+	struct cached_stride *cached;
+
+	hlist_for_each_entry(cached, stride_hash(inode, stride), hashlink) {
+		if (cached->inode == inode && cached->stride == stride)
+			return cached;
+	}
+	return NULL;
 }
 
-int test;
-struct stride_map
+static void unlink_stride(struct cached_stride *cached)
 {
-	unsigned int num[100];
-	unsigned int count;
-}em;
-//unsigned int modulus;
-//unsigned int logical_memory;
-unsigned int is_first;
-void init_stride(void)
+	hlist_del(&cached->hashlink);
+	list_del(&cached->lru);
+	list_del(&cached->link);
+	stride_cache.stats.bytes -= cached->len;
+}
+
+/* Evict until len more bytes fit, keep one big enough to reuse */
+static struct cached_stride *evict_strides(unsigned len)
 {
-	em.count=0;
+	struct stride_cache *cache = &stride_cache;
+	struct cached_stride *cached, *reuse = NULL;
+
+	while (!list_empty(&cache->lru) &&
+	       cache->stats.bytes + len > cache->stats.max_bytes) {
+		cached = list_entry(cache->lru.next, struct cached_stride, lru);
+		unlink_stride(cached);
+		cache->stats.evictions++;
+		if (!reuse && cached->size >= len)
+			reuse = cached;
+		else
+			free(cached);
+	}
+	return reuse;
 }
 
-void add_stride(unsigned int i)
+/* Copy from cached stride if there, out_len is its expected size */
+static int stride_cache_read(struct inode *inode, block_t stride,
+			     unsigned from, void *data, unsigned len,
+			     unsigned out_len)
 {
-	printf("i %d\n",i);
-	if(em.count==0)
+	if(DEBUG_MODE_K==1)
 	{
-		em.num[em.count]=i;
+		printf("%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct stride_cache *cache = &stride_cache;
+	struct cached_stride *cached;
+	int hit = 0;
+
+	if (list_empty(&tux_inode(inode)->strides))
+		return 0;
+
+	pthread_mutex_lock(&cache->lock);
+	cached = lookup_stride(inode, stride);
+	if (cached && cached->len == out_len) {
+		memcpy(data, cached->data + from, len);
+		list_move_tail(&cached->lru, &cache->lru);
+		cache->stats.hits++;
+		hit = 1;
 	}
-	else
+	pthread_mutex_unlock(&cache->lock);
+	return hit;
+}
+
+/* Add stride just decompressed after a miss */
+static void stride_cache_insert(struct inode *inode, block_t stride,
+				const void *data, unsigned len)
+{
+	if(DEBUG_MODE_K==1)
 	{
-		em.num[em.count]=i-em.num[em.count-1];
-		printf("em.num[em.count-1] %d\n",em.num[em.count-1]);
+		printf("%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct stride_cache *cache = &stride_cache;
+	struct cached_stride *cached;
+
+	pthread_mutex_lock(&cache->lock);
+	cache->stats.misses++;
+	if (len > cache->stats.max_bytes || lookup_stride(inode, stride))
+		goto out;
+	cached = evict_strides(len);
+	if (!cached) {
+		cached = malloc(sizeof(*cached) + len);
+		if (!cached)
+			goto out;
+		cached->size = len;
 	}
-	printf("ADDSTRIDE stride no : %d, stride len : %d\n",em.count,em.num[em.count]);
-	em.count++;
+	cached->inode = inode;
+	cached->stride = stride;
+	cached->len = len;
+	memcpy(cached->data, data, len);
+	hlist_add_head(&cached->hashlink, stride_hash(inode, stride));
+	list_add_tail(&cached->lru, &cache->lru);
+	list_add_tail(&cached->link, &tux_inode(inode)->strides);
+	cache->stats.bytes += len;
+out:
+	pthread_mutex_unlock(&cache->lock);
 }
 
-int is_stride_initialised(void)
+/* Drop cached strides of inode in [start, end) */
+void tux3_invalidate_strides(struct inode *inode, block_t start, block_t end)
 {
-	return em.count;
+	if(DEBUG_MODE_K==1)
+	{
+		printf("%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct stride_cache *cache = &stride_cache;
+	struct cached_stride *cached, *safe;
+	struct list_head *head = &tux_inode(inode)->strides;
+
+	if (list_empty(head))
+		return;
+
+	pthread_mutex_lock(&cache->lock);
+	list_for_each_entry_safe(cached, safe, head, link) {
+		if (cached->stride < start || cached->stride >= end)
+			continue;
+		unlink_stride(cached);
+		free(cached);
+		cache->stats.invalidations++;
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/* Limit of cached stride bytes, 0 disables the cache */
+void set_stride_cache_size(unsigned long bytes)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printf("%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct stride_cache *cache = &stride_cache;
+
+	pthread_mutex_lock(&cache->lock);
+	cache->stats.max_bytes = bytes;
+	free(evict_strides(0));
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void get_stride_cache_stats(struct stride_cache_stats *stats)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printf("%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	pthread_mutex_lock(&stride_cache.lock);
+	*stats = stride_cache.stats;
+	pthread_mutex_unlock(&stride_cache.lock);
+}
+
+/* Copy len bytes at offset from of cached blocks from index into data */
+static int copy_blocks(struct inode *inode, block_t index, unsigned from,
+		       void *data, unsigned len)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printf("%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct sb *sb = tux_sb(inode->i_sb);
+
+	while (len) {
+		unsigned offset = from & sb->blockmask;
+		unsigned some = min(len, sb->blocksize - offset);
+		struct buffer_head *buffer;
+
+		buffer = blockread(mapping(inode), index + (from >> sb->blockbits));
+		if (!buffer)
+			return -EIO;
+		memcpy(data, bufdata(buffer) + offset, some);
+		blockput(buffer);
+		data += some;
+		from += some;
+		len -= some;
+	}
+	return 0;
+}
+
+static int decompress_stride(struct sb *sb, void *in, unsigned in_len,
+			     void *out, unsigned out_len, void *mem)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printf("%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct stride_header *head = in;
+	unsigned bytes = be32_to_cpu(head->bytes);
+	size_t got = out_len;
+
+	if (be16_to_cpu(head->magic) != STRIDE_MAGIC ||
+	    head->codec >= TUX3_CODECS ||
+	    !stride_codecs[head->codec].decompress ||
+	    bytes > in_len - sizeof(*head)) {
+		tux3_err(sb, "bad stride header: magic %x, codec %u, bytes %u",
+			 be16_to_cpu(head->magic), head->codec, bytes);
+		return -EIO;
+	}
+	if (stride_codecs[head->codec].decompress(in + sizeof(*head), bytes,
+						  out, &got, mem) ||
+	    got != out_len) {
+		tux3_err(sb, "stride decompression failed");
+		return -EIO;
+	}
+	return 0;
+}
+
+/*
+ * Read len bytes at offset from of stride into data, within
+ * stride_blocks() of i_size. Dirty stride is uncompressed in cache,
+ * otherwise the dtree tells how it is stored. Only the blocks holding
+ * the range are read for raw stride. Compressed stride is decompressed
+ * straight into data if it is wanted whole, else through workspace.
+ *
+ * Neighbour strides are read ahead by blockread(), which reads the
+ * rest of the extents around a missing block.
+ */
+static int read_stride(struct inode *inode, block_t stride, unsigned from,
+		       void *data, unsigned len, struct workspace *workspace)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printf("%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct sb *sb = tux_sb(inode->i_sb);
+	struct block_segment seg[COMPRESSION_STRIDE_LEN];
+	block_t index = stride * COMPRESSION_STRIDE_LEN;
+	unsigned count = stride_blocks(sb, inode->i_size, stride);
+	unsigned out_len = count << sb->blockbits;
+	unsigned mapped = 0, in_len;
+	struct buffer_head *buffer;
+	void *in, *out;
+	int segs, err;
+
+	assert(from + len <= out_len);
+	if (!len)
+		return 0;
+
+	buffer = peekblk(mapping(inode), index);
+	if (buffer) {
+		int dirty = buffer_dirty(buffer);
+		blockput(buffer);
+		if (dirty)
+			return copy_blocks(inode, index, from, data, len);
+	}
+
+	if (stride_cache_read(inode, stride, from, data, len, out_len))
+		return 0;
+
+	segs = map_region(inode, index, count, seg, ARRAY_SIZE(seg), MAP_READ);
+	if (segs < 0)
+		return segs;
+	for (int i = 0; i < segs && seg[i].state != BLOCK_SEG_HOLE; i++)
+		mapped += seg[i].count;
+	mapped = min(mapped, count);
+
+	if (!mapped) {
+		memset(data, 0, len);
+		return 0;
+	}
+	if (mapped == count)
+		return copy_blocks(inode, index, from, data, len);
+
+	/* Compressed, use the cached block as is if it is all */
+	in_len = mapped << sb->blockbits;
+	buffer = NULL;
+	if (mapped == 1) {
+		buffer = blockread(mapping(inode), index);
+		if (!buffer)
+			return -EIO;
+		in = bufdata(buffer);
+	} else {
+		in = workspace->c_buf;
+		err = copy_blocks(inode, index, 0, in, in_len);
+		if (err)
+			return err;
+	}
+
+	out = (from == 0 && len == out_len) ? data : workspace->d_buf;
+	err = decompress_stride(sb, in, in_len, out, out_len, workspace->mem);
+	if (!err) {
+		stride_cache_insert(inode, stride, out, out_len);
+		if (out != data)
+			memcpy(data, out + from, len);
+	}
+	if (buffer)
+		blockput(buffer);
+	return err;
+}
+
+/*
+ * Read len bytes at pos of compressed file, range must be in i_size.
+ * Only the strides holding the range are looked up and decompressed.
+ */
+int tux3_read_strides(struct inode *inode, loff_t pos, void *data,
+		      unsigned len)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printf("%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct sb *sb = tux_sb(inode->i_sb);
+	unsigned stride_size = COMPRESSION_STRIDE_LEN << sb->blockbits;
+	struct workspace *workspace;
+	int err = 0;
+
+	workspace = get_workspace(sb, COMPRESSION_STRIDE_LEN);
+	if (IS_ERR(workspace))
+		return PTR_ERR(workspace);
+	while (len) {
+		unsigned from = pos % stride_size;
+		unsigned some = min(len, stride_size - from);
+
+		err = read_stride(inode, pos / stride_size, from, data, some,
+				  workspace);
+		if (err)
+			break;
+		data += some;
+		pos += some;
+		len -= some;
+	}
+	put_workspace(sb, workspace);
+	return err;
+}
+
+/*
+ * Dirty all blocks of stride for current delta with its uncompressed
+ * data, sized for newsize, so the stride can be changed in part and is
+ * written back as a whole.
+ */
+static int prepare_stride(struct inode *inode, block_t stride, loff_t newsize)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printf("%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct sb *sb = tux_sb(inode->i_sb);
+	unsigned delta = tux3_get_current_delta();
+	unsigned stride_size = COMPRESSION_STRIDE_LEN << sb->blockbits;
+	block_t index = stride * COMPRESSION_STRIDE_LEN;
+	unsigned count = stride_blocks(sb, newsize, stride);
+	unsigned count_old = stride_blocks(sb, inode->i_size, stride);
+	struct workspace *workspace;
+	loff_t start = stride * stride_size;
+	struct buffer_head *buffer, *clone;
+	unsigned i;
+	void *buf;
+	int err;
+
+	/* Already done in this delta? */
+	for (i = 0; i < count; i++) {
+		int done;
+
+		buffer = peekblk(mapping(inode), index + i);
+		if (!buffer)
+			break;
+		done = buffer_already_dirty(buffer, delta);
+		blockput(buffer);
+		if (!done)
+			break;
+	}
+	if (i == count)
+		return 0;
+
+	workspace = get_workspace(sb, COMPRESSION_STRIDE_LEN);
+	if (IS_ERR(workspace))
+		return PTR_ERR(workspace);
+	buf = workspace->d_buf;
+	memset(buf, 0, stride_size);
+	err = read_stride(inode, stride, 0, buf, count_old << sb->blockbits,
+			  workspace);
+	if (err)
+		goto out;
+	/* Tail of old last block is exposed when size grows */
+	if (inode->i_size > start && inode->i_size < start + stride_size)
+		memset(buf + (inode->i_size - start), 0,
+		       start + stride_size - inode->i_size);
+
+	for (i = 0; i < count; i++) {
+		buffer = blockget(mapping(inode), index + i);
+		if (!buffer) {
+			err = -ENOMEM;
+			break;
+		}
+		clone = blockdirty(buffer, delta);
+		if (IS_ERR(clone)) {
+			blockput(buffer);
+			err = PTR_ERR(clone);
+			break;
+		}
+		memcpy(bufdata(clone), buf + (i << sb->blockbits), sb->blocksize);
+		mark_buffer_dirty_non(clone);
+		blockput(clone);
+	}
+	tux3_invalidate_strides(inode, stride, stride + 1);
+out:
+	put_workspace(sb, workspace);
+	return err;
+}
+
+/*
+ * Prepare strides which a write of len bytes at pos changes without
+ * overwriting them whole: the partially written ones, and the old last
+ * stride if it grows.
+ */
+int tux3_prepare_write(struct inode *inode, loff_t pos, unsigned len)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printf("%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct sb *sb = tux_sb(inode->i_sb);
+	loff_t stride_size = COMPRESSION_STRIDE_LEN << sb->blockbits;
+	loff_t end = pos + len, newsize = max(inode->i_size, end);
+	block_t first, last, stride;
+	int err;
+
+	if (!len)
+		return 0;
+
+	first = pos / stride_size;
+	last = (end - 1) / stride_size;
+	tux3_invalidate_strides(inode, first, last + 1);
+	/* Only first and last strides can be written in part */
+	for (stride = first; ; stride = last) {
+		loff_t start = stride * stride_size;
+		loff_t limit = min(start + stride_size, newsize);
+
+		if (pos > start || end < limit) {
+			err = prepare_stride(inode, stride, newsize);
+			if (err)
+				return err;
+		}
+		if (stride == last)
+			break;
+	}
+
+	if (newsize > inode->i_size && inode->i_size % stride_size) {
+		stride = inode->i_size / stride_size;
+		if (stride < first)
+			return prepare_stride(inode, stride, newsize);
+	}
+	return 0;
+}
+
+/* Prepare the stride which changing i_size to newsize cuts or grows */
+int tux3_prepare_resize(struct inode *inode, loff_t newsize)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printf("%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct sb *sb = tux_sb(inode->i_sb);
+	loff_t stride_size = COMPRESSION_STRIDE_LEN << sb->blockbits;
+
+	if (newsize > inode->i_size) {
+		if (inode->i_size % stride_size)
+			return prepare_stride(inode, inode->i_size / stride_size,
+					      newsize);
+		return 0;
+	}
+
+	/* Strides from newsize are chopped */
+	tux3_invalidate_strides(inode, newsize / stride_size, TUXKEY_LIMIT);
+	if (newsize % stride_size)
+		return prepare_stride(inode, newsize / stride_size, newsize);
+	return 0;
 }
 
 #endif
@@ -0,0 +1,107 @@
+// gcc -std=gnu99 -O2 hugepool.c -o hugepool && ./hugepool [pool MB] [reads M] [blocksize]
+
+/*
+ * Buffer pool TLB benchmark. Lays out a data pool the way
+ * preallocate_buffers() does, once on normal pages and once on 2MB
+ * pages (hugetlb, else madvise(MADV_HUGEPAGE)), then reads one word
+ * plus one cache line at a random offset of random blocks, like btree
+ * probes through the buffer cache do. Pool should be much bigger than
+ * what the TLB covers with 4KB pages to see a difference.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#define HUGEPAGE_SIZE	(2UL << 20)
+
+static double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static uint64_t rnd = 88172645463325252ULL;
+
+static inline uint64_t xorshift(void)
+{
+	rnd ^= rnd << 13;
+	rnd ^= rnd >> 7;
+	rnd ^= rnd << 17;
+	return rnd;
+}
+
+static void *alloc_pool(size_t size, int huge, const char **how)
+{
+	void *pool;
+
+	if (huge) {
+		pool = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (pool != MAP_FAILED) {
+			*how = "hugetlb";
+			return pool;
+		}
+		if (!posix_memalign(&pool, HUGEPAGE_SIZE, size)) {
+			*how = madvise(pool, size, MADV_HUGEPAGE) ?
+				"normal (no THP)" : "THP";
+			return pool;
+		}
+		return NULL;
+	}
+	if (posix_memalign(&pool, 512, size))
+		return NULL;
+	/* Keep THP away from the baseline */
+	madvise(pool, size, MADV_NOHUGEPAGE);
+	*how = "normal";
+	return pool;
+}
+
+static void run(size_t size, unsigned long reads, unsigned blocksize, int huge)
+{
+	const char *how = NULL;
+	char *pool = alloc_pool(size, huge, &how);
+	if (!pool) {
+		fprintf(stderr, "unable to allocate %zu bytes\n", size);
+		exit(1);
+	}
+	memset(pool, 1, size);	/* fault everything in */
+
+	size_t blocks = size / blocksize;
+	unsigned long sum = 0;
+	double start = now();
+	for (unsigned long i = 0; i < reads; i++) {
+		uint64_t r = xorshift();
+		char *data = pool + (r % blocks) * blocksize;
+		data += (r >> 40) % (blocksize / 64) * 64;
+		sum += *(volatile unsigned long *)data;
+	}
+	double secs = now() - start;
+
+	printf("%-16s %8.1f M reads/s  %6.1f ns/read  (%lu)\n", how,
+	       reads / secs / 1e6, secs * 1e9 / reads, sum & 1);
+
+	if (!strcmp(how, "hugetlb"))
+		munmap(pool, size);
+	else
+		free(pool);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t mb = argc > 1 ? strtoul(argv[1], NULL, 0) : 4096;
+	unsigned long reads = (argc > 2 ? strtoul(argv[2], NULL, 0) : 50) * 1000000UL;
+	unsigned blocksize = argc > 3 ? strtoul(argv[3], NULL, 0) : 4096;
+	size_t size = mb << 20;
+
+	size = (size + HUGEPAGE_SIZE - 1) & ~(HUGEPAGE_SIZE - 1);
+	printf("pool %zu MB, %u byte blocks, %lu random reads\n",
+	       size >> 20, blocksize, reads);
+	run(size, reads, blocksize, 0);
+	run(size, reads, blocksize, 1);
+	return 0;
+}
@@ -0,0 +1,100 @@
+// gcc -std=gnu99 -O2 readdir.c -o readdir && ./readdir <dir> [files] [loops]
+
+/*
+ * Directory listing benchmark. Optionally populates <dir> with empty
+ * files, then lists it with getdents64 and reports how many system calls
+ * (hence FUSE readdir round trips, with a cold dentry cache) it took.
+ * Run it against a tux3fuse mount before and after a change to compare.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
+
+struct linux_dirent64 {
+	unsigned long long d_ino;
+	long long d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+static double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void populate(const char *dir, unsigned files)
+{
+	char path[4096];
+	for (unsigned i = 0; i < files; i++) {
+		snprintf(path, sizeof path, "%s/file%08u", dir, i);
+		int fd = open(path, O_CREAT | O_WRONLY, 0644);
+		if (fd < 0 && errno != EEXIST) {
+			perror(path);
+			exit(1);
+		}
+		close(fd);
+	}
+}
+
+static void list(const char *dir, unsigned long *entries, unsigned long *calls)
+{
+	char buf[1 << 16];
+	int fd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		perror(dir);
+		exit(1);
+	}
+	*entries = *calls = 0;
+	while (1) {
+		long got = syscall(SYS_getdents64, fd, buf, sizeof buf);
+		if (got < 0) {
+			perror("getdents64");
+			exit(1);
+		}
+		++*calls;
+		if (!got)
+			break;
+		for (long pos = 0; pos < got;) {
+			struct linux_dirent64 *d = (void *)(buf + pos);
+			++*entries;
+			pos += d->d_reclen;
+		}
+	}
+	close(fd);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <dir> [files] [loops]\n", argv[0]);
+		return 1;
+	}
+	const char *dir = argv[1];
+	unsigned files = argc > 2 ? strtoul(argv[2], NULL, 0) : 0;
+	unsigned loops = argc > 3 ? strtoul(argv[3], NULL, 0) : 10;
+	unsigned long entries, calls;
+
+	if (files) {
+		double start = now();
+		populate(dir, files);
+		printf("created %u files in %.3fs\n", files, now() - start);
+	}
+
+	double start = now();
+	for (unsigned i = 0; i < loops; i++)
+		list(dir, &entries, &calls);
+	double secs = (now() - start) / loops;
+
+	printf("%lu entries, %lu getdents calls, %.3f ms per listing, %.0f entries/s\n",
+	       entries, calls, secs * 1e3, entries / secs);
+	return 0;
+}
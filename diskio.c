@@ -1,9 +1,13 @@
+#include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <inttypes.h>
 #include <linux/fs.h> // for BLKGETSIZE
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 #include "trace.h"
 #include "diskio.h"
 
@@ -237,6 +241,27 @@ int streamwrite(int fd, void *data, size_t count)
 	return iorel(fd, data, count, 1);
 }
 
+/* Alignment of offset, length and memory for O_DIRECT on fd */
+int fdalign(int fd, unsigned *align)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct stat stat;
+	int size;
+	if (fstat(fd, &stat))
+		return -1;
+	if (S_ISREG(stat.st_mode)) {
+		*align = stat.st_blksize;
+		return 0;
+	}
+	if (ioctl(fd, BLKSSZGET, &size))
+		return -1;
+	*align = size;
+	return 0;
+}
+
 int fdsize64(int fd, loff_t *size)
 {
 	if(DEBUG_MODE_U==1)
@@ -252,3 +277,229 @@ int fdsize64(int fd, loff_t *size)
 	}
 	return ioctl(fd, BLKGETSIZE64, size);
 }
+
+/*
+ * io_uring backend (raw syscalls, no liburing). Callers queue vectored
+ * reads/writes with a cookie, and iouring_reap() hands each completion
+ * to the ->done callback. This is not thread safe, callers serialize.
+ */
+
+struct iouring {
+	int fd;
+	unsigned entries;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_size, cq_size, sqes_size;
+	unsigned queued;	/* sqes not yet submitted */
+	unsigned inflight;	/* submitted, not yet reaped */
+	iouring_done_t done;
+};
+
+struct iouring *iouring_init(unsigned entries, iouring_done_t done)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct io_uring_params p = {};
+	struct iouring *ring;
+	int fd;
+
+	fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (fd < 0)
+		return NULL;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		goto error;
+	ring->fd = fd;
+	ring->entries = p.sq_entries;
+	ring->done = done;
+
+	ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring->sq_ring = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	ring->cq_ring = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED ||
+	    ring->sqes == MAP_FAILED)
+		goto error_unmap;
+
+	ring->sq_head = ring->sq_ring + p.sq_off.head;
+	ring->sq_tail = ring->sq_ring + p.sq_off.tail;
+	ring->sq_mask = ring->sq_ring + p.sq_off.ring_mask;
+	ring->sq_array = ring->sq_ring + p.sq_off.array;
+	ring->cq_head = ring->cq_ring + p.cq_off.head;
+	ring->cq_tail = ring->cq_ring + p.cq_off.tail;
+	ring->cq_mask = ring->cq_ring + p.cq_off.ring_mask;
+	ring->cqes = ring->cq_ring + p.cq_off.cqes;
+
+	return ring;
+
+error_unmap:
+	if (ring->sq_ring != MAP_FAILED)
+		munmap(ring->sq_ring, ring->sq_size);
+	if (ring->cq_ring != MAP_FAILED)
+		munmap(ring->cq_ring, ring->cq_size);
+	if (ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_size);
+	free(ring);
+error:
+	close(fd);
+	return NULL;
+}
+
+void iouring_exit(struct iouring *ring)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	/* Caller must have reaped all I/O */
+	assert(!ring->queued && !ring->inflight);
+	munmap(ring->sq_ring, ring->sq_size);
+	munmap(ring->cq_ring, ring->cq_size);
+	munmap(ring->sqes, ring->sqes_size);
+	close(ring->fd);
+	free(ring);
+}
+
+static int iouring_submit(struct iouring *ring)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	while (ring->queued) {
+		int ret = syscall(__NR_io_uring_enter, ring->fd, ring->queued,
+				  0, 0, NULL, 0);
+		if (ret == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			return -errno;
+		}
+		ring->queued -= ret;
+		ring->inflight += ret;
+	}
+	return 0;
+}
+
+/*
+ * Call ->done for completed I/O. If wait, block until at least one
+ * completes (unless nothing is in flight). Returns number reaped.
+ */
+int iouring_reap(struct iouring *ring, int wait)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	int err, count = 0;
+
+	err = iouring_submit(ring);
+	if (err)
+		return err;
+
+	while (1) {
+		unsigned head = *ring->cq_head;
+		if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe *cqe;
+			void *data;
+			int res;
+
+			cqe = &ring->cqes[head & *ring->cq_mask];
+			data = (void *)(uintptr_t)cqe->user_data;
+			res = cqe->res;
+			__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+			ring->inflight--;
+
+			ring->done(data, res);
+			count++;
+			continue;
+		}
+		if (!wait || count || !ring->inflight)
+			break;
+
+		err = syscall(__NR_io_uring_enter, ring->fd, 0, 1,
+			      IORING_ENTER_GETEVENTS, NULL, 0);
+		if (err == -1 && errno != EINTR)
+			return -errno;
+	}
+
+	return count;
+}
+
+/*
+ * Block until a completion is ready to reap (unless nothing is in
+ * flight), without calling ->done. So the caller can wait without its
+ * lock, and reap under it.
+ */
+int iouring_wait(struct iouring *ring)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	int err;
+
+	err = iouring_submit(ring);
+	if (err)
+		return err;
+
+	while (ring->inflight &&
+	       *ring->cq_head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		err = syscall(__NR_io_uring_enter, ring->fd, 0, 1,
+			      IORING_ENTER_GETEVENTS, NULL, 0);
+		if (err == -1 && errno != EINTR)
+			return -errno;
+	}
+
+	return 0;
+}
+
+/*
+ * Queue vectored read or write. This may submit queued I/O, or reap
+ * completions to make room. iov must be valid until ->done is called.
+ */
+int iouring_queue(struct iouring *ring, int fd, struct iovec *iov,
+		  int iovcnt, int out, off_t offset, void *data)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct io_uring_sqe *sqe;
+	unsigned tail, index;
+	int err;
+
+	/* Keep completions within the CQ ring */
+	while (ring->queued + ring->inflight >= ring->entries) {
+		err = iouring_reap(ring, 1);
+		if (err < 0)
+			return err;
+	}
+
+	tail = *ring->sq_tail;
+	index = tail & *ring->sq_mask;
+	sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = out ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)iov;
+	sqe->len = iovcnt;
+	sqe->off = offset;
+	sqe->user_data = (uintptr_t)data;
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->queued++;
+
+	return 0;
+}
@@ -12,5 +12,15 @@ int diskwrite(int fd, void *data, size_t count, off_t offset);
 int streamread(int fd, void *data, size_t count);
 int streamwrite(int fd, void *data, size_t count);
 int fdsize64(int fd, loff_t *size);
+int fdalign(int fd, unsigned *align);
+
+struct iouring;
+typedef void (*iouring_done_t)(void *data, int res);
+struct iouring *iouring_init(unsigned entries, iouring_done_t done);
+void iouring_exit(struct iouring *ring);
+int iouring_reap(struct iouring *ring, int wait);
+int iouring_wait(struct iouring *ring);
+int iouring_queue(struct iouring *ring, int fd, struct iovec *iov,
+		  int iovcnt, int out, off_t offset, void *data);
 
 #endif /* !TUX3_DISKIO_H */
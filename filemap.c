@@ -177,6 +177,7 @@ static int filemap_extent_io(enum map_mode mode, int rw, struct bufvec *bufvec)
 			if(DEBUG_MODE_U==1){printf("\t\t\t\t%25s[U]  %25s  %4d  #out\n",__FILE__,__func__,__LINE__);};return err;
 		}
 		bufvec_io = &bufvec_ahead;
+		count_readahead(bufvec_contig_count(bufvec_io) - 1);
 	} else {
 		bufvec_io = bufvec;
 	}
@@ -233,7 +234,13 @@ static int filemap_extent_io(enum map_mode mode, int rw, struct bufvec *bufvec)
 	if(DEBUG_MODE_U==1){printf("\t\t\t\t%25s[U]  %25s  %4d  #out\n",__FILE__,__func__,__LINE__);};return err;
 }
 
-static int tuxio(struct file *file, void *data, unsigned len, int write)
+/*
+ * If fill is set, data is the opaque argument to fill, and fill is
+ * called to produce the written bytes straight into the buffer
+ * instead of copying them from a flat source.
+ */
+static int __tuxio(struct file *file, void *data, unsigned len, int write,
+		   tuxio_fill_t fill)
 {
 	if(DEBUG_MODE_U==1)
 	{
@@ -244,23 +251,7 @@ static int tuxio(struct file *file, void *data, unsigned len, int write)
 	struct sb *sb = tux_sb(inode->i_sb);
 	loff_t pos = file->f_pos;
 	int err = 0;
-	/*AplaCode*/
-	//int len=inode->i_size;
-	lzo_uint stride_len;
-	char *clone1[COMPRESSION_STRIDE_LEN];
-	unsigned char *compressed_data;
-	unsigned decompressed_length;
-	int i,r;
-	unsigned len2=len;
-	int stride_count=1;
-	int blocks_count=0;
-	init_stride();
-	/*if(!write)
-	{
-		printf("\n$$!Full length : %u, inode full length : %Ld, inode compressed length : %Ld\n",len,inode->i_size,(tux_inode(inode))->i_size_compr);
-		len=(tux_inode(inode))->i_size_compr;
-	}*/
-	/*AplaCode*/
+
 	trace("%s %u bytes at %Lu, isize = 0x%Lx",
 	      write ? "write" : "read", len, (s64)pos, (s64)inode->i_size);
 	if (write && pos + len > sb->s_maxbytes)
@@ -275,9 +266,24 @@ static int tuxio(struct file *file, void *data, unsigned len, int write)
 		len = inode->i_size - pos;
 	}
 
+	if (!write && is_compressed_file(inode)) {
+		err = tux3_read_strides(inode, pos, data, len);
+		if (!err)
+			file->f_pos = pos + len;
+		if(DEBUG_MODE_U==1){printf("\t\t\t\t%25s[U]  %25s  %4d  #out\n",__FILE__,__func__,__LINE__);};return err ? err : len;
+	}
+
 	if (write) {
 		tux3_iattrdirty(inode);
 		inode->i_mtime = inode->i_ctime = gettime();
+		/* Strides written in part have to be read in first */
+		if (is_compressed_file(inode)) {
+			err = tux3_prepare_write(inode, pos, len);
+			if (err)
+			{
+				if(DEBUG_MODE_U==1){printf("\t\t\t\t%25s[U]  %25s  %4d  #out\n",__FILE__,__func__,__LINE__);};return err;
+			}
+		}
 	}
 
 	unsigned bbits = sb->blockbits;
@@ -299,9 +305,6 @@ static int tuxio(struct file *file, void *data, unsigned len, int write)
 			err = -EIO;
 			break;
 		}
-		if(!write)
-		{
-		}
 
 		if (write) {
 			clone = blockdirty(buffer, delta);
@@ -311,78 +314,27 @@ static int tuxio(struct file *file, void *data, unsigned len, int write)
 				break;
 			}
 
-			memcpy(bufdata(clone) + from, data, some);
-			mark_buffer_dirty_non(clone);
-		} 
-		else 
-		{
-			clone=buffer;
-			//assert(is_stride_initialised());
-			if(is_compressed_file(inode))
-			{
-				clone1[blocks_count]=malloc(PAGE_SIZE_1);
-				memcpy(clone1[blocks_count],buffer->data,PAGE_SIZE_1);
-				printf("\nstride Count : %d ; count : %d\n",stride_count,blocks_count);
-				blocks_count++;
-				
-				if(blocks_count==(em.num[stride_count]))
-				{
-					compressed_data=malloc(PAGE_SIZE_1*COMPRESSION_STRIDE_LEN);
-					for(i=0;i<em.num[stride_count];i++)
-					{
-						memcpy(compressed_data+i*PAGE_SIZE_1,(void *)clone1[i], some);
-						//decompressed_data=decompressed_data+PAGE_SIZE_1;	
-						free(clone1[i]);
-					}
-					
-					printf("\n-----------------------------------------------------------------------\n");
-					for(i=0;i<PAGE_SIZE_1*em.num[stride_count];i++)
-					{
-						printf("%c",*(char *)(compressed_data+i));
-					}
-					printf("\n-----------------------------------------------------------------------\n");
-					//decompressed_data-=em.num[stride_count]*PAGE_SIZE_1;
-					
-					stride_len = (em.num[stride_count])*PAGE_SIZE_1;
-					r = lzo1x_decompress(compressed_data,stride_len,data+(stride_count-1)*PAGE_SIZE_1*COMPRESSION_STRIDE_LEN,(lzo_uint *)&decompressed_length,NULL);
-					if (r == LZO_E_OK)
-						printf("decompressed %lu bytes back into %lu bytes\n",
-									(unsigned long) decompressed_length, (unsigned long) stride_len);
-					//len2=len2+decompressed_length;
-					/*
-					printf("----------------------------Decompressed data----------------------------\n");
-					for(i=(stride_count-1)*PAGE_SIZE_1*COMPRESSION_STRIDE_LEN;i<stride_count*PAGE_SIZE_1*COMPRESSION_STRIDE_LEN;i++)
-					{
-						printf("%c",*(char *)(data+i));
-					}
-					printf("-----------------------------------------------------------------------\n");
-					*/
-					blocks_count=0;
-					free(compressed_data);
-					stride_count++;
-				}
-			}
+			if (fill)
+				err = fill(data, bufdata(clone) + from, some);
 			else
-			{
-				memcpy(data, bufdata(clone) + from, some);
+				memcpy(bufdata(clone) + from, data, some);
+			if (err) {
+				blockput(clone);
+				break;
 			}
-			
-		}			
+			mark_buffer_dirty_non(clone);
+		} 
+		else {
+			clone = buffer;
+			memcpy(data, bufdata(clone) + from, some);
+		}
 		trace_off("transfer %u bytes, block 0x%Lx, buffer %p",
 			  some, bufindex(clone), buffer);
-		blockput(clone);			
-		if(stride_count==em.count && !write && is_compressed_file(inode))
-		{
-			tail=0;
-			pos=0;
-			break;
-		}
+		blockput(clone);
 		tail -= some;
 		pos += some;
-		if(write || !is_compressed_file(inode))
+		if (!fill)
 			data += some;
-		printf("pos %u,some %u, tail %u",(unsigned int)pos,(unsigned int)some,(unsigned int)tail);
-					
 	}
 	file->f_pos = pos;
 	
@@ -391,7 +343,12 @@ static int tuxio(struct file *file, void *data, unsigned len, int write)
 			inode->i_size = pos;
 		tux3_mark_inode_dirty(inode);
 	}					
-	if(DEBUG_MODE_U==1){printf("\t\t\t\t%25s[U]  %25s  %4d  #out\n",__FILE__,__func__,__LINE__);};return err ? err : (!is_compressed_file(inode)?len - tail:len2);
+	if(DEBUG_MODE_U==1){printf("\t\t\t\t%25s[U]  %25s  %4d  #out\n",__FILE__,__func__,__LINE__);};return err ? err : len - tail;
+}
+
+static int tuxio(struct file *file, void *data, unsigned len, int write)
+{
+	return __tuxio(file, data, len, write, NULL);
 }
 
 int tuxread(struct file *file, void *data, unsigned len)
@@ -417,6 +374,220 @@ int tuxwrite(struct file *file, const void *data, unsigned len)
 	if(DEBUG_MODE_U==1){printf("\t\t\t\t%25s[U]  %25s  %4d  #out\n",__FILE__,__func__,__LINE__);};return ret;
 }
 
+/*
+ * Read count blocks missing from cache at index into private buffers,
+ * with one map_region() for the run and one devio_vec() per segment,
+ * and sb->fs_lock released across the I/O. Buffers are hashed only
+ * after the I/O, so nobody sees them half read. Blocks are never
+ * overwritten in place, so the data is valid unless a block was freed
+ * (and maybe reused) meanwhile. If one was, or the inode was changed,
+ * the buffers are dropped and the caller falls back to blockread().
+ * Pins the buffers into buffers[], iov[] is just room for the I/O.
+ * Returns the number of pinned buffers, which is less than count if
+ * the mapping didn't fit in one pass, 0 to fall back, or error.
+ */
+static int tuxread_unlocked(struct inode *inode, block_t index,
+			    unsigned count, struct buffer_head **buffers,
+			    struct iovec *iov)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct sb *sb = tux_sb(inode->i_sb);
+	map_t *map = mapping(inode);
+	struct block_segment seg[10];
+	unsigned long bfree_seq = sb->bfree_seq;
+	struct timespec ctime = inode->i_ctime;
+	loff_t size = inode->i_size;
+	unsigned done, i;
+	int segs, err = 0;
+
+	segs = map_region(inode, index, count, seg, ARRAY_SIZE(seg), MAP_READ);
+	if (segs < 0)
+	{
+		if(DEBUG_MODE_U==1){printf("\t\t\t\t%25s[U]  %25s  %4d  #out\n",__FILE__,__func__,__LINE__);};return segs;
+	}
+	for (count = 0, i = 0; i < segs; i++)
+		count += seg[i].count;
+
+	for (i = 0; i < count; i++) {
+		buffers[i] = new_buffer(map);
+		if (IS_ERR(buffers[i]))
+			break;
+		iov[i] = (struct iovec){
+			.iov_base	= bufdata(buffers[i]),
+			.iov_len	= bufsize(buffers[i]),
+		};
+	}
+	count = i;
+	if (!count)
+	{
+		if(DEBUG_MODE_U==1){printf("\t\t\t\t%25s[U]  %25s  %4d  #out\n",__FILE__,__func__,__LINE__);};return 0;
+	}
+
+	tux3_unlock_fs(sb);
+	for (done = 0, i = 0; i < segs && done < count; i++) {
+		unsigned some = min(seg[i].count, count - done);
+
+		if (seg[i].state == BLOCK_SEG_HOLE) {
+			for (unsigned j = done; j < done + some; j++)
+				memset(iov[j].iov_base, 0, iov[j].iov_len);
+		} else {
+			err = devio_vec(READ, sb_dev(sb),
+					seg[i].block << sb->blockbits,
+					iov + done, some);
+			if (err)
+				break;
+		}
+		done += some;
+	}
+	tux3_lock_fs(sb);
+
+	/* Blocks may be reused, or inode was truncated or written */
+	if (err || sb->bfree_seq != bfree_seq || inode->i_size != size ||
+	    inode->i_ctime.tv_sec != ctime.tv_sec ||
+	    inode->i_ctime.tv_nsec != ctime.tv_nsec)
+		done = 0;
+
+	for (i = 0; i < done; i++) {
+		/* Someone may have cached the block meanwhile */
+		struct buffer_head *buffer = peekblk(map, index + i);
+		if (!buffer) {
+			/* Private reference becomes the pin */
+			buffer = buffers[i];
+			buffer->index = index + i;
+			insert_buffer_hash(buffer);
+			set_buffer_clean(buffer);
+			continue;
+		}
+		if (buffer_empty(buffer)) {
+			memcpy(bufdata(buffer), bufdata(buffers[i]),
+			       bufsize(buffer));
+			set_buffer_clean(buffer);
+		}
+		blockput(buffers[i]);
+		buffers[i] = buffer;
+	}
+	for (i = done; i < count; i++)
+		blockput(buffers[i]);
+	count_reads(done);
+
+	if(DEBUG_MODE_U==1){printf("\t\t\t\t%25s[U]  %25s  %4d  #out\n",__FILE__,__func__,__LINE__);};return done;
+}
+
+/*
+ * Pin the cached buffers covering len bytes at pos, reading them in if
+ * needed, and point iov at their data. Each run of missing blocks is
+ * read by tuxread_unlocked(), without sb->fs_lock across the I/O, so
+ * an uncached range takes one map_region() and one I/O per extent.
+ * Nothing is read past the range, readahead is up to the kernel.
+ * Caller must hold sb->fs_lock and no other lock, clamp the range to
+ * i_size, provide room for one entry per block, and release the
+ * buffers with tuxread_unpin().
+ * Returns the number of pinned buffers.
+ */
+int tuxread_pin(struct inode *inode, loff_t pos, unsigned len,
+		struct buffer_head **buffers, struct iovec *iov)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct sb *sb = tux_sb(inode->i_sb);
+	map_t *map = mapping(inode);
+	unsigned bsize = sb->blocksize;
+	unsigned bmask = sb->blockmask;
+	block_t index = pos >> sb->blockbits;
+	unsigned from = pos & bmask;
+	unsigned nr = (from + len + bmask) >> sb->blockbits;
+	unsigned count = 0;
+
+	assert(!is_compressed_file(inode));
+	assert(pos + len <= inode->i_size);
+
+	while (count < nr) {
+		struct buffer_head *buffer = peekblk(map, index + count);
+		unsigned run;
+		int got;
+
+		if (buffer && !buffer_empty(buffer)) {
+			buffers[count++] = buffer;
+			continue;
+		}
+		if (buffer) {
+			/* Cached but not read yet, read under the lock */
+			blockput(buffer);
+			got = 0;
+		} else {
+			/* Missing up to the next cached block */
+			for (run = 1; count + run < nr; run++) {
+				buffer = peekblk(map, index + count + run);
+				if (buffer) {
+					blockput(buffer);
+					break;
+				}
+			}
+			got = tuxread_unlocked(inode, index + count, run,
+					       buffers + count, iov + count);
+			if (got < 0) {
+				tuxread_unpin(buffers, count);
+				if(DEBUG_MODE_U==1){printf("\t\t\t\t%25s[U]  %25s  %4d  #out\n",__FILE__,__func__,__LINE__);};return got;
+			}
+		}
+		if (!got) {
+			buffer = blockread(map, index + count);
+			if (!buffer) {
+				tuxread_unpin(buffers, count);
+				if(DEBUG_MODE_U==1){printf("\t\t\t\t%25s[U]  %25s  %4d  #out\n",__FILE__,__func__,__LINE__);};return -EIO;
+			}
+			buffers[count] = buffer;
+			got = 1;
+		}
+		count += got;
+	}
+
+	for (unsigned i = 0; i < count; i++) {
+		unsigned some = min(bsize - from, len);
+
+		iov[i] = (struct iovec){
+			.iov_base	= bufdata(buffers[i]) + from,
+			.iov_len	= some,
+		};
+		len -= some;
+		from = 0;
+	}
+
+	if(DEBUG_MODE_U==1){printf("\t\t\t\t%25s[U]  %25s  %4d  #out\n",__FILE__,__func__,__LINE__);};return count;
+}
+
+void tuxread_unpin(struct buffer_head **buffers, int count)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	for (int i = 0; i < count; i++)
+		blockput(buffers[i]);
+	if(DEBUG_MODE_U==1){printf("\t\t\t\t%25s[U]  %25s  %4d  #out\n",__FILE__,__func__,__LINE__);}
+}
+
+/* Write len bytes at f_pos, letting fill copy each piece into the cache */
+int tuxwrite_fill(struct file *file, unsigned len, tuxio_fill_t fill,
+		  void *info)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct sb *sb = file->f_inode->i_sb;
+	int ret;
+	change_begin(sb);
+	ret = __tuxio(file, info, len, 1, fill);
+	change_end(sb);
+	if(DEBUG_MODE_U==1){printf("\t\t\t\t%25s[U]  %25s  %4d  #out\n",__FILE__,__func__,__LINE__);};return ret;
+}
+
 void tuxseek(struct file *file, loff_t pos)
 {
 	if(DEBUG_MODE_U==1)
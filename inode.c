@@ -82,6 +82,21 @@ void remove_inode_hash(struct inode *inode)
 		hlist_del_init(&inode->i_hash);
 }
 
+/* In-core inodes come from a slab, inode_init() does the full init */
+static struct kmem_cache *tux_inode_cachep;
+static pthread_once_t tux_inode_cache_once = PTHREAD_ONCE_INIT;
+
+static void init_inode_cache(void)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	tux_inode_cachep = kmem_cache_create("tux3_inode_cache",
+			sizeof(struct tux3_inode), 0, SLAB_HWCACHE_ALIGN, NULL);
+	assert(tux_inode_cachep);
+}
+
 static struct inode *new_inode(struct sb *sb)
 {
 	if(DEBUG_MODE_U==1)
@@ -91,7 +106,8 @@ static struct inode *new_inode(struct sb *sb)
 	struct tux3_inode *tuxnode;
 	struct inode *inode;
 
-	tuxnode = malloc(sizeof(*tuxnode));
+	pthread_once(&tux_inode_cache_once, init_inode_cache);
+	tuxnode = kmem_cache_alloc(tux_inode_cachep, GFP_NOFS);
 	if (!tuxnode)
 		goto error;
 
@@ -107,7 +123,7 @@ static struct inode *new_inode(struct sb *sb)
 	return inode;
 
 error_map:
-	free(tuxnode);
+	kmem_cache_free(tux_inode_cachep, tuxnode);
 error:
 	return NULL;
 }
@@ -124,8 +140,9 @@ static void free_inode(struct inode *inode)
 
 	free_inode_check(tuxnode);
 
+	tux3_invalidate_strides(inode, 0, TUXKEY_LIMIT);
 	free_map(mapping(inode));
-	free(tuxnode);
+	kmem_cache_free(tux_inode_cachep, tuxnode);
 }
 
 /* This is just to clean inode is partially initialized */
@@ -491,3 +508,41 @@ int tuxtruncate(struct inode *inode, loff_t size)
 
 	return err;
 }
+
+/* FS_IOC_SETFLAGS by inode number, for files and directories alike */
+int tuxsetflags(struct sb *sb, inum_t inum, unsigned flags)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct inode *inode;
+	int err;
+
+	inode = tux3_iget(sb, inum);
+	if (IS_ERR(inode))
+		return PTR_ERR(inode);
+	err = tux3_set_flags(inode, flags);
+	iput(inode);
+
+	return err;
+}
+
+/* TUX3_IOC_SET_CODEC by inode number, for files and directories alike */
+int tuxsetcodec(struct sb *sb, inum_t inum, unsigned codec)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct inode *inode;
+	int err;
+
+	inode = tux3_iget(sb, inum);
+	if (IS_ERR(inode))
+		return PTR_ERR(inode);
+	err = tux3_set_codec(inode, codec);
+	iput(inode);
+
+	return err;
+}
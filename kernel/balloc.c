@@ -488,6 +488,10 @@ int bfree(struct sb *sb, block_t start, unsigned blocks)
 	}
 	assert(tux3_under_backend(sb));
 	trace("bfree extent [block %Lx, count %x], ", start, blocks);
+#ifndef __KERNEL__
+	/* Freed blocks can be reused, tell it to unlocked readers */
+	sb->bfree_seq++;
+#endif
 	return bitmap_test_and_modify(sb, start, blocks, 0);
 }
 
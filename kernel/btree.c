@@ -319,6 +319,27 @@ static inline int alloc_cursor_size(int count)
 	return sizeof(struct cursor) + sizeof(struct path_level) * count;
 }
 
+/*
+ * Cursors are allocated and freed for nearly every btree operation, so
+ * take them from a slab. Any sane tree fits in CURSOR_CACHED_LEVELS,
+ * deeper ones fall back to malloc.
+ */
+#define CURSOR_CACHED_LEVELS	8
+
+static struct kmem_cache *cursor_cachep;
+static pthread_once_t cursor_cache_once = PTHREAD_ONCE_INIT;
+
+static void init_cursor_cache(void)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printf("\t\t\t\t%25s[K]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	cursor_cachep = kmem_cache_create("tux3_cursor",
+			alloc_cursor_size(CURSOR_CACHED_LEVELS), 0,
+			SLAB_HWCACHE_ALIGN, NULL);
+}
+
 struct cursor *alloc_cursor(struct btree *btree, int extra)
 {
 	if(DEBUG_MODE_K==1)
@@ -326,13 +347,19 @@ struct cursor *alloc_cursor(struct btree *btree, int extra)
 		printf("\t\t\t\t%25s[K]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
 	int maxlevel = btree->root.depth + extra;
-	struct cursor *cursor = malloc(alloc_cursor_size(maxlevel + 1));
+	struct cursor *cursor;
+
+	pthread_once(&cursor_cache_once, init_cursor_cache);
+	if (maxlevel < CURSOR_CACHED_LEVELS && cursor_cachep)
+		cursor = kmem_cache_alloc(cursor_cachep, GFP_NOFS);
+	else
+		cursor = malloc(alloc_cursor_size(maxlevel + 1));
 
 	if (cursor) {
 		cursor->btree = btree;
 		cursor->level = -1;
-#ifdef CURSOR_DEBUG
 		cursor->maxlevel = maxlevel;
+#ifdef CURSOR_DEBUG
 		for (int i = 0; i <= maxlevel; i++) {
 			cursor->path[i].buffer = FREE_BUFFER; /* for debug */
 			cursor->path[i].next = FREE_NEXT; /* for debug */
@@ -351,7 +378,10 @@ void free_cursor(struct cursor *cursor)
 #ifdef CURSOR_DEBUG
 	assert(cursor->level == -1);
 #endif
-	free(cursor);
+	if (cursor->maxlevel < CURSOR_CACHED_LEVELS && cursor_cachep)
+		kmem_cache_free(cursor_cachep, cursor);
+	else
+		free(cursor);
 }
 
 /* Lookup the index entry contains key */
@@ -16,6 +16,7 @@
 
 static void __delta_transition(struct sb *sb, struct delta_ref *delta_ref);
 static void schedule_flush_delta(struct sb *sb);
+static int need_delta(struct sb *sb);
 
 /*
  * Need frontend modification of backend buffers. (modification
@@ -26,6 +27,14 @@ static void schedule_flush_delta(struct sb *sb);
  */
 #define ALLOW_FRONTEND_MODIFY
 
+const struct tux3_policy tux3_default_policy = {
+	.delta_bytes		= 8 << 20,
+	.delta_ratio		= 50,
+	.delta_interval		= 5 * 1000,
+	.unify_logblocks	= 256,
+	.unify_interval		= 30 * 1000,
+};
+
 /* Initialize the lock and list */
 static void init_sb(struct sb *sb)
 {
@@ -57,6 +66,17 @@ static void init_sb(struct sb *sb)
 	/* Initialize sb_delta_dirty */
 	for (i = 0; i < ARRAY_SIZE(sb->s_ddc); i++)
 		INIT_LIST_HEAD(&sb->s_ddc[i].dirty_inodes);
+
+	sb->policy = tux3_default_policy;
+	sb->unify_start = tux3_msecs();
+#ifndef __KERNEL__
+	pthread_mutex_init(&sb->fs_lock, NULL);
+	pthread_cond_init(&sb->flush_wait, NULL);
+	pthread_cond_init(&sb->commit_wait, NULL);
+	pthread_mutex_init(&sb->group_lock, NULL);
+	pthread_cond_init(&sb->group_wait, NULL);
+	pthread_mutex_init(&sb->workspace_lock, NULL);
+#endif
 }
 
 static void setup_roots(struct sb *sb, struct disksuper *super)
@@ -424,14 +444,28 @@ static void post_commit(struct sb *sb, unsigned delta)
 	tux3_clear_dirty_inodes(sb, delta);
 }
 
+/*
+ * Unify when the log chain gets long (replay cost), when it has been a
+ * while, or when dirty metadata pinned until unify fills the cache.
+ */
 static int need_unify(struct sb *sb)
 {
 	if(DEBUG_MODE_K==1)
 	{
 		printf("\t\t\t\t%25s[K]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	static unsigned crudehack;
-	return !(++crudehack % 3);
+	struct tux3_policy *policy = &sb->policy;
+
+	if (policy->unify_logblocks &&
+	    be32_to_cpu(sb->super.logcount) >= policy->unify_logblocks)
+		return 1;
+	if (policy->unify_interval &&
+	    tux3_msecs() - sb->unify_start >= policy->unify_interval)
+		return 1;
+	if (policy->delta_ratio &&
+	    tux3_dirty_ratio(sb) >= policy->delta_ratio)
+		return 1;
+	return 0;
 }
 
 enum unify_flags { NO_UNIFY, ALLOW_UNIFY, FORCE_UNIFY, };
@@ -509,6 +543,7 @@ static int do_commit(struct sb *sb, enum unify_flags unify_flag)
 		err = unify_log(sb);
 		if (err)
 			return err;
+		sb->unify_start = tux3_msecs();
 
 		/* Add delta log for debugging. */
 		log_delta(sb);
@@ -519,6 +554,7 @@ static int do_commit(struct sb *sb, enum unify_flags unify_flag)
 
 	/* Wait I/O was submitted */
 	tux3_iowait_wait(&iowait);
+	sb->iowait = NULL;
 
 	/*
 	 * Commit last block (for now, this is sync I/O).
@@ -626,6 +662,7 @@ static void __delta_transition(struct sb *sb, struct delta_ref *delta_ref)
 	atomic_set(&delta_ref->refcount, 1);
 	/* Assign the delta number */
 	delta_ref->delta = sb->next_delta++;
+	sb->delta_start = tux3_msecs();
 #ifdef UNIFY_DEBUG
 	delta_ref->unify_flag = ALLOW_UNIFY;
 #endif
@@ -711,6 +748,107 @@ int force_delta(struct sb *sb)
 	return sync_current_delta(sb, NO_UNIFY);
 }
 
+/*
+ * Can inode be committed alone? Only if no other change in the delta
+ * can be referenced from it: a new or removed name lives in a
+ * directory, and xattr names live in atable, so if any of those are
+ * dirty we have to commit the whole delta.
+ */
+static int can_sync_inode(struct sb *sb, struct inode *inode, unsigned delta)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printf("\t\t\t\t%25s[K]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct sb_delta_dirty *s_ddc = tux3_sb_ddc(sb, delta);
+	struct inode_delta_dirty *i_ddc;
+
+	if (!S_ISREG(inode->i_mode) || !inode->i_nlink)
+		return 0;
+	/* Previous delta is still being committed */
+	if (test_bit(TUX3_COMMIT_RUNNING_BIT, &sb->backend_state) ||
+	    test_bit(TUX3_COMMIT_PENDING_BIT, &sb->backend_state))
+		return 0;
+	if (sb->atable->i_state & I_DIRTY)
+		return 0;
+
+	list_for_each_entry(i_ddc, &s_ddc->dirty_inodes, dirty_list) {
+		struct inode *dirty = &i_ddc_to_inode(i_ddc, delta)->vfs_inode;
+		if (!S_ISREG(dirty->i_mode) || !dirty->i_nlink)
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Make the changes of one file stable without closing the current
+ * delta. The file is flushed like do_commit() flushes every dirty
+ * inode, then btree, log and commit block are written, so replay
+ * redoes its allocations and btree updates. The other dirty inodes
+ * stay in the delta, and cost nothing here.
+ *
+ * If the file can't be committed alone, this falls back to
+ * force_delta().
+ */
+int tux3_sync_inode(struct sb *sb, struct inode *inode)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printf("\t\t\t\t%25s[K]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct delta_ref *delta_ref;
+	struct iowait iowait;
+	unsigned delta;
+	int err;
+
+	/* Rough check, tuxnode->flags has the true dirty state */
+	if (!(inode->i_state & I_DIRTY))
+		return 0;
+
+#if TUX3_FLUSHER == TUX3_FLUSHER_SYNC
+	down_write(&sb->delta_lock);
+#endif
+	delta_ref = delta_get(sb);
+	delta = delta_ref->delta;
+	delta_put(sb, delta_ref);
+
+	if (!can_sync_inode(sb, inode, delta)) {
+#if TUX3_FLUSHER == TUX3_FLUSHER_SYNC
+		up_write(&sb->delta_lock);
+#endif
+		return force_delta(sb);
+	}
+
+	trace(">>>>>>>>> sync inode %Lu, delta %u", tux_inode(inode)->inum, delta);
+	tux3_start_backend(sb);
+
+	tux3_iowait_init(&iowait);
+	sb->iowait = &iowait;
+
+	err = tux3_flush_inode(inode, delta);
+	if (!err) {
+		write_btree(sb, delta);
+		write_log(sb);
+	}
+
+	tux3_iowait_wait(&iowait);
+	sb->iowait = NULL;
+
+	if (!err)
+		err = commit_delta(sb);
+	tux3_end_backend();
+
+	if (!err)
+		tux3_clear_dirty_inode_delta(inode, delta);
+	trace("<<<<<<<<< sync inode done %u", delta);
+#if TUX3_FLUSHER == TUX3_FLUSHER_SYNC
+	up_write(&sb->delta_lock);
+#endif
+
+	return err;
+}
+
 unsigned tux3_get_current_delta(void)
 {
 	if(DEBUG_MODE_K==1)
@@ -809,14 +947,28 @@ void change_end_atomic_nested(struct sb *sb, void *ptr)
 	current->journal_info = ptr;
 }
 
+/*
+ * Start a new delta when enough dirty data has built up, when the
+ * cache is under pressure, or when the current delta is old.
+ */
 static int need_delta(struct sb *sb)
 {
 	if(DEBUG_MODE_K==1)
 	{
 		printf("\t\t\t\t%25s[K]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	static unsigned crudehack;
-	return !(++crudehack % 10);
+	struct tux3_policy *policy = &sb->policy;
+
+	if (policy->delta_bytes &&
+	    tux3_dirty_bytes(sb) >= policy->delta_bytes)
+		return 1;
+	if (policy->delta_ratio &&
+	    tux3_dirty_ratio(sb) >= policy->delta_ratio)
+		return 1;
+	if (policy->delta_interval &&
+	    tux3_msecs() - sb->delta_start >= policy->delta_interval)
+		return 1;
+	return 0;
 }
 
 /*
@@ -857,7 +1009,9 @@ int change_end(struct sb *sb)
 		try_delta_transition(sb);
 
 #if TUX3_FLUSHER == TUX3_FLUSHER_SYNC
-	err = flush_pending_delta(sb);
+	/* With the flusher thread, the frontend doesn't wait for commit */
+	if (!tux3_has_flusher(sb))
+		err = flush_pending_delta(sb);
 	up_write(&sb->delta_lock);
 #endif
 
@@ -109,6 +109,18 @@ int tux3_init_flusher(struct sb *sb)
 
 void tux3_exit_flusher(struct sb *sb)
 {
+#ifndef __KERNEL__
+	if (!sb->flush_running)
+		return;
+
+	pthread_mutex_lock(&sb->fs_lock);
+	sb->flush_stop = 1;
+	pthread_cond_signal(&sb->flush_wait);
+	pthread_mutex_unlock(&sb->fs_lock);
+
+	pthread_join(sb->flush_task, NULL);
+	sb->flush_running = 0;
+#endif
 }
 
 static void schedule_flush_delta(struct sb *sb)
@@ -119,6 +131,20 @@ static void schedule_flush_delta(struct sb *sb)
 	}
 	/* Wake up waiters for pending marshal delta */
 	wake_up_all(&sb->delta_event_wq);
+#ifndef __KERNEL__
+	if (sb->flush_running)
+		pthread_cond_signal(&sb->flush_wait);
+#endif
+}
+
+/* Is pending delta flushed by flusher thread, instead of frontend? */
+static int tux3_has_flusher(struct sb *sb)
+{
+#ifdef __KERNEL__
+	return 0;
+#else
+	return sb->flush_running;
+#endif
 }
 
 static int flush_pending_delta(struct sb *sb)
@@ -217,6 +243,46 @@ static int wait_for_commit(struct sb *sb, unsigned delta)
 				   try_flush_pending_until_delta(sb, delta));
 }
 
+#if TUX3_FLUSHER == TUX3_FLUSHER_SYNC && !defined(__KERNEL__)
+/*
+ * Wait until the flusher thread commits the current delta. The
+ * flusher releases sb->fs_lock while writing, so this waits on
+ * sb->commit_wait instead of holding sb->delta_lock.
+ */
+static int sync_delta_by_flusher(struct sb *sb, enum unify_flags unify_flag)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printf("\t\t\t\t%25s[K]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct delta_ref *delta_ref;
+	unsigned delta;
+
+	down_write(&sb->delta_lock);
+	delta_ref = delta_get(sb);
+#ifdef UNIFY_DEBUG
+	delta_ref->unify_flag = unify_flag;
+#endif
+	delta = delta_ref->delta;
+	delta_put(sb, delta_ref);
+	up_write(&sb->delta_lock);
+
+	trace("delta %u", delta);
+
+	while (!delta_after_eq(sb->committed_delta, delta)) {
+		/* Retried after each commit, while flusher is running */
+		if (!delta_after_eq(sb->marshal_delta, delta)) {
+			down_write(&sb->delta_lock);
+			try_delta_transition_until_delta(sb, delta);
+			up_write(&sb->delta_lock);
+		}
+		pthread_cond_wait(&sb->commit_wait, &sb->fs_lock);
+	}
+
+	return 0;
+}
+#endif
+
 static int sync_current_delta(struct sb *sb, enum unify_flags unify_flag)
 {
 	if(DEBUG_MODE_K==1)
@@ -228,6 +294,10 @@ static int sync_current_delta(struct sb *sb, enum unify_flags unify_flag)
 	int err = 0;
 
 #if TUX3_FLUSHER == TUX3_FLUSHER_SYNC
+#ifndef __KERNEL__
+	if (tux3_has_flusher(sb))
+		return sync_delta_by_flusher(sb, unify_flag);
+#endif
 	down_write(&sb->delta_lock);
 #endif
 	/* Get delta that have to write */
@@ -255,4 +325,121 @@ static int sync_current_delta(struct sb *sb, enum unify_flags unify_flag)
 
 	return err;
 }
+
+#if TUX3_FLUSHER == TUX3_FLUSHER_SYNC && !defined(__KERNEL__)
+/* sb flushed by this thread, if this is the flusher thread */
+static __thread struct sb *flusher_sb;
+
+/*
+ * If this is the flusher thread, release sb->fs_lock across the I/O
+ * of the frozen delta. Returns sb to pass to tux3_flusher_relock(),
+ * or NULL if the lock was kept.
+ */
+struct sb *tux3_flusher_unlock(void)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printf("\t\t\t\t%25s[K]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct sb *sb = flusher_sb;
+
+	if (sb)
+		pthread_mutex_unlock(&sb->fs_lock);
+	return sb;
+}
+
+void tux3_flusher_relock(struct sb *sb)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printf("\t\t\t\t%25s[K]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	if (sb)
+		pthread_mutex_lock(&sb->fs_lock);
+}
+
+/*
+ * Userland backend. Frontend only does delta transition, and this
+ * thread commits the pending delta while frontend dirties the next
+ * delta. Marshalling runs under sb->fs_lock, because btree, balloc
+ * and buffer cache have no locks of their own. But the writes of the
+ * frozen delta release it (see tux3_flusher_unlock()), and buffer
+ * state is updated after relocking. Like kernel backend, this doesn't
+ * hold sb->delta_lock, so frontend can change_begin() meanwhile.
+ * This also starts delta transition of idle delta after
+ * sb->policy.delta_interval.
+ */
+static void *flush_delta_work(void *data)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printf("\t\t\t\t%25s[K]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct sb *sb = data;
+
+	pthread_mutex_lock(&sb->fs_lock);
+	flusher_sb = sb;
+	while (1) {
+		if (test_bit(TUX3_COMMIT_PENDING_BIT, &sb->backend_state)) {
+			flush_pending_delta(sb);
+			/* FIXME: error handling */
+			pthread_cond_broadcast(&sb->commit_wait);
+			continue;
+		}
+		if (sb->flush_stop)
+			break;
+
+		if (!sb->policy.delta_interval) {
+			pthread_cond_wait(&sb->flush_wait, &sb->fs_lock);
+			continue;
+		}
+
+		struct timespec ts;
+		unsigned msecs = sb->policy.delta_interval;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += msecs / 1000;
+		ts.tv_nsec += (msecs % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		if (pthread_cond_timedwait(&sb->flush_wait, &sb->fs_lock,
+					   &ts) != ETIMEDOUT)
+			continue;
+
+		/* Timed out, start new delta if current delta has changes */
+		struct delta_ref *delta_ref = delta_get(sb);
+		unsigned delta = delta_ref->delta;
+		delta_put(sb, delta_ref);
+
+		down_write(&sb->delta_lock);
+		if (!list_empty(&tux3_sb_ddc(sb, delta)->dirty_inodes) &&
+		    need_delta(sb))
+			try_delta_transition(sb);
+		up_write(&sb->delta_lock);
+	}
+	pthread_mutex_unlock(&sb->fs_lock);
+
+	return NULL;
+}
+
+/* Start flusher thread. Caller must not hold sb->fs_lock. */
+int tux3_start_flusher(struct sb *sb)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printf("\t\t\t\t%25s[K]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	int err;
+
+	assert(!sb->flush_running);
+	sb->flush_stop = 0;
+	err = pthread_create(&sb->flush_task, NULL, flush_delta_work, sb);
+	if (err)
+		return -err;
+	sb->flush_running = 1;
+
+	return 0;
+}
+#endif
 #endif /* TUX3_FLUSHER == TUX3_FLUSHER_ASYNC_HACK */
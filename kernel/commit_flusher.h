@@ -18,5 +18,10 @@ static inline void tux3_start_periodical_flusher(struct sb *sb) { }
 
 int tux3_init_flusher(struct sb *sb);
 void tux3_exit_flusher(struct sb *sb);
+#if TUX3_FLUSHER == TUX3_FLUSHER_SYNC && !defined(__KERNEL__)
+int tux3_start_flusher(struct sb *sb);
+struct sb *tux3_flusher_unlock(void);
+void tux3_flusher_relock(struct sb *sb);
+#endif
 
 #endif /* !TUX3_COMMIT_FLUSHER_H */
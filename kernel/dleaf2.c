@@ -31,9 +31,6 @@
 
 #include "tux3.h"
 #include "dleaf2.h"
-extern void init_stride(void);
-extern void add_stride(unsigned);
-extern unsigned int is_first;
 /*
  * The uptag is for filesystem integrity checking and corruption
  * repair. It provides the low order bits of the delta at which the
@@ -658,12 +655,7 @@ static int dleaf2_read(struct btree *btree, tuxkey_t key_bottom,
 
 	/* Get start position of logical and physical */
 	get_extent(dex, &next);
-	is_first=!(unsigned int)key->start;
-	if(is_first)
-		init_stride();
 	printf("\n****Logical : %Lx\nPhysical : %Lx\n",next.logical,next.physical);//
-	if(is_first)
-		add_stride(next.logical);
 	physical = next.physical;
 	if (physical)
 		physical += key->start - next.logical;	/* add offset */
@@ -673,8 +665,6 @@ static int dleaf2_read(struct btree *btree, tuxkey_t key_bottom,
 
 		get_extent(dex, &next);
 		printf("\n****Logical : %Lx\nPhysical : %Lx\n",next.logical,next.physical);//
-		if(is_first)
-			add_stride(next.logical);
 		/* Check of logical addr range of current and next. */
 		seg->count = min_t(u64, key->len, next.logical - key->start);
 		if (physical) {
@@ -58,6 +58,7 @@ enum map_mode {
 	MAP_WRITE	= 1,	/* map_region for overwrite */
 	MAP_REDIRECT	= 2,	/* map_region for redirected write
 				 * (copy-on-write) */
+	MAP_PUNCH	= 3,	/* map_region to unmap blocks as hole */
 	MAX_MAP_MODE,
 };
 
@@ -108,6 +109,8 @@ static int map_region1(struct inode *inode, block_t start, unsigned count,
 	int err, segs = 0;
 
 	assert(seg_max > 0);
+	/* Only dleaf2 knows how to record a hole */
+	assert(mode != MAP_PUNCH);
 
 	/*
 	 * bitmap enters here recursively.
@@ -462,9 +465,21 @@ static int redirect_seg_alloc(struct btree *btree, struct dleaf_req *rq,
 	return seg_alloc(btree, rq, write_segs, 0);
 }
 
+static int punch_seg_alloc(struct btree *btree, struct dleaf_req *rq,
+			   int write_segs)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printf("\t\t\t\t%25s[K]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	/* If punch mode, leave seg as hole */
+	return 0;
+}
+
 static int (*seg_alloc_funs[])(struct btree *, struct dleaf_req *, int) = {
 	[MAP_WRITE]	= overwrite_seg_alloc,
 	[MAP_REDIRECT]	= redirect_seg_alloc,
+	[MAP_PUNCH]	= punch_seg_alloc,
 };
 
 /* map_region() by using dleaf2 */
@@ -502,6 +517,15 @@ static int map_region2(struct inode *inode, block_t start, unsigned count,
 			down_write(&btree->lock);
 	}
 
+	if (!has_root(btree) && mode == MAP_PUNCH) {
+		/* Nothing to unmap */
+		seg[0].block = 0;
+		seg[0].count = count;
+		seg[0].state = BLOCK_SEG_HOLE;
+		segs = 1;
+		goto out_unlock;
+	}
+
 	if (!has_root(btree) && mode != MAP_READ) {
 		/*
 		 * Allocate empty btree if this btree doesn't have it yet.
@@ -560,7 +584,11 @@ static int map_region2(struct inode *inode, block_t start, unsigned count,
 	if (mode == MAP_READ)
 		goto out_release;
 
-	if (mode == MAP_REDIRECT) {
+	/* Already hole, nothing to punch */
+	if (mode == MAP_PUNCH && segs == 1 && seg[0].state == BLOCK_SEG_HOLE)
+		goto out_release;
+
+	if (mode == MAP_REDIRECT || mode == MAP_PUNCH) {
 		/* Change the seg[] to redirect this region as one extent */
 		unsigned total = 0;
 		for (int i = 0; i < segs; i++) {
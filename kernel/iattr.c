@@ -28,6 +28,8 @@ unsigned atsize[MAX_ATTRS] = {
 	[DATA_BTREE_ATTR] = 8,
 	[LINK_COUNT_ATTR] = 4,
 	[MTIME_ATTR] = 8,
+	[FLAGS_ATTR] = 4,
+	[CODEC_ATTR] = 4,
 	/* Variable size (extended) attrs */
 	[IDATA_ATTR] = 2,
 	[XATTR_ATTR] = 4,
@@ -150,6 +152,12 @@ void dump_attrs(struct inode *inode)
 		case MTIME_ATTR:
 			__tux3_dbg("mtime %Lx ", tuxtime(inode->i_mtime));
 			break;
+		case FLAGS_ATTR:
+			__tux3_dbg("flags %x ", tuxnode->i_flags);
+			break;
+		case CODEC_ATTR:
+			__tux3_dbg("codec %u ", tuxnode->i_codec);
+			break;
 		case XATTR_ATTR:
 			__tux3_dbg("xattr(s) ");
 			break;
@@ -214,6 +222,12 @@ static void *encode_attrs(struct btree *btree, void *data, void *attrs,
 		case MTIME_ATTR:
 			attrs = encode64(attrs, tuxtime(idata->i_mtime) >> TIME_ATTR_SHIFT);
 			break;
+		case FLAGS_ATTR:
+			attrs = encode32(attrs, idata->i_flags);
+			break;
+		case CODEC_ATTR:
+			attrs = encode32(attrs, idata->i_codec);
+			break;
 		}
 	}
 	return attrs;
@@ -288,6 +302,14 @@ static void *decode_attrs(struct inode *inode, void *attrs, unsigned size)
 			attrs = decode64(attrs, &v64);
 			inode->i_mtime = spectime(v64 << TIME_ATTR_SHIFT);
 			break;
+		case FLAGS_ATTR:
+			attrs = decode32(attrs, &v32);
+			tuxnode->i_flags = v32;
+			break;
+		case CODEC_ATTR:
+			attrs = decode32(attrs, &v32);
+			tuxnode->i_codec = v32;
+			break;
 		case XATTR_ATTR:
 			attrs = decode_xattr(inode, attrs);
 			break;
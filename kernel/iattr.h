@@ -12,8 +12,8 @@ enum atkind {
 	/* i_blocks	= 6 */
 	/* i_generation	= 7 */
 	/* i_version	= 8 */
-	/* i_flag	= 9 */
-	RESERVED1_ATTR	= 10,
+	FLAGS_ATTR	= 9,
+	CODEC_ATTR	= 10,
 	VAR_ATTRS,
 	/* Variable size (extended) attrs */
 	IDATA_ATTR	= 11,
@@ -32,6 +32,8 @@ enum atbit {
 	DATA_BTREE_BIT	= 1 << DATA_BTREE_ATTR,
 	LINK_COUNT_BIT	= 1 << LINK_COUNT_ATTR,
 	MTIME_BIT	= 1 << MTIME_ATTR,
+	FLAGS_BIT	= 1 << FLAGS_ATTR,
+	CODEC_BIT	= 1 << CODEC_ATTR,
 	/* Variable size (extended) attrs */
 	IDATA_BIT	= 1 << IDATA_ATTR,
 	XATTR_BIT	= 1 << XATTR_ATTR,
@@ -75,7 +75,6 @@ static struct inode *tux_new_inode(struct inode *dir, struct tux_iattr *iattr,
 	if (!inode)
 		return NULL;
 	assert(!tux_inode(inode)->present);
-	(tux_inode(inode))->is_compressed=0;
 	inode->i_mode = iattr->mode;
 	inode->i_uid = iattr->uid;
 	if (dir->i_mode & S_ISGID) {
@@ -98,6 +97,20 @@ static struct inode *tux_new_inode(struct inode *dir, struct tux_iattr *iattr,
 	}
 	tux_inode(inode)->present |= CTIME_SIZE_BIT|MTIME_BIT|MODE_OWNER_BIT|LINK_COUNT_BIT;
 
+	/* Regular files and directories inherit policy flags from parent */
+	if (S_ISREG(inode->i_mode) || S_ISDIR(inode->i_mode)) {
+		unsigned flags = tux_inode(dir)->i_flags & TUX3_FL_INHERITED;
+		unsigned codec = tux_inode(dir)->i_codec;
+		if (flags) {
+			tux_inode(inode)->i_flags = flags;
+			tux_inode(inode)->present |= FLAGS_BIT;
+		}
+		if (codec) {
+			tux_inode(inode)->i_codec = codec;
+			tux_inode(inode)->present |= CODEC_BIT;
+		}
+	}
+
 	/* Just for debug, will rewrite by alloc_inum() */
 	tux_set_inum(inode, TUX_INVALID_INO);
 
@@ -720,6 +733,15 @@ static int tux3_truncate(struct inode *inode, loff_t newsize)
 	oldsize = inode->i_size;
 	is_expand = newsize > oldsize;
 
+#ifndef __KERNEL__
+	/* Stride of new or old end changes length, rewrite it */
+	if (is_compressed_file(inode)) {
+		err = tux3_prepare_resize(inode, newsize);
+		if (err)
+			goto error;
+	}
+#endif
+
 	if (!is_expand) {
 		err = tux3_truncate_partial_block(inode, newsize);
 		if (err)
@@ -934,6 +956,71 @@ void tux3_evict_inode(struct inode *inode)
 	free_xcache(inode);
 }
 
+/*
+ * Change persistent inode flags (FS_IOC_SETFLAGS). Stride layout is
+ * chosen per file, so compression can't be switched under existing
+ * data: only directories and empty files may change TUX3_COMPR_FL.
+ */
+int tux3_set_flags(struct inode *inode, unsigned flags)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printf("\t\t\t\t%25s[K]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct tux3_inode *tuxnode = tux_inode(inode);
+	struct sb *sb = tux_sb(inode->i_sb);
+
+	if (flags & ~TUX3_FL_USER_MODIFIABLE)
+		return -EOPNOTSUPP;
+	if (flags == tuxnode->i_flags)
+		return 0;
+	if (!S_ISREG(inode->i_mode) && !S_ISDIR(inode->i_mode))
+		return -EINVAL;
+	if (S_ISREG(inode->i_mode) && inode->i_size)
+		return -EINVAL;
+
+	change_begin(sb);
+	tux3_iattrdirty(inode);
+	tuxnode->i_flags = flags;
+	tuxnode->present |= FLAGS_BIT;
+	inode->i_ctime = gettime();
+	tux3_mark_inode_dirty(inode);
+	change_end(sb);
+
+	return 0;
+}
+
+/*
+ * Change codec new strides of inode are compressed with. Each stride
+ * records its own codec, so this is fine with data already there.
+ */
+int tux3_set_codec(struct inode *inode, unsigned codec)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printf("\t\t\t\t%25s[K]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct tux3_inode *tuxnode = tux_inode(inode);
+	struct sb *sb = tux_sb(inode->i_sb);
+
+	if (codec >= TUX3_CODECS)
+		return -EINVAL;
+	if (codec == tuxnode->i_codec)
+		return 0;
+	if (!S_ISREG(inode->i_mode) && !S_ISDIR(inode->i_mode))
+		return -EINVAL;
+
+	change_begin(sb);
+	tux3_iattrdirty(inode);
+	tuxnode->i_codec = codec;
+	tuxnode->present |= CODEC_BIT;
+	inode->i_ctime = gettime();
+	tux3_mark_inode_dirty(inode);
+	change_end(sb);
+
+	return 0;
+}
+
 #ifdef __KERNEL__
 /* This is used by tux3_clear_dirty_inodes() to tell inode state was changed */
 void iget_if_dirty(struct inode *inode)
@@ -962,16 +1049,8 @@ int tux3_sync_file(struct file *file, loff_t start, loff_t end, int datasync)
 	struct inode *inode = file->f_mapping->host;
 	struct sb *sb = tux_sb(inode->i_sb);
 
-	/* FIXME: this is sync(2). We should implement real one */
-	static int print_once;
-	if (!print_once) {
-		print_once++;
-		tux3_warn(sb,
-			  "fsync(2) fall-back to sync(2): %Lx-%Lx, datasync %d",
-			  start, end, datasync);
-	}
-
-	return force_delta(sb);
+	/* FIXME: range and datasync are ignored, this syncs whole inode */
+	return tux3_sync_inode(sb, inode);
 }
 
 int tux3_getattr(struct vfsmount *mnt, struct dentry *dentry, struct kstat *stat)
@@ -150,10 +150,14 @@ static struct inode *create_internal_inode(struct sb *sbi, inum_t inum,
 		printf("\t\t\t\t%25s[K]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
 	static struct tux_iattr null_iattr;
-	struct inode *dir = &(struct inode){
-		.i_sb = vfs_sb(sbi),
-		.i_mode = S_IFDIR | 0755,
-	};
+	/* Parent of internal inodes, carries the volume default flags */
+	struct inode *dir = &(struct tux3_inode){
+		.i_flags = ENABLE_TRANSPARENT_COMPRESSION ? TUX3_COMPR_FL : 0,
+		.vfs_inode = {
+			.i_sb = vfs_sb(sbi),
+			.i_mode = S_IFDIR | 0755,
+		},
+	}.vfs_inode;
 	struct inode *inode;
 
 	if (iattr == NULL)
@@ -306,6 +310,8 @@ static void tux3_inode_init_always(struct tux3_inode *tuxnode)
 
 	tuxnode->btree		= (struct btree){ };
 	tuxnode->present	= 0;
+	tuxnode->i_flags	= 0;
+	tuxnode->i_codec	= TUX3_CODEC_DEFAULT;
 	tuxnode->xcache		= NULL;
 	tuxnode->flags		= 0;
 #ifdef __KERNEL__
@@ -134,6 +134,19 @@ static inline void *decode48(void *at, u64 *val)
 #define TUX_INVALID_INO		63	/* FIXME: just for debugging */
 #define TUX_NORMAL_INO		64	/* until this ino, reserved ino */
 
+/* Persistent inode flags (values match FS_*_FL) */
+#define TUX3_COMPR_FL		0x00000004	/* Store data as compressed strides */
+#define TUX3_FL_INHERITED	TUX3_COMPR_FL	/* Copied from parent directory */
+#define TUX3_FL_USER_MODIFIABLE	TUX3_COMPR_FL	/* Settable by FS_IOC_SETFLAGS */
+
+/* Stride compression codecs, recorded per inode and per stride */
+enum {
+	TUX3_CODEC_DEFAULT	= 0,	/* Inode: use the mount default */
+	TUX3_CODEC_LZO1X	= 1,	/* Fast */
+	TUX3_CODEC_DEFLATE	= 2,	/* Strong */
+	TUX3_CODECS,
+};
+
 struct disksuper {
 	/* Update magic on any incompatible format change */
 	char magic[8];		/* Contains TUX3_LABEL magic string */
@@ -195,8 +208,8 @@ struct cursor {
 #ifdef CURSOR_DEBUG
 #define FREE_BUFFER	((void *)0xdbc06505)
 #define FREE_NEXT	((void *)0xdbc06507)
-	int maxlevel;
 #endif
+	int maxlevel;		/* path[] has maxlevel + 1 levels */
 	int level;
 	struct path_level {
 		struct buffer_head *buffer;
@@ -222,6 +235,17 @@ struct delta_ref {
 #endif
 };
 
+/* When to start a new delta, and when to unify (0 disables a limit) */
+struct tux3_policy {
+	unsigned long delta_bytes;	/* dirty bytes to start a delta */
+	unsigned delta_ratio;		/* dirty % of cache to start a delta */
+	unsigned delta_interval;	/* msecs to start a delta */
+	unsigned unify_logblocks;	/* log blocks to unify */
+	unsigned unify_interval;	/* msecs to unify */
+};
+
+extern const struct tux3_policy tux3_default_policy;
+
 /* Per-delta data structure for sb */
 struct sb_delta_dirty {
 	struct list_head dirty_inodes;	/* dirty inodes list */
@@ -241,6 +265,9 @@ struct sb {
 	struct delta_ref delta_refs[TUX3_MAX_DELTA];
 	unsigned next_delta;			/* delta commit cycle */
 	unsigned unify;				/* log unify cycle */
+	struct tux3_policy policy;		/* delta/unify thresholds */
+	unsigned long delta_start;		/* msecs current delta began */
+	unsigned long unify_start;		/* msecs of last unify */
 
 #define TUX3_COMMIT_RUNNING_BIT		0
 #define TUX3_COMMIT_PENDING_BIT		1
@@ -315,6 +342,22 @@ struct sb {
 #else
 	struct dev *dev;		/* userspace block device */
 	loff_t s_maxbytes;		/* maximum file size */
+	pthread_mutex_t fs_lock;	/* serialize tasks on this volume */
+	pthread_t flush_task;		/* thread to flush pending delta */
+	pthread_cond_t flush_wait;	/* wakes flush_task, under fs_lock */
+	pthread_cond_t commit_wait;	/* flush_task committed a delta */
+	int flush_running, flush_stop;
+	unsigned long bfree_seq;	/* bumped by bfree(), see tuxread_pin() */
+	/* Group commit: syncs that arrive together share one commit */
+	pthread_mutex_t group_lock;
+	pthread_cond_t group_wait;
+	unsigned group_window;		/* usecs the leader waits for others */
+	unsigned long group_next;	/* last ticket handed out */
+	unsigned long group_done;	/* last ticket covered by a commit */
+	int group_leader;		/* somebody is driving a commit */
+	int group_err;			/* result of the last group commit */
+	pthread_mutex_t workspace_lock;	/* protects idle_workspaces */
+	struct workspace *idle_workspaces; /* reusable compression workspaces */
 #endif
 };
 
@@ -385,6 +428,8 @@ struct tux3_iattr_data {
 	struct timespec	i_mtime;
 	struct timespec	i_ctime;
 	u64		i_version;
+	unsigned	i_flags;
+	unsigned	i_codec;
 };
 
 /* Per-delta data structure for inode */
@@ -416,13 +461,18 @@ struct tux3_inode {
 	unsigned flags;			/* flags for inode state */
 	unsigned present;		/* Attributes decoded from or
 					 * to be encoded to itree */
+	unsigned i_flags;		/* Persistent flags (TUX3_*_FL) */
+	unsigned i_codec;		/* Codec of new strides (TUX3_CODEC_*) */
 	struct inode_delta_dirty i_ddc[TUX3_MAX_DELTA];
 #ifdef __KERNEL__
 	int (*io)(int rw, struct bufvec *bufvec);
+#else
+	struct list_head strides;	/* decompressed strides in cache */
+	unsigned compress_fails;	/* strides failed to compress in a row */
+	unsigned compress_skip;		/* strides to store raw without trying */
 #endif
 	/* Generic inode */
 	struct inode vfs_inode;
-	unsigned int is_compressed;
 };
 
 static inline struct tux3_inode *tux_inode(struct inode *inode)
@@ -467,6 +517,21 @@ static inline struct block_device *sb_dev(struct sb *sb)
 {
 	return sb->vfs_sb->s_bdev;
 }
+
+static inline unsigned long tux3_msecs(void)
+{
+	return jiffies_to_msecs(jiffies);
+}
+
+static inline unsigned long tux3_dirty_bytes(struct sb *sb)
+{
+	return global_page_state(NR_FILE_DIRTY) << PAGE_SHIFT;
+}
+
+static inline unsigned tux3_dirty_ratio(struct sb *sb)
+{
+	return global_page_state(NR_FILE_DIRTY) * 100 / totalram_pages;
+}
 #else /* !__KERNEL__ */
 static inline struct sb *tux_sb(struct sb *sb)
 {
@@ -487,6 +552,10 @@ static inline struct dev *sb_dev(struct sb *sb)
 {
 	return sb->dev;
 }
+
+unsigned long tux3_msecs(void);
+unsigned long tux3_dirty_bytes(struct sb *sb);
+unsigned tux3_dirty_ratio(struct sb *sb);
 #endif /* !__KERNEL__ */
 
 /* Get delta from free running counter */
@@ -748,6 +817,7 @@ void tux3_end_backend(void);
 int tux3_under_backend(struct sb *sb);
 int force_unify(struct sb *sb);
 int force_delta(struct sb *sb);
+int tux3_sync_inode(struct sb *sb, struct inode *inode);
 unsigned tux3_get_current_delta(void);
 unsigned tux3_inode_delta(struct inode *inode);
 void change_begin_atomic(struct sb *sb);
@@ -832,6 +902,8 @@ int tux3_purge_inode(struct inode *inode, struct tux3_iattr_data *idata,
 int tux3_drop_inode(struct inode *inode);
 void tux3_evict_inode(struct inode *inode);
 void iget_if_dirty(struct inode *inode);
+int tux3_set_flags(struct inode *inode, unsigned flags);
+int tux3_set_codec(struct inode *inode, unsigned codec);
 
 /* log.c */
 extern unsigned log_size[];
@@ -943,6 +1015,7 @@ int tux3_flush_inode_internal(struct inode *inode, unsigned delta);
 int tux3_flush_inode(struct inode *inode, unsigned delta);
 int tux3_flush_inodes(struct sb *sb, unsigned delta);
 void tux3_clear_dirty_inodes(struct sb *sb, unsigned delta);
+void tux3_clear_dirty_inode_delta(struct inode *inode, unsigned delta);
 void tux3_check_destroy_inode_flags(struct inode *inode);
 
 /* xattr.c */
@@ -981,9 +1054,12 @@ static inline struct buffer_head *vol_bread(struct sb *sb, block_t block)
 	return blockread(mapping(sb->volmap), block);
 }
 
+/* Is data of this inode stored as compressed strides? */
 static inline unsigned int is_compressed_file(struct inode *inode)
 {
-	return ENABLE_TRANSPARENT_COMPRESSION;
+	return S_ISREG(inode->i_mode) &&
+		tux_inode(inode)->inum >= TUX_NORMAL_INO &&
+		(tux_inode(inode)->i_flags & TUX3_COMPR_FL);
 }
 
 #include "dirty-buffer.h"	/* remove this after atomic commit */
@@ -695,6 +695,20 @@ error:
 	return err;
 }
 
+/*
+ * Clear dirty flags of an inode that was flushed alone by
+ * tux3_sync_inode(). Caller must hold a reference of inode.
+ */
+void tux3_clear_dirty_inode_delta(struct inode *inode, unsigned delta)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printf("\t\t\t\t%25s[K]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	assert(atomic_read(&inode->i_count) >= 1);
+	__tux3_clear_dirty_inode(inode, delta);
+}
+
 /*
  * Clear inode dirty flags after flush.
  */
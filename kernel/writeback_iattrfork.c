@@ -42,6 +42,8 @@ static void idata_copy(struct inode *inode, struct tux3_iattr_data *idata)
 	idata->i_mtime		= inode->i_mtime;
 	idata->i_ctime		= inode->i_ctime;
 	idata->i_version	= inode->i_version;
+	idata->i_flags		= tux_inode(inode)->i_flags;
+	idata->i_codec		= tux_inode(inode)->i_codec;
 }
 
 void tux3_iattrdirty(struct inode *inode)
@@ -5,6 +5,12 @@
 #include <libklib/libklib.h>
 #include <libklib/slab.h>
 
+/* Free pointer of object, stored just after it */
+static inline void **slab_freeptr(struct kmem_cache *cachep, void *objp)
+{
+	return objp + ALIGN(cachep->object_size, sizeof(void *));
+}
+
 struct kmem_cache *kmem_cache_create(const char *name, size_t size,
 				     size_t align, unsigned long flags,
 				     void (*ctor)(void *))
@@ -15,13 +21,26 @@ struct kmem_cache *kmem_cache_create(const char *name, size_t size,
 	}
 	struct kmem_cache *cachep;
 
+	if (flags & SLAB_HWCACHE_ALIGN)
+		align = max_t(size_t, align, L1_CACHE_BYTES);
+	align = max_t(size_t, align, sizeof(void *));
+
 	cachep = malloc(sizeof(*cachep));
 	if (cachep) {
-		cachep->name		= name;
-		cachep->object_size	= size;
-		cachep->align		= align;
-		cachep->flags		= flags;
-		cachep->ctor		= ctor;
+		unsigned slot = ALIGN(ALIGN(size, sizeof(void *)) + sizeof(void *), align);
+		/* First slot of slab holds the slab link */
+		unsigned header = ALIGN(sizeof(void *), align);
+
+		*cachep = (struct kmem_cache){
+			.name		= name,
+			.object_size	= size,
+			.align		= align,
+			.flags		= flags,
+			.ctor		= ctor,
+			.slot_size	= slot,
+			.slab_objects	= max(8U, (KMEM_SLAB_SIZE - header) / slot),
+		};
+		pthread_mutex_init(&cachep->lock, NULL);
 	}
 	return cachep;
 }
@@ -32,16 +51,62 @@ void kmem_cache_destroy(struct kmem_cache *cachep)
 	{
 		printf("\t\t\t\t%25s[L]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
+	if (!cachep)
+		return;
+	if (cachep->active)
+		fprintf(stderr, "kmem_cache %s: %lu objects leaked\n",
+			cachep->name, cachep->active);
+	while (cachep->slabs) {
+		void *slab = cachep->slabs;
+		cachep->slabs = *(void **)slab;
+		free(slab);
+	}
+	pthread_mutex_destroy(&cachep->lock);
 	free(cachep);
 }
 
+/* Add one slab of objects to the free list. Called with cachep->lock */
+static int kmem_cache_grow(struct kmem_cache *cachep)
+{
+	if(DEBUG_MODE_L==1)
+	{
+		printf("\t\t\t\t%25s[L]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	unsigned header = ALIGN(sizeof(void *), cachep->align);
+	unsigned align = max(cachep->align, (unsigned)L1_CACHE_BYTES);
+	void *slab, *objp;
+
+	if (posix_memalign(&slab, align,
+			   header + cachep->slab_objects * cachep->slot_size))
+		return -ENOMEM;
+	*(void **)slab = cachep->slabs;
+	cachep->slabs = slab;
+
+	objp = slab + header + (cachep->slab_objects - 1) * cachep->slot_size;
+	for (unsigned i = 0; i < cachep->slab_objects; i++) {
+		if (cachep->ctor)
+			cachep->ctor(objp);
+		*slab_freeptr(cachep, objp) = cachep->freelist;
+		cachep->freelist = objp;
+		objp -= cachep->slot_size;
+	}
+	cachep->total += cachep->slab_objects;
+	return 0;
+}
+
 void kmem_cache_free(struct kmem_cache *cachep, void *objp)
 {
 	if(DEBUG_MODE_L==1)
 	{
 		printf("\t\t\t\t%25s[L]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	free(objp);
+	if (!objp)
+		return;
+	pthread_mutex_lock(&cachep->lock);
+	*slab_freeptr(cachep, objp) = cachep->freelist;
+	cachep->freelist = objp;
+	cachep->active--;
+	pthread_mutex_unlock(&cachep->lock);
 }
 
 void *kmem_cache_alloc(struct kmem_cache *cachep, gfp_t flags)
@@ -50,22 +115,18 @@ void *kmem_cache_alloc(struct kmem_cache *cachep, gfp_t flags)
 	{
 		printf("\t\t\t\t%25s[L]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	void *objp;
-
-	if (cachep->align) {
-		int err;
-		err = posix_memalign(&objp, cachep->align, cachep->object_size);
-		if (err)
-			objp = NULL;
-	} else
-		objp = malloc(cachep->object_size);
+	void *objp = NULL;
 
-	if (objp) {
-		if (cachep->ctor)
-			cachep->ctor(objp);
-		if (flags & __GFP_ZERO)
-			memset(objp, 0, cachep->object_size);
+	pthread_mutex_lock(&cachep->lock);
+	if (cachep->freelist || !kmem_cache_grow(cachep)) {
+		objp = cachep->freelist;
+		cachep->freelist = *slab_freeptr(cachep, objp);
+		cachep->active++;
 	}
+	pthread_mutex_unlock(&cachep->lock);
+
+	if (objp && (flags & __GFP_ZERO))
+		memset(objp, 0, cachep->object_size);
 
 	return objp;
 }
@@ -71,12 +71,28 @@
 #define SLAB_RECLAIM_ACCOUNT	0x00020000UL		/* Objects are reclaimable */
 #define SLAB_TEMPORARY		SLAB_RECLAIM_ACCOUNT	/* Objects are short-lived */
 
+#define L1_CACHE_BYTES		64
+#define KMEM_SLAB_SIZE		(16 << 10)	/* minimum bytes per slab */
+
+/*
+ * Userland slab: objects are carved from cache line aligned slabs and
+ * recycled through a free list, never given back until the cache is
+ * destroyed. Free pointer lives after the object, so constructed state
+ * (ctor) survives free/alloc like kernel slab.
+ */
 struct kmem_cache {
 	unsigned int object_size;	/* The original size of the object */
 	unsigned int align;		/* Alignment as calculated */
 	unsigned long flags;		/* Active flags on the slab */
 	const char *name;		/* Slab name for sysfs */
 	void (*ctor)(void *);		/* Called on object slot creation */
+
+	unsigned int slot_size;		/* object + free pointer, aligned */
+	unsigned int slab_objects;	/* objects per slab */
+	void *freelist;			/* free objects */
+	void *slabs;			/* allocated slabs, linked by 1st word */
+	unsigned long active, total;	/* objects in use, objects in slabs */
+	pthread_mutex_t lock;
 };
 
 struct kmem_cache *kmem_cache_create(const char *, size_t, size_t,
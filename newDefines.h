@@ -5,6 +5,6 @@
 #define ALLOW_BUILTIN_LOG 1
 #define PAGE_SIZE_1 4096
 #define COMPRESSION_STRIDE_LEN 4
-#define ENABLE_TRANSPARENT_COMPRESSION 1
+#define ENABLE_TRANSPARENT_COMPRESSION 1	/* mkfs sets FS_COMPR_FL on root dir */
 
 //#include "compression.h"
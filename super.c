@@ -39,6 +39,9 @@ void inode_init(struct tux3_inode *tuxnode, struct sb *sb, umode_t mode)
 
 	tux3_inode_init_once(tuxnode);
 	tux3_inode_init_always(tuxnode);
+	INIT_LIST_HEAD(&tuxnode->strides);
+	tuxnode->compress_fails = 0;
+	tuxnode->compress_skip = 0;
 
 	inode->i_sb	= sb;
 	inode->i_mode	= mode;
@@ -73,6 +76,7 @@ int put_super(struct sb *sb)
 		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
 	__tux3_put_super(sb);
+	free_compress_workspaces(sb);
 
 	inode_leak_check();
 
@@ -152,6 +152,341 @@ static void test02(void)
 	free_map(map);
 }
 
+/* Like rapid_open_inode(), but inode lives in caller's scope */
+static struct inode *open_test_inode(struct sb *sb, struct tux3_inode *tux,
+				     inum_t inum)
+{
+	*tux = (struct tux3_inode){};
+	inode_init(tux, sb, 0);
+	tux->inum = inum;
+	tux->vfs_inode.map = new_map(sb->dev, NULL);
+	assert(tux->vfs_inode.map);
+	tux->vfs_inode.map->inode = &tux->vfs_inode;
+	return &tux->vfs_inode;
+}
+
+/* Map hash grows and shrinks with number of buffers */
+static void test03(void)
+{
+	struct dev *dev = &(struct dev){ .bits = 12 };
+	struct sb sb = { .dev = dev, };
+	struct tux3_inode tux;
+	unsigned nr = 1000;
+
+	init_buffers(dev, 10 << 20, 1);
+	struct inode *inode = open_test_inode(&sb, &tux, TUX_NORMAL_INO);
+	map_t *map = inode->map;
+	test_assert(map->hash_bits == BUFFER_HASH_MIN_BITS);
+
+	for (unsigned i = 0; i < nr; i++)
+		blockput(blockget(map, i));
+	test_assert(map->hash_count == nr);
+	test_assert(map->hash_count <= 1U << map->hash_bits);
+
+	for (unsigned i = 0; i < nr; i++) {
+		struct buffer_head *buffer = peekblk(map, i);
+		test_assert(buffer);
+		test_assert(buffer->index == i);
+		blockput(buffer);
+	}
+
+	invalidate_buffers(map);
+	test_assert(map->hash_count == 0);
+	test_assert(map->hash_bits == BUFFER_HASH_MIN_BITS);
+}
+
+/* Sequential scan doesn't push out buffers used twice */
+static void test04(void)
+{
+	struct dev *dev = &(struct dev){ .bits = 12 };
+	struct sb sb = { .dev = dev, };
+	struct buffer_stats stats;
+	unsigned hot = 20, scan = 1000;
+
+	test_assert(set_buffer_policy("nothing") == -EINVAL);
+	test_assert(set_buffer_policy("arc") == 0);
+	init_buffers(dev, NR_BUF << dev->bits, 0);
+	struct tux3_inode tux1, tux2;
+	struct inode *inode1 = open_test_inode(&sb, &tux1, TUX_NORMAL_INO);
+	struct inode *inode2 = open_test_inode(&sb, &tux2, TUX_NORMAL_INO + 1);
+
+	for (int loop = 0; loop < 2; loop++) {
+		for (unsigned i = 0; i < hot; i++)
+			blockput(blockget(inode1->map, i));
+	}
+	for (unsigned i = 0; i < scan; i++)
+		blockput(blockget(inode2->map, i));
+
+	for (unsigned i = 0; i < hot; i++) {
+		struct buffer_head *buffer = peekblk(inode1->map, i);
+		test_assert(buffer);
+		blockput(buffer);
+	}
+
+	get_buffer_stats(&stats);
+	test_assert(!strcmp(stats.policy, "arc"));
+	test_assert(stats.hits == hot);
+	test_assert(stats.misses == hot + scan);
+	test_assert(stats.evictions >= scan - NR_BUF);
+}
+
+/* Dirty bytes are counted per delta */
+static void test05(void)
+{
+	struct dev *dev = &(struct dev){ .bits = 12 };
+	struct sb sb = { .dev = dev, };
+	struct tux3_inode tux;
+	struct buffer_stats stats;
+
+	init_buffers(dev, NR_BUF << dev->bits, 0);
+	struct inode *inode = open_test_inode(&sb, &tux, TUX_NORMAL_INO);
+
+	struct buffer_head *buffer = blockget(inode->map, 0);
+	test_assert(buffer);
+	tux3_set_buffer_dirty(inode->map, buffer, 1);
+	get_buffer_stats(&stats);
+	test_assert(stats.dirty_bytes[tux3_delta(1)] == 1 << dev->bits);
+	test_assert(stats.dirty_bytes[tux3_delta(0)] == 0);
+
+	set_buffer_clean(buffer);
+	blockput(buffer);
+	get_buffer_stats(&stats);
+	test_assert(stats.dirty_bytes[tux3_delta(1)] == 0);
+	test_assert(stats.buffers == 1);
+}
+
+/* Pool can grow and shrink while buffers are cached */
+static void test06(void)
+{
+	struct dev *dev = &(struct dev){ .bits = 12 };
+	struct sb sb = { .dev = dev, };
+	struct tux3_inode tux;
+	struct buffer_stats stats;
+	unsigned nr = 400;
+
+	init_buffers(dev, nr << dev->bits, 0);
+	struct inode *inode = open_test_inode(&sb, &tux, TUX_NORMAL_INO);
+
+	for (unsigned i = 0; i < nr; i++)
+		blockput(blockget(inode->map, i));
+	get_buffer_stats(&stats);
+	test_assert(stats.buffers == nr);
+
+	/* Shrink evicts clean buffers, one pinned buffer stays */
+	struct buffer_head *pinned = peekblk(inode->map, nr - 1);
+	test_assert(resize_buffers((nr / 2) << dev->bits) == 0);
+	get_buffer_stats(&stats);
+	test_assert(stats.max_buffers == nr / 2);
+	test_assert(stats.buffers <= nr / 2);
+	test_assert(peekblk(inode->map, nr - 1) == pinned);
+	blockput(pinned);
+	blockput(pinned);
+
+	/* Grow, then the whole set fits again */
+	test_assert(resize_buffers((nr * 2) << dev->bits) == 0);
+	for (unsigned i = 0; i < nr * 2; i++)
+		blockput(blockget(inode->map, i));
+	get_buffer_stats(&stats);
+	test_assert(stats.max_buffers == nr * 2);
+	test_assert(stats.buffers == nr * 2);
+}
+
+/* Shrinking below mount time size frees unused chunks of pool */
+static void test08(void)
+{
+	struct dev *dev = &(struct dev){ .bits = 12 };
+	struct sb sb = { .dev = dev, };
+	struct tux3_inode tux;
+	struct buffer_stats stats;
+	unsigned nr = 2048;
+
+	init_buffers(dev, (unsigned long)nr << dev->bits, 0);
+	get_buffer_stats(&stats);
+	test_assert(stats.prealloc == nr);
+	struct inode *inode = open_test_inode(&sb, &tux, TUX_NORMAL_INO);
+	for (unsigned i = 0; i < 10; i++)
+		blockput(blockget(inode->map, i));
+
+	test_assert(resize_buffers(100 << dev->bits) == 0);
+	get_buffer_stats(&stats);
+	test_assert(stats.prealloc > 0);
+	test_assert(stats.prealloc <= nr / 2);
+	test_assert(stats.buffers == 10);
+
+	/* Cached buffers still live in the kept chunk */
+	for (unsigned i = 0; i < 10; i++) {
+		struct buffer_head *buffer = peekblk(inode->map, i);
+		test_assert(buffer);
+		blockput(buffer);
+	}
+
+	/* Growing again preallocates again */
+	test_assert(resize_buffers((unsigned long)nr << dev->bits) == 0);
+	get_buffer_stats(&stats);
+	test_assert(stats.prealloc == nr);
+}
+
+/* Pool size whose buffer count doesn't fit in unsigned is rejected */
+static void test11(void)
+{
+	struct dev *dev = &(struct dev){ .bits = 12 };
+	struct buffer_stats stats;
+	unsigned long huge = 16UL << 40;
+
+	test_assert(init_buffers(dev, huge, 0) == -EINVAL);
+	test_assert(init_buffers(dev, NR_BUF << dev->bits, 0) == 0);
+	test_assert(resize_buffers(huge) == -EINVAL);
+	get_buffer_stats(&stats);
+	test_assert(stats.max_buffers == NR_BUF);
+}
+
+/* Clean buffer stays cached after last blockput, with mount time args */
+static void test09(void)
+{
+	struct dev *dev = &(struct dev){ .bits = 12 };
+	struct sb sb = { .dev = dev, };
+	struct tux3_inode tux;
+
+	init_buffers(dev, NR_BUF << dev->bits, 0);
+	struct inode *inode = open_test_inode(&sb, &tux, TUX_NORMAL_INO);
+
+	struct buffer_head *buffer = blockget(inode->map, 0);
+	test_assert(buffer);
+	set_buffer_clean(buffer);
+	blockput(buffer);
+
+	struct buffer_head *cached = peekblk(inode->map, 0);
+	test_assert(cached == buffer);
+	test_assert(buffer_clean(cached));
+	blockput(cached);
+}
+
+/* Mount time pool is preallocated, on huge pages if asked */
+static void test10(void)
+{
+	struct dev *dev = &(struct dev){ .bits = 12 };
+	struct sb sb = { .dev = dev, };
+	struct tux3_inode tux;
+	struct buffer_stats stats;
+	unsigned nr = 1024;
+
+	set_buffer_hugepages(1);
+	init_buffers(dev, nr << dev->bits, 0);
+	get_buffer_stats(&stats);
+	test_assert(stats.prealloc == nr);
+	/* Huge pages may be unavailable, then pool falls back to normal */
+	test_assert(stats.huge_bytes % (2 << 20) == 0);
+	test_assert(stats.huge_bytes <= (u64)nr << dev->bits);
+
+	struct inode *inode = open_test_inode(&sb, &tux, TUX_NORMAL_INO);
+	for (unsigned i = 0; i < nr; i++) {
+		struct buffer_head *buffer = blockget(inode->map, i);
+		test_assert(buffer);
+		memset(buffer->data, i, 1 << dev->bits);
+		blockput(buffer);
+	}
+	get_buffer_stats(&stats);
+	test_assert(stats.buffers == nr);
+	test_assert(stats.prealloc == nr);
+	set_buffer_hugepages(0);
+}
+
+/* Hot metadata block survives a sequential read bigger than the pool */
+static void test12(void)
+{
+	struct dev *dev = &(struct dev){ .bits = 12 };
+	struct sb sb = { .dev = dev, };
+	struct tux3_inode tux1, tux2;
+
+	test_assert(set_buffer_policy("arc") == 0);
+	init_buffers(dev, NR_BUF << dev->bits, 0);
+	struct inode *volmap = open_test_inode(&sb, &tux1, TUX_VOLMAP_INO);
+	struct inode *inode = open_test_inode(&sb, &tux2, TUX_NORMAL_INO);
+
+	blockput(blockget(volmap->map, 7));
+	for (unsigned i = 0; i < NR_BUF * 4; i++)
+		blockput(blockget(inode->map, i));
+
+	struct buffer_head *buffer = peekblk(volmap->map, 7);
+	test_assert(buffer);
+	blockput(buffer);
+}
+
+/* Freed map leaves no ghosts behind to be hit by a later map */
+static void test13(void)
+{
+	struct dev *dev = &(struct dev){ .bits = 12 };
+	struct sb sb = { .dev = dev, };
+	struct tux3_inode tux1, tux2;
+	struct buffer_stats stats;
+
+	test_assert(set_buffer_policy("arc") == 0);
+	init_buffers(dev, NR_BUF << dev->bits, 0);
+	struct inode *inode1 = open_test_inode(&sb, &tux1, TUX_NORMAL_INO);
+	struct inode *inode2 = open_test_inode(&sb, &tux2, TUX_NORMAL_INO + 1);
+
+	for (unsigned i = 0; i < NR_BUF; i++)
+		blockput(blockget(inode1->map, i));
+	for (unsigned i = 0; i < NR_BUF; i++)
+		blockput(blockget(inode2->map, i));
+	unsigned ghosts2 = inode2->map->ghost_count;
+	test_assert(inode1->map->ghost_count > 0);
+
+	free_map(inode1->map);
+	test_assert(inode2->map->ghost_count == ghosts2);
+
+	/* Whatever address a new map gets, its blocks are plain misses */
+	get_buffer_stats(&stats);
+	u64 ghost_hits = stats.ghost_hits;
+	map_t *map = new_map(dev, NULL);
+	test_assert(map);
+	map->inode = inode1;
+	for (unsigned i = 0; i < NR_BUF; i++)
+		blockput(blockget(map, i));
+	get_buffer_stats(&stats);
+	test_assert(stats.ghost_hits == ghost_hits);
+	free_map(map);
+}
+
+static int ctor_calls;
+
+static void test07_ctor(void *mem)
+{
+	ctor_calls++;
+	memset(mem, 0x5a, 40);
+}
+
+/* Slab recycles freed objects, aligned, and constructs each slot once */
+static void test07(void)
+{
+	struct kmem_cache *cachep;
+	void *objs[1000], *obj;
+
+	cachep = kmem_cache_create("test07", 40, 0, SLAB_HWCACHE_ALIGN,
+				   test07_ctor);
+	test_assert(cachep);
+
+	for (int i = 0; i < 1000; i++) {
+		objs[i] = kmem_cache_alloc(cachep, GFP_NOFS);
+		test_assert(objs[i]);
+		test_assert(((unsigned long)objs[i] & (L1_CACHE_BYTES - 1)) == 0);
+		test_assert(*(unsigned char *)objs[i] == 0x5a);
+	}
+	int constructed = ctor_calls;
+	test_assert(constructed >= 1000);
+
+	/* Last freed is first reused, without calling ctor again */
+	kmem_cache_free(cachep, objs[500]);
+	obj = kmem_cache_alloc(cachep, __GFP_ZERO);
+	test_assert(obj == objs[500]);
+	test_assert(*(unsigned char *)obj == 0);
+	test_assert(ctor_calls == constructed);
+
+	for (int i = 0; i < 1000; i++)
+		kmem_cache_free(cachep, objs[i]);
+	kmem_cache_destroy(cachep);
+}
+
 int main(int argc, char *argv[])
 {
 	test_init(argv[0]);
@@ -164,5 +499,49 @@ int main(int argc, char *argv[])
 		test02();
 	test_end();
 
+	if (test_start("test03"))
+		test03();
+	test_end();
+
+	if (test_start("test04"))
+		test04();
+	test_end();
+
+	if (test_start("test05"))
+		test05();
+	test_end();
+
+	if (test_start("test06"))
+		test06();
+	test_end();
+
+	if (test_start("test07"))
+		test07();
+	test_end();
+
+	if (test_start("test08"))
+		test08();
+	test_end();
+
+	if (test_start("test09"))
+		test09();
+	test_end();
+
+	if (test_start("test10"))
+		test10();
+	test_end();
+
+	if (test_start("test11"))
+		test11();
+	test_end();
+
+	if (test_start("test12"))
+		test12();
+	test_end();
+
+	if (test_start("test13"))
+		test13();
+	test_end();
+
 	return test_failures();
 }
@@ -757,6 +757,473 @@ static void test07(struct sb *sb)
 	clean_main(sb);
 }
 
+/* Test to commit one file by tux3_sync_inode() */
+static void test08(struct sb *sb)
+{
+	struct open_result *r = test_alloc_shm(sizeof(*r) * 2);
+
+	test_assert(make_tux3(sb) == 0);
+	test_assert(force_unify(sb) == 0);
+
+	pid_t pid = fork();
+	assert(pid >= 0);
+	if (pid == 0) {
+		struct tux_iattr iattr = { .mode = S_IFREG | S_IRWXU };
+		struct inode *inode[2];
+
+		for (int i = 0; i < 2; i++) {
+			r[i].namelen = snprintf(r[i].name, sizeof(r[i].name),
+						"file%03d", i);
+			inode[i] = tuxcreate(sb->rootdir, r[i].name,
+					     r[i].namelen, &iattr);
+			test_assert(!IS_ERR(inode[i]));
+			r[i].inum = tux_inode(inode[i])->inum;
+		}
+
+		/* rootdir is dirty, so this has to commit the whole delta */
+		test_assert(tux3_sync_inode(sb, inode[0]) == 0);
+		test_assert(!(inode[1]->i_state & I_DIRTY));
+
+		/* Change both files in the same delta */
+		change_begin(sb);
+		for (int i = 0; i < 2; i++) {
+			tux3_iattrdirty(inode[i]);
+			i_uid_write(inode[i], 100);
+			tux3_mark_inode_dirty(inode[i]);
+		}
+		change_end(sb);
+
+		/* Only regular files are dirty, so inode[0] is committed alone */
+		test_assert(tux3_sync_inode(sb, inode[0]) == 0);
+		test_assert(!(inode[0]->i_state & I_DIRTY));
+		test_assert(inode[1]->i_state & I_DIRTY);
+
+		/* Simulate crash */
+		exit(1);
+	}
+	waitpid(pid, NULL, 0);
+	clean_sb(sb);
+
+	if (test_start("test08.1")) {
+		struct replay *rp = check_replay(sb);
+		test_assert(replay_stage3(rp, 0) == 0);
+
+		for (int i = 0; i < 2; i++) {
+			struct inode *inode;
+
+			inode = tuxopen(sb->rootdir, r[i].name, r[i].namelen);
+			test_assert(!IS_ERR(inode));
+			test_assert(tux_inode(inode)->inum == r[i].inum);
+			/* Change of inode[1] was not committed */
+			test_assert(i_uid_read(inode) == (i == 0 ? 100 : 0));
+			iput(inode);
+		}
+		clean_main(sb);
+	}
+	test_end();
+
+	tux3_exit_mem();
+	test_free_shm(r, sizeof(*r) * 2);
+}
+
+/* Test to commit deltas by flusher thread */
+static void test09(struct sb *sb)
+{
+	struct open_result *r = test_alloc_shm(sizeof(*r) * 20);
+
+	test_assert(make_tux3(sb) == 0);
+	test_assert(force_unify(sb) == 0);
+
+	pid_t pid = fork();
+	assert(pid >= 0);
+	if (pid == 0) {
+		struct tux_iattr iattr = { .mode = S_IFREG | S_IRWXU };
+		unsigned committed = sb->committed_delta;
+
+		/* New delta on each change */
+		sb->policy.delta_bytes = 1;
+		test_assert(tux3_start_flusher(sb) == 0);
+
+		for (int i = 0; i < 20; i++) {
+			struct inode *inode;
+
+			r[i].namelen = snprintf(r[i].name, sizeof(r[i].name),
+						"file%03d", i);
+			tux3_lock_fs(sb);
+			inode = tuxcreate(sb->rootdir, r[i].name, r[i].namelen,
+					  &iattr);
+			test_assert(!IS_ERR(inode));
+			r[i].inum = tux_inode(inode)->inum;
+			iput(inode);
+			tux3_unlock_fs(sb);
+		}
+
+		/* Stop flushes pending delta, and current delta is left */
+		tux3_exit_flusher(sb);
+		test_assert(!test_bit(TUX3_COMMIT_PENDING_BIT, &sb->backend_state));
+		test_assert(sb->committed_delta != committed);
+		test_assert(force_delta(sb) == 0);
+
+		/* Simulate crash */
+		exit(1);
+	}
+	waitpid(pid, NULL, 0);
+	clean_sb(sb);
+
+	if (test_start("test09.1")) {
+		struct replay *rp = check_replay(sb);
+		test_assert(replay_stage3(rp, 0) == 0);
+
+		for (int i = 0; i < 20; i++) {
+			struct inode *inode;
+
+			inode = tuxopen(sb->rootdir, r[i].name, r[i].namelen);
+			test_assert(!IS_ERR(inode));
+			test_assert(tux_inode(inode)->inum == r[i].inum);
+			iput(inode);
+		}
+		clean_main(sb);
+	}
+	test_end();
+
+	tux3_exit_mem();
+	test_free_shm(r, sizeof(*r) * 20);
+}
+
+/* Test to commit delta with async writes by io_uring */
+static void test10(struct sb *sb)
+{
+	struct open_result *r = test_alloc_shm(sizeof(*r) * 20);
+
+	if (dev_init_uring(sb->dev, 8)) {
+		/* No io_uring on this kernel, nothing to test */
+		test_free_shm(r, sizeof(*r) * 20);
+		return;
+	}
+
+	test_assert(make_tux3(sb) == 0);
+	test_assert(force_unify(sb) == 0);
+
+	pid_t pid = fork();
+	assert(pid >= 0);
+	if (pid == 0) {
+		struct tux_iattr iattr = { .mode = S_IFREG | S_IRWXU };
+
+		for (int i = 0; i < 20; i++) {
+			struct inode *inode;
+
+			r[i].namelen = snprintf(r[i].name, sizeof(r[i].name),
+						"file%03d", i);
+			inode = tuxcreate(sb->rootdir, r[i].name, r[i].namelen,
+					  &iattr);
+			test_assert(!IS_ERR(inode));
+			r[i].inum = tux_inode(inode)->inum;
+			iput(inode);
+		}
+		test_assert(force_delta(sb) == 0);
+
+		/* Simulate crash */
+		exit(1);
+	}
+	waitpid(pid, NULL, 0);
+	clean_sb(sb);
+	dev_exit_uring(sb->dev);
+
+	if (test_start("test10.1")) {
+		struct replay *rp = check_replay(sb);
+		test_assert(replay_stage3(rp, 0) == 0);
+
+		for (int i = 0; i < 20; i++) {
+			struct inode *inode;
+
+			inode = tuxopen(sb->rootdir, r[i].name, r[i].namelen);
+			test_assert(!IS_ERR(inode));
+			test_assert(tux_inode(inode)->inum == r[i].inum);
+			iput(inode);
+		}
+		clean_main(sb);
+	}
+	test_end();
+
+	tux3_exit_mem();
+	test_free_shm(r, sizeof(*r) * 20);
+}
+
+/*
+ * Test to write, truncate and sync data while the flusher thread
+ * writes the previous delta without sb->fs_lock
+ */
+static void test11(struct sb *sb)
+{
+	struct open_result *r = test_alloc_shm(sizeof(*r) * 20);
+
+	test_assert(make_tux3(sb) == 0);
+	test_assert(force_unify(sb) == 0);
+
+	pid_t pid = fork();
+	assert(pid >= 0);
+	if (pid == 0) {
+		struct tux_iattr iattr = { .mode = S_IFREG | S_IRWXU };
+		char data[1024];
+
+		/* New delta on each change */
+		sb->policy.delta_bytes = 1;
+		test_assert(tux3_start_flusher(sb) == 0);
+
+		for (int i = 0; i < 20; i++) {
+			struct inode *inode;
+			struct file *file;
+
+			r[i].namelen = snprintf(r[i].name, sizeof(r[i].name),
+						"file%03d", i);
+			tux3_lock_fs(sb);
+			inode = tuxcreate(sb->rootdir, r[i].name, r[i].namelen,
+					  &iattr);
+			test_assert(!IS_ERR(inode));
+			r[i].inum = tux_inode(inode)->inum;
+
+			/* Flusher is idle, so change_end() freezes the write */
+			if (i & 1)
+				test_assert(force_delta(sb) == 0);
+
+			memset(data, i, sizeof(data));
+			file = &(struct file){ .f_inode = inode };
+			test_assert(tuxwrite(file, data, sizeof(data)) == sizeof(data));
+			/* Truncate buffers dirty for the pending delta */
+			if (i & 1)
+				test_assert(tuxtruncate(inode, 256) == 0);
+			iput(inode);
+			tux3_unlock_fs(sb);
+		}
+
+		/* Sync while flusher is running */
+		tux3_lock_fs(sb);
+		test_assert(force_delta(sb) == 0);
+		test_assert(!test_bit(TUX3_COMMIT_PENDING_BIT, &sb->backend_state));
+		tux3_unlock_fs(sb);
+
+		tux3_exit_flusher(sb);
+
+		/* Simulate crash */
+		exit(1);
+	}
+	waitpid(pid, NULL, 0);
+	clean_sb(sb);
+
+	if (test_start("test11.1")) {
+		struct replay *rp = check_replay(sb);
+		test_assert(replay_stage3(rp, 0) == 0);
+
+		for (int i = 0; i < 20; i++) {
+			unsigned size = (i & 1) ? 256 : 1024;
+			char data[1024], expect[1024];
+			struct inode *inode;
+			struct file *file;
+
+			inode = tuxopen(sb->rootdir, r[i].name, r[i].namelen);
+			test_assert(!IS_ERR(inode));
+			test_assert(tux_inode(inode)->inum == r[i].inum);
+			test_assert(inode->i_size == size);
+
+			memset(expect, i, size);
+			file = &(struct file){ .f_inode = inode };
+			test_assert(tuxread(file, data, size) == size);
+			test_assert(!memcmp(data, expect, size));
+			iput(inode);
+		}
+		clean_main(sb);
+	}
+	test_end();
+
+	tux3_exit_mem();
+	test_free_shm(r, sizeof(*r) * 20);
+}
+
+/* Test the flusher thread commits an idle delta after delta_interval */
+static void test12(struct sb *sb)
+{
+	struct open_result *r = test_alloc_shm(sizeof(*r));
+
+	test_assert(make_tux3(sb) == 0);
+	test_assert(force_unify(sb) == 0);
+
+	pid_t pid = fork();
+	assert(pid >= 0);
+	if (pid == 0) {
+		struct tux_iattr iattr = { .mode = S_IFREG | S_IRWXU };
+		unsigned committed = sb->committed_delta;
+		struct inode *inode;
+
+		/* Only the interval can start a delta */
+		sb->policy.delta_bytes = 0;
+		sb->policy.delta_ratio = 0;
+		sb->policy.delta_interval = 50;
+		test_assert(tux3_start_flusher(sb) == 0);
+
+		r->namelen = snprintf(r->name, sizeof(r->name), "idle");
+		tux3_lock_fs(sb);
+		inode = tuxcreate(sb->rootdir, r->name, r->namelen, &iattr);
+		test_assert(!IS_ERR(inode));
+		r->inum = tux_inode(inode)->inum;
+		iput(inode);
+		tux3_unlock_fs(sb);
+
+		usleep(500 * 1000);
+
+		/* Check before tux3_exit_flusher(), it commits anyway */
+		tux3_lock_fs(sb);
+		r->err = sb->committed_delta != committed ? 0 : -EAGAIN;
+		tux3_unlock_fs(sb);
+		tux3_exit_flusher(sb);
+
+		/* Simulate crash */
+		exit(1);
+	}
+	waitpid(pid, NULL, 0);
+	clean_sb(sb);
+	test_assert(r->err == 0);
+
+	if (test_start("test12.1")) {
+		struct replay *rp = check_replay(sb);
+		test_assert(replay_stage3(rp, 0) == 0);
+
+		struct inode *inode = tuxopen(sb->rootdir, r->name, r->namelen);
+		test_assert(!IS_ERR(inode));
+		test_assert(tux_inode(inode)->inum == r->inum);
+		iput(inode);
+		clean_main(sb);
+	}
+	test_end();
+
+	tux3_exit_mem();
+	test_free_shm(r, sizeof(*r));
+}
+
+#define GROUP_SYNCS	4
+
+struct group_sync {
+	struct sb *sb;
+	struct inode *inode;
+	pthread_barrier_t *barrier;
+	int err;
+};
+
+static void *test13_sync(void *arg)
+{
+	struct group_sync *g = arg;
+	struct sb *sb = g->sb;
+	char data[1024];
+
+	memset(data, tux_inode(g->inode)->inum, sizeof(data));
+	tux3_lock_fs(sb);
+	struct file *file = &(struct file){ .f_inode = g->inode };
+	if (tuxwrite(file, data, sizeof(data)) != sizeof(data))
+		g->err = -EIO;
+	tux3_unlock_fs(sb);
+
+	pthread_barrier_wait(g->barrier);
+	if (!g->err)
+		g->err = tux3_group_sync(sb, g->inode);
+
+	/* Returned only after the data was committed */
+	tux3_lock_fs(sb);
+	if (!g->err && (g->inode->i_state & I_DIRTY))
+		g->err = -EAGAIN;
+	tux3_unlock_fs(sb);
+	return NULL;
+}
+
+/* Test concurrent syncs share one commit, and each waits for it */
+static void test13(struct sb *sb)
+{
+	struct open_result *r = test_alloc_shm(sizeof(*r) * (GROUP_SYNCS + 1));
+
+	test_assert(make_tux3(sb) == 0);
+	test_assert(force_unify(sb) == 0);
+
+	pid_t pid = fork();
+	assert(pid >= 0);
+	if (pid == 0) {
+		struct tux_iattr iattr = { .mode = S_IFREG | S_IRWXU };
+		struct group_sync g[GROUP_SYNCS];
+		pthread_t threads[GROUP_SYNCS];
+		pthread_barrier_t barrier;
+		unsigned committed;
+
+		pthread_barrier_init(&barrier, NULL, GROUP_SYNCS);
+		/* Long enough that every sync joins the first one */
+		sb->group_window = 200 * 1000;
+
+		tux3_lock_fs(sb);
+		for (int i = 0; i < GROUP_SYNCS; i++) {
+			struct inode *inode;
+
+			r[i].namelen = snprintf(r[i].name, sizeof(r[i].name),
+						"sync%d", i);
+			inode = tuxcreate(sb->rootdir, r[i].name, r[i].namelen,
+					  &iattr);
+			assert(!IS_ERR(inode));
+			r[i].inum = tux_inode(inode)->inum;
+			g[i] = (struct group_sync){
+				.sb	 = sb,
+				.inode	 = inode,
+				.barrier = &barrier,
+			};
+		}
+		committed = sb->committed_delta;
+		tux3_unlock_fs(sb);
+
+		for (int i = 0; i < GROUP_SYNCS; i++)
+			pthread_create(&threads[i], NULL, test13_sync, &g[i]);
+		for (int i = 0; i < GROUP_SYNCS; i++) {
+			pthread_join(threads[i], NULL);
+			r[i].err = g[i].err;
+		}
+		r[GROUP_SYNCS].err = sb->committed_delta - committed;
+
+		tux3_lock_fs(sb);
+		for (int i = 0; i < GROUP_SYNCS; i++)
+			iput(g[i].inode);
+		tux3_unlock_fs(sb);
+		pthread_barrier_destroy(&barrier);
+
+		/* Simulate crash */
+		exit(1);
+	}
+	waitpid(pid, NULL, 0);
+	clean_sb(sb);
+	for (int i = 0; i < GROUP_SYNCS; i++)
+		test_assert(r[i].err == 0);
+	test_assert(r[GROUP_SYNCS].err == 1);
+
+	if (test_start("test13.1")) {
+		struct replay *rp = check_replay(sb);
+		test_assert(replay_stage3(rp, 0) == 0);
+
+		for (int i = 0; i < GROUP_SYNCS; i++) {
+			char data[1024], expect[1024];
+			struct inode *inode;
+			struct file *file;
+
+			inode = tuxopen(sb->rootdir, r[i].name, r[i].namelen);
+			test_assert(!IS_ERR(inode));
+			test_assert(tux_inode(inode)->inum == r[i].inum);
+			test_assert(inode->i_size == sizeof(data));
+
+			memset(expect, r[i].inum, sizeof(expect));
+			file = &(struct file){ .f_inode = inode };
+			test_assert(tuxread(file, data, sizeof(data)) == sizeof(data));
+			test_assert(!memcmp(data, expect, sizeof(data)));
+			iput(inode);
+		}
+		clean_main(sb);
+	}
+	test_end();
+
+	tux3_exit_mem();
+	test_free_shm(r, sizeof(*r) * (GROUP_SYNCS + 1));
+}
+
 int main(int argc, char *argv[])
 {
 	if (argc < 2)
@@ -813,6 +1280,30 @@ int main(int argc, char *argv[])
 		test07(sb);
 	test_end();
 
+	if (test_start("test08"))
+		test08(sb);
+	test_end();
+
+	if (test_start("test09"))
+		test09(sb);
+	test_end();
+
+	if (test_start("test10"))
+		test10(sb);
+	test_end();
+
+	if (test_start("test11"))
+		test11(sb);
+	test_end();
+
+	if (test_start("test12"))
+		test12(sb);
+	test_end();
+
+	if (test_start("test13"))
+		test13(sb);
+	test_end();
+
 	clean_main(sb);
 	return test_failures();
 }
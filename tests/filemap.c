@@ -375,6 +375,174 @@ static void test05(struct sb *sb, struct inode *inode)
 	clean_main(sb, inode);
 }
 
+/* Test entropy pre-check of strides */
+static void test06(struct sb *sb, struct inode *inode)
+{
+	static unsigned char data[64 << 10];
+	const char text[] = "The quick brown fox jumps over the lazy dog. ";
+
+	/* Repeated and text data compress */
+	memset(data, 0, sizeof(data));
+	test_assert(!stride_incompressible(data, 16 << 10));
+	for (unsigned i = 0; i < sizeof(data); i++)
+		data[i] = text[i % (sizeof(text) - 1)];
+	test_assert(!stride_incompressible(data, 16 << 10));
+
+	/* Random data doesn't, at any stride size */
+	srand(1);
+	for (unsigned i = 0; i < sizeof(data); i++)
+		data[i] = rand();
+	test_assert(stride_incompressible(data, 1 << 10));
+	test_assert(stride_incompressible(data, 16 << 10));
+	test_assert(stride_incompressible(data, 64 << 10));
+
+	/* Half random is worth a try */
+	for (unsigned i = 0; i < sizeof(data); i += 2)
+		data[i] = 0;
+	test_assert(!stride_incompressible(data, 16 << 10));
+
+	clean_main(sb, inode);
+}
+
+/* Test stride codecs round trip */
+static void test07(struct sb *sb, struct inode *inode)
+{
+	static char in[16 << 10], out[16 << 10], mem[512 << 10];
+	static char c_buf[32 << 10];
+	const char *words[] = { "quick ", "brown ", "fox ", "jumps ", "over ",
+				"the ", "lazy ", "dog. " };
+	size_t sizes[TUX3_CODECS] = { };
+
+	/* Random words */
+	srand(7);
+	for (unsigned i = 0; i < sizeof(in); ) {
+		const char *word = words[rand() % ARRAY_SIZE(words)];
+		for (; *word && i < sizeof(in); word++)
+			in[i++] = *word;
+	}
+
+	for (int i = 0; i < TUX3_CODECS; i++) {
+		const struct stride_codec *codec = &stride_codecs[i];
+		size_t c_len = sizeof(c_buf), d_len = sizeof(out);
+
+		if (!codec->compress)
+			continue;
+		test_assert(codec->workspace_size(sizeof(in)) <= sizeof(mem));
+		test_assert(codec->bound(sizeof(in)) <= sizeof(c_buf));
+		test_assert(!codec->compress(in, sizeof(in), c_buf, &c_len,
+					     mem, -1));
+		test_assert(c_len < sizeof(in));
+		test_assert(!codec->decompress(c_buf, c_len, out, &d_len, mem));
+		test_assert(d_len == sizeof(in));
+		test_assert(!memcmp(in, out, sizeof(in)));
+		sizes[i] = c_len;
+
+		/* No room is not an error */
+		c_len = 100;
+		test_assert(codec->compress(in, sizeof(in), c_buf, &c_len,
+					    mem, -1) == -ENOSPC);
+		test_assert(compress_codec_id(codec->name) == i);
+	}
+	/* Strong one is stronger */
+	test_assert(sizes[TUX3_CODEC_DEFLATE] < sizes[TUX3_CODEC_LZO1X]);
+	test_assert(compress_codec_id("default") == TUX3_CODEC_DEFAULT);
+	test_assert(compress_codec_id("nope") < 0);
+
+	/* Bad level is refused at mount, and by deflate itself */
+	size_t c_len = sizeof(c_buf);
+	test_assert(set_compress_codec("deflate", 10) == -EINVAL);
+	test_assert(set_compress_codec("deflate", -2) == -EINVAL);
+	test_assert(!set_compress_codec("lzo", Z_DEFAULT_COMPRESSION));
+	test_assert(stride_codecs[TUX3_CODEC_DEFLATE].compress(in, sizeof(in),
+				c_buf, &c_len, mem, 10) == -EINVAL);
+
+	clean_main(sb, inode);
+}
+
+/* Test tuxread_pin() reads uncached blocks and holes */
+static void test08(struct sb *sb, struct inode *inode)
+{
+	struct tux_iattr iattr = { .mode = S_IFREG | 0644, };
+	unsigned bsize = sb->blocksize;
+	struct buffer_head *buffers[4], *buffer;
+	struct buffer_stats before, after;
+	struct iovec iov[4];
+	char data[6 << 8], got[4 << 8];
+	unsigned len = 4 * bsize - 20, pos = 10;
+	struct inode *plain;
+	struct file *file;
+	int count;
+
+	assert(sizeof(data) == 6 * bsize);
+	/* tuxread_pin() is only for uncompressed file */
+	plain = tuxcreate(sb->rootdir, "bar", 3, &iattr);
+	test_assert(!IS_ERR(plain));
+	test_assert(!tux3_set_flags(plain, 0));
+	file = &(struct file){ .f_inode = plain };
+
+	/* Blocks 0, 1, 3, 4 and 5, block 2 is hole */
+	for (int i = 0; i < 6; i++)
+		memset(data + i * bsize, 'a' + i, bsize);
+	memset(data + 2 * bsize, 0, bsize);
+	tuxseek(file, 0);
+	test_assert(tuxwrite(file, data, 2 * bsize) == 2 * bsize);
+	tuxseek(file, 3 * bsize);
+	test_assert(tuxwrite(file, data + 3 * bsize, 3 * bsize) == 3 * bsize);
+	test_assert(force_delta(sb) == 0);
+	invalidate_buffers(plain->map);
+
+	/* Blocks read by one map_region() and I/O of single block */
+	tux3_lock_fs(sb);
+	get_buffer_stats(&before);
+	count = tuxread_pin(plain, 5 * bsize, bsize, buffers, iov);
+	get_buffer_stats(&after);
+	test_assert(count == 1);
+	tuxread_unpin(buffers, count);
+	u64 lookup = after.reads - before.reads - 1;
+
+	/* Whole range is pinned from one pass, nothing read past it */
+	get_buffer_stats(&before);
+	count = tuxread_pin(plain, pos, len, buffers, iov);
+	get_buffer_stats(&after);
+	test_assert(count == 4);
+	test_assert(after.reads - before.reads == 4 + lookup);
+	test_assert(after.readahead == before.readahead);
+	for (int i = 0; i < count; i++)
+		test_assert(buffers[i]->index == i);
+	buffer = peekblk(plain->map, 4);
+	test_assert(!buffer);
+	for (int i = 0, off = 0; i < count; i++) {
+		memcpy(got + off, iov[i].iov_base, iov[i].iov_len);
+		off += iov[i].iov_len;
+	}
+	test_assert(!memcmp(got, data + pos, len));
+	tuxread_unpin(buffers, count);
+	tux3_unlock_fs(sb);
+
+	/* Cached block in the middle splits the range in two runs */
+	invalidate_buffers(plain->map);
+	tux3_lock_fs(sb);
+	buffer = blockread(plain->map, 3);
+	test_assert(buffer);
+	get_buffer_stats(&before);
+	count = tuxread_pin(plain, 2 * bsize, 4 * bsize, buffers, iov);
+	get_buffer_stats(&after);
+	test_assert(count == 4);
+	test_assert(after.reads - before.reads == 3 + 2 * lookup);
+	test_assert(buffers[1] == buffer);
+	for (int i = 0, off = 0; i < count; i++) {
+		memcpy(got + off, iov[i].iov_base, iov[i].iov_len);
+		off += iov[i].iov_len;
+	}
+	test_assert(!memcmp(got, data + 2 * bsize, 4 * bsize));
+	tuxread_unpin(buffers, count);
+	blockput(buffer);
+	tux3_unlock_fs(sb);
+
+	iput(plain);
+	clean_main(sb, inode);
+}
+
 int main(int argc, char *argv[])
 {
 	if (argc < 2)
@@ -429,6 +597,18 @@ int main(int argc, char *argv[])
 		test05(sb, inode);
 	test_end();
 
+	if (test_start("test06"))
+		test06(sb, inode);
+	test_end();
+
+	if (test_start("test07"))
+		test07(sb, inode);
+	test_end();
+
+	if (test_start("test08"))
+		test08(sb, inode);
+	test_end();
+
 	clean_main(sb, inode);
 	return test_failures();
 }
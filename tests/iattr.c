@@ -18,12 +18,29 @@
 #include "writeback.c"
 #include "kernel/iattr.c"
 
+/*
+ * Like rapid_open_inode(), but inode lives in caller's scope. The one
+ * rapid_open_inode() makes is dead once the macro returns.
+ */
+static struct inode *open_test_inode(struct sb *sb, struct tux3_inode *tux,
+				     umode_t mode)
+{
+	*tux = (struct tux3_inode){};
+	inode_init(tux, sb, mode);
+	init_rwsem(&tux->btree.lock);
+	tux->vfs_inode.map = new_map(sb->dev, NULL);
+	assert(tux->vfs_inode.map);
+	tux->vfs_inode.map->inode = &tux->vfs_inode;
+	return &tux->vfs_inode;
+}
+
 /* Test encode_attrs() and decode_attrs() */
 static void test01(struct sb *sb)
 {
-	unsigned abits = RDEV_BIT|MODE_OWNER_BIT|CTIME_SIZE_BIT|LINK_COUNT_BIT|MTIME_BIT;
-	struct inode *inode1 = rapid_open_inode(sb, NULL, S_IFCHR | 0644);
-	struct inode *inode2 = rapid_open_inode(sb, NULL, 0x666);
+	unsigned abits = RDEV_BIT|MODE_OWNER_BIT|CTIME_SIZE_BIT|LINK_COUNT_BIT|MTIME_BIT|FLAGS_BIT|CODEC_BIT;
+	struct tux3_inode tux1, tux2;
+	struct inode *inode1 = open_test_inode(sb, &tux1, S_IFCHR | 0644);
+	struct inode *inode2 = open_test_inode(sb, &tux2, 0x666);
 	unsigned delta;
 
 	change_begin_atomic(sb);
@@ -37,6 +54,8 @@ static void test01(struct sb *sb)
 	inode1->i_size	= 0x123456789ULL;
 	inode1->i_ctime	= spectime(0xdec0de01dec0de02ULL);
 	inode1->i_mtime	= spectime(0xbadface1badface2ULL);
+	tux_inode(inode1)->i_flags = TUX3_COMPR_FL;
+	tux_inode(inode1)->i_codec = TUX3_CODEC_DEFLATE;
 	tux_inode(inode1)->present = abits;
 	tux_inode(inode1)->btree = (struct btree){
 		.root = { .block = 0xcaba1f00dULL, .depth = 3 },
@@ -69,6 +88,8 @@ static void test01(struct sb *sb)
 	struct tux3_inode *tuxnode1 = tux_inode(inode1);
 	struct tux3_inode *tuxnode2 = tux_inode(inode2);
 	test_assert(tuxnode1->present == tuxnode2->present);
+	test_assert(tuxnode1->i_flags == tuxnode2->i_flags);
+	test_assert(tuxnode1->i_codec == tuxnode2->i_codec);
 	test_assert(inode1->i_rdev == inode2->i_rdev);
 	test_assert(inode1->i_mode == inode2->i_mode);
 	test_assert(uid_eq(inode1->i_uid, inode2->i_uid));
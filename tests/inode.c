@@ -158,6 +158,248 @@ static void test02(struct sb *sb)
 	clean_main(sb);
 }
 
+/* Check stride map: compressed and raw strides, partial rewrite, truncate */
+static void test03(struct sb *sb)
+{
+	struct tux_iattr iattr = { .mode = S_IFREG | S_IRWXU };
+	char name[] = "bar";
+	struct inode *inode;
+	struct file *file;
+	static char buf[64 << 10], data[64 << 10];
+	loff_t size = sizeof(buf) - 777, cut = 30001;
+	int got;
+
+	/* Every other 16K compressible */
+	srand(1);
+	for (unsigned i = 0; i < sizeof(buf); i++)
+		buf[i] = (i >> 14) & 1 ? rand() : i / 1000;
+
+	inode = tuxcreate(sb->rootdir, name, strlen(name), &iattr);
+	test_assert(!IS_ERR(inode));
+	file = &(struct file){ .f_inode = inode };
+	got = tuxwrite(file, buf, size);
+	test_assert(got == size);
+	iput(inode);
+	force_delta(sb);
+
+	/* Rewrite in part, across strides */
+	inode = tuxopen(sb->rootdir, name, strlen(name));
+	test_assert(!IS_ERR(inode));
+	file = &(struct file){ .f_inode = inode };
+	tuxseek(file, 10000);
+	got = tuxwrite(file, "hello world!", 12);
+	test_assert(got == 12);
+	memcpy(buf + 10000, "hello world!", 12);
+	tuxseek(file, 16000);
+	got = tuxwrite(file, buf, 1000);
+	test_assert(got == 1000);
+	memmove(buf + 16000, buf, 1000);
+	test_assert(!tuxtruncate(inode, cut));
+	iput(inode);
+	force_delta(sb);
+
+	/* Read from disk, at random places */
+	inode = tuxopen(sb->rootdir, name, strlen(name));
+	test_assert(!IS_ERR(inode));
+	test_assert(inode->i_size == cut);
+	file = &(struct file){ .f_inode = inode };
+	got = tuxread(file, data, sizeof(data));
+	test_assert(got == cut);
+	test_assert(!memcmp(data, buf, cut));
+	for (int i = 0; i < 100; i++) {
+		loff_t pos = rand() % cut;
+		unsigned len = min_t(loff_t, rand() % 10000, cut - pos);
+
+		tuxseek(file, pos);
+		got = tuxread(file, data, len);
+		test_assert(got == len);
+		test_assert(!memcmp(data, buf + pos, len));
+	}
+
+	/* Stride read again comes from stride cache */
+	struct stride_cache_stats before, after;
+	get_stride_cache_stats(&before);
+	tuxseek(file, 100);
+	got = tuxread(file, data, 100);
+	test_assert(got == 100);
+	test_assert(!memcmp(data, buf + 100, 100));
+	get_stride_cache_stats(&after);
+	test_assert(after.hits == before.hits + 1);
+	test_assert(after.misses == before.misses);
+	iput(inode);
+
+	force_delta(sb);
+	clean_main(sb);
+}
+
+/* Test per-inode compression flag */
+static void test04(struct sb *sb)
+{
+	struct tux_iattr iattr = { .mode = S_IFREG | S_IRWXU };
+	struct inode *cold, *db;
+	struct file *file;
+	char buf[] = "hello world!", data[100];
+	int got;
+
+	/* New files inherit the flag of mkfs root */
+	test_assert(tux_inode(sb->rootdir)->i_flags & TUX3_COMPR_FL);
+	cold = tuxcreate(sb->rootdir, "cold", 4, &iattr);
+	test_assert(!IS_ERR(cold));
+	test_assert(is_compressed_file(cold));
+	test_assert(tux_inode(cold)->present & FLAGS_BIT);
+
+	/* Clear on parent, child doesn't inherit */
+	test_assert(!tux3_set_flags(sb->rootdir, 0));
+	db = tuxcreate(sb->rootdir, "db", 2, &iattr);
+	test_assert(!IS_ERR(db));
+	test_assert(!is_compressed_file(db));
+	file = &(struct file){ .f_inode = db };
+	got = tuxwrite(file, buf, sizeof(buf));
+	test_assert(got == sizeof(buf));
+
+	/* Can't change layout under data, nor set unknown flags */
+	test_assert(tux3_set_flags(db, TUX3_COMPR_FL) == -EINVAL);
+	test_assert(tux3_set_flags(cold, 1 << 30) == -EOPNOTSUPP);
+	test_assert(!tux3_set_flags(cold, 0));
+	test_assert(!is_compressed_file(cold));
+	test_assert(!tux3_set_flags(sb->rootdir, TUX3_COMPR_FL));
+	iput(cold);
+	iput(db);
+	force_delta(sb);
+
+	db = tuxopen(sb->rootdir, "db", 2);
+	test_assert(!IS_ERR(db));
+	test_assert(!is_compressed_file(db));
+	file = &(struct file){ .f_inode = db };
+	got = tuxread(file, data, sizeof(data));
+	test_assert(got == sizeof(buf));
+	test_assert(!memcmp(data, buf, sizeof(buf)));
+	iput(db);
+
+	force_delta(sb);
+	clean_main(sb);
+}
+
+/* Test incompressible file is stored raw and backs off */
+static void test05(struct sb *sb)
+{
+	struct tux_iattr iattr = { .mode = S_IFREG | S_IRWXU };
+	char name[] = "media";
+	struct inode *inode;
+	struct file *file;
+	static char buf[192 << 10], data[192 << 10];
+	int got;
+
+	srand(5);
+	for (unsigned i = 0; i < sizeof(buf); i++)
+		buf[i] = rand();
+
+	inode = tuxcreate(sb->rootdir, name, strlen(name), &iattr);
+	test_assert(!IS_ERR(inode));
+	test_assert(is_compressed_file(inode));
+	file = &(struct file){ .f_inode = inode };
+	got = tuxwrite(file, buf, sizeof(buf));
+	test_assert(got == sizeof(buf));
+	force_delta(sb);
+	test_assert(tux_inode(inode)->compress_fails);
+	test_assert(tux_inode(inode)->compress_skip);
+
+	tuxseek(file, 0);
+	got = tuxread(file, data, sizeof(data));
+	test_assert(got == sizeof(buf));
+	test_assert(!memcmp(data, buf, sizeof(buf)));
+	iput(inode);
+
+	force_delta(sb);
+	clean_main(sb);
+}
+
+/* Test per-file codec, strides of one file with different codecs */
+static void test06(struct sb *sb)
+{
+	struct tux_iattr iattr = { .mode = S_IFREG | S_IRWXU };
+	char name[] = "archive";
+	struct inode *inode;
+	struct buffer_head *buffer;
+	struct file *file;
+	static char buf[64 << 10], data[64 << 10];
+	int got;
+
+	for (unsigned i = 0; i < sizeof(buf); i++)
+		buf[i] = "0123456789abcdef"[(i * 7 + i / 3) & 15];
+
+	inode = tuxcreate(sb->rootdir, name, strlen(name), &iattr);
+	test_assert(!IS_ERR(inode));
+	test_assert(tux3_set_codec(inode, TUX3_CODECS) == -EINVAL);
+	test_assert(!tux3_set_codec(inode, TUX3_CODEC_DEFLATE));
+	test_assert(tux_inode(inode)->present & CODEC_BIT);
+	file = &(struct file){ .f_inode = inode };
+	got = tuxwrite(file, buf, sizeof(buf) / 2);
+	test_assert(got == sizeof(buf) / 2);
+	force_delta(sb);
+
+	/* Switch codec for the rest of file */
+	test_assert(!tux3_set_codec(inode, TUX3_CODEC_LZO1X));
+	got = tuxwrite(file, buf + sizeof(buf) / 2, sizeof(buf) / 2);
+	test_assert(got == sizeof(buf) / 2);
+	force_delta(sb);
+
+	/* Codec byte of stride_header, stride 0 was deflated */
+	buffer = blockread(mapping(inode), 0);
+	test_assert(buffer);
+	test_assert(((u8 *)bufdata(buffer))[2] == TUX3_CODEC_DEFLATE);
+	blockput(buffer);
+	buffer = blockread(mapping(inode), (sizeof(buf) / 2) >> sb->blockbits);
+	test_assert(buffer);
+	test_assert(((u8 *)bufdata(buffer))[2] == TUX3_CODEC_LZO1X);
+	blockput(buffer);
+
+	tuxseek(file, 0);
+	got = tuxread(file, data, sizeof(data));
+	test_assert(got == sizeof(buf));
+	test_assert(!memcmp(data, buf, sizeof(buf)));
+	iput(inode);
+
+	force_delta(sb);
+	clean_main(sb);
+}
+
+/* Flags and codec set on a directory by inode number are inherited */
+static void test07(struct sb *sb)
+{
+	struct tux_iattr dir_iattr = { .mode = S_IFDIR | 0755 };
+	struct tux_iattr iattr = { .mode = S_IFREG | S_IRWXU };
+	struct inode *dir, *plain, *packed;
+	inum_t inum;
+
+	/* Directory made while root has no flags, child starts plain */
+	test_assert(!tuxsetflags(sb, TUX_ROOTDIR_INO, 0));
+	dir = tuxcreate(sb->rootdir, "cold", 4, &dir_iattr);
+	test_assert(!IS_ERR(dir));
+	inum = tux_inode(dir)->inum;
+	test_assert(!(tux_inode(dir)->i_flags & TUX3_COMPR_FL));
+	plain = tuxcreate(dir, "plain", 5, &iattr);
+	test_assert(!IS_ERR(plain));
+	test_assert(!is_compressed_file(plain));
+	iput(plain);
+
+	/* chattr +c and tux3 codec on directory, as tux3fuse_ioctl() does */
+	test_assert(!tuxsetflags(sb, inum, TUX3_COMPR_FL));
+	test_assert(!tuxsetcodec(sb, inum, TUX3_CODEC_DEFLATE));
+	test_assert(tux_inode(dir)->i_flags & TUX3_COMPR_FL);
+	packed = tuxcreate(dir, "packed", 6, &iattr);
+	test_assert(!IS_ERR(packed));
+	test_assert(tux_inode(packed)->i_flags & TUX3_COMPR_FL);
+	test_assert(is_compressed_file(packed));
+	test_assert(tux_inode(packed)->i_codec == TUX3_CODEC_DEFLATE);
+	iput(packed);
+	iput(dir);
+	test_assert(!tuxsetflags(sb, TUX_ROOTDIR_INO, TUX3_COMPR_FL));
+
+	force_delta(sb);
+	clean_main(sb);
+}
+
 int main(int argc, char *argv[])
 {
 	if (argc < 2)
@@ -198,6 +440,26 @@ int main(int argc, char *argv[])
 		test02(sb);
 	test_end();
 
+	if (test_start("test03"))
+		test03(sb);
+	test_end();
+
+	if (test_start("test04"))
+		test04(sb);
+	test_end();
+
+	if (test_start("test05"))
+		test05(sb);
+	test_end();
+
+	if (test_start("test06"))
+		test06(sb);
+	test_end();
+
+	if (test_start("test07"))
+		test07(sb);
+	test_end();
+
 	clean_main(sb);
 	return test_failures();
 }
@@ -18,6 +18,9 @@
 #define STRINGIFY2(text) #text
 #define STRINGIFY(text) STRINGIFY2(text)
 
+/* Access volume with O_DIRECT */
+static int direct_io;
+
 static int open_volume(const char *volname)
 {
 	if(DEBUG_MODE_U==1)
@@ -41,6 +44,11 @@ static int open_sb(const char *volname, struct sb *sb)
 	int err = load_sb(sb);
 	if (!err) {
 		sb->dev->bits = sb->blockbits;
+		if (direct_io) {
+			err = dev_enable_direct(sb->dev);
+			if (err)
+				return err;
+		}
 		init_buffers(sb->dev, 1 << 20, 2);
 	}
 	return err;
@@ -101,6 +109,116 @@ static int mkfs(const char *volname, struct sb *sb, unsigned blocksize)
 	return make_tux3(sb);
 }
 
+/* Print buffer cache counters of a mounted tux3fuse */
+static int show_buffer_stats(const char *mountpoint)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct buffer_stats stats;
+	int fd = open(mountpoint, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	int err = ioctl(fd, TUX3_IOC_BUFFER_STATS, &stats);
+	if (err)
+		err = -errno;
+	close(fd);
+	if (err)
+		return err;
+
+	u64 lookups = stats.hits + stats.misses;
+	printf("policy      %s\n", stats.policy);
+	printf("buffers     %Lu / %Lu\n", stats.buffers, stats.max_buffers);
+	printf("hits        %Lu (%Lu%%)\n", stats.hits,
+	       lookups ? stats.hits * 100 / lookups : 0);
+	printf("misses      %Lu\n", stats.misses);
+	printf("ghost hits  %Lu\n", stats.ghost_hits);
+	printf("evictions   %Lu\n", stats.evictions);
+	printf("forks       %Lu\n", stats.forks);
+	printf("reads       %Lu\n", stats.reads);
+	printf("readahead   %Lu\n", stats.readahead);
+	for (int i = 0; i < BUFFER_DIRTY_STATES; i++)
+		printf("dirty[%d]    %Lu bytes\n", i, stats.dirty_bytes[i]);
+	printf("hugepages   %Lu bytes\n", stats.huge_bytes);
+	printf("prealloc    %Lu buffers\n", stats.prealloc);
+	return 0;
+}
+
+/* Print decompressed stride cache counters of a mounted tux3fuse */
+static int show_stride_stats(const char *mountpoint)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct stride_cache_stats stats;
+	int fd = open(mountpoint, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	int err = ioctl(fd, TUX3_IOC_STRIDE_STATS, &stats);
+	if (err)
+		err = -errno;
+	close(fd);
+	if (err)
+		return err;
+
+	u64 lookups = stats.hits + stats.misses;
+	printf("strides     %Lu / %Lu bytes\n", stats.bytes, stats.max_bytes);
+	printf("stride hits %Lu (%Lu%%)\n", stats.hits,
+	       lookups ? stats.hits * 100 / lookups : 0);
+	printf("  misses    %Lu\n", stats.misses);
+	printf("  evictions %Lu\n", stats.evictions);
+	printf("  dropped   %Lu\n", stats.invalidations);
+	return 0;
+}
+
+/* Resize buffer pool of a mounted tux3fuse */
+static int resize_cache(const char *mountpoint, u64 poolsize)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	int fd = open(mountpoint, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	int err = ioctl(fd, TUX3_IOC_RESIZE_BUFFERS, &poolsize);
+	if (err)
+		err = -errno;
+	close(fd);
+	return err;
+}
+
+/* Show codec of a file on a mounted tux3fuse, after setting it if name */
+static int file_codec(const char *filename, const char *name)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	u32 codec;
+	int err = 0;
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	if (name) {
+		err = compress_codec_id(name);
+		if (err >= 0) {
+			codec = err;
+			err = ioctl(fd, TUX3_IOC_SET_CODEC, &codec) ? -errno : 0;
+		}
+	}
+	if (!err && ioctl(fd, TUX3_IOC_GET_CODEC, &codec))
+		err = -errno;
+	close(fd);
+	if (err)
+		return err;
+
+	printf("%s: %s\n", filename, compress_codec_name(codec) ? : "unknown");
+	return 0;
+}
+
 static void usage(struct options *options, const char *progname,
 		  const char *cmdname, const char *name, const char *blurb)
 {
@@ -122,7 +240,7 @@ static void usage(struct options *options, const char *progname,
 	printf("%s\n", help);
 }
 
-struct vars { const char *volname; unsigned blocksize; long long seek; int verbose; };
+struct vars { const char *volname; unsigned blocksize; long long seek; int verbose; const char *codec; };
 
 static void command_options(int *argc, const char ***args,
 		struct options *options, int need, const char *progname,
@@ -150,6 +268,9 @@ static void command_options(int *argc, const char ***args,
 		case 's':
 			vars->seek = strtoull(value, NULL, 0);
 			break;
+		case 'c':
+			vars->codec = value;
+			break;
 		case 'v':
 			vars->verbose++;
 			break;
@@ -184,7 +305,7 @@ int main(int argc, char *argv[])
 	enum {
 		CMD_MKFS, CMD_FSCK, CMD_DELTA, CMD_UNIFY, CMD_IMAGE,
 		CMD_READ, CMD_WRITE, CMD_GET, CMD_SET, CMD_STAT, CMD_DELETE,
-		CMD_TRUNCATE, CMD_UNKNOWN,
+		CMD_TRUNCATE, CMD_STATS, CMD_CACHE, CMD_CODEC, CMD_UNKNOWN,
 	};
 
 	static char *commands[] = {
@@ -193,12 +314,14 @@ int main(int argc, char *argv[])
 		[CMD_READ] = "read", [CMD_WRITE] = "write",
 		[CMD_GET] = "get", [CMD_SET] = "set",
 		[CMD_STAT] = "stat", [CMD_DELETE] = "delete",
-		[CMD_TRUNCATE] = "truncate",
+		[CMD_TRUNCATE] = "truncate", [CMD_STATS] = "stats",
+		[CMD_CACHE] = "cache", [CMD_CODEC] = "codec",
 	};
 
 	struct options options[] = {
 		{ "commands", "L", 0, "List commands", },
 		{ "verbose", "v", OPT_MANY, "Verbose output", },
+		{ "direct", "D", 0, "Bypass page cache (O_DIRECT)", },
 		{ "version", "V", 0, "Show version", },
 		{ "usage", "", 0, "Show usage", },
 		{ "help", "?", 0, "Show help", },
@@ -227,6 +350,9 @@ int main(int argc, char *argv[])
 		case 'v':
 			verbose++;
 			break;
+		case 'D':
+			direct_io = 1;
+			break;
 		case 'V':
 			printf("Tux3 tools version %s\n", STRINGIFY(VERSION));
 			exit(0);
@@ -280,6 +406,14 @@ int main(int argc, char *argv[])
 		{},
 	};
 
+	struct options onlycodec[] = {
+		{ "codec", "c", OPT_HASARG, "Set codec (lzo, deflate, default)", },
+		{ "verbose", "v", OPT_MANY, "Verbose output", },
+		{ "usage", "", 0, "Show usage", },
+		{ "help", "?", 0, "Show help", },
+		{},
+	};
+
 	int cmd;
 	for (cmd = 0; cmd < ARRAY_SIZE(commands); cmd++) {
 		if (commands[cmd] && !strcmp(command, commands[cmd]))
@@ -547,6 +681,36 @@ int main(int argc, char *argv[])
 			goto error;
 		break;
 
+	case CMD_STATS:
+		command_options(&argc, &args, onlyhelp, 3, progname, command,
+				"<mountpoint>", &vars);
+		/* Ask running tux3fuse, volume is not opened here */
+		err = show_buffer_stats(vars.volname);
+		if (!err)
+			err = show_stride_stats(vars.volname);
+		if (err)
+			goto error;
+		goto out;
+
+	case CMD_CACHE:
+		command_options(&argc, &args, onlysize, 3, progname, command,
+				"<mountpoint>", &vars);
+		err = resize_cache(vars.volname, vars.seek);
+		if (err)
+			goto error;
+		err = show_buffer_stats(vars.volname);
+		if (err)
+			goto error;
+		goto out;
+
+	case CMD_CODEC:
+		command_options(&argc, &args, onlycodec, 3, progname, command,
+				"<file>", &vars);
+		err = file_codec(vars.volname, vars.codec);
+		if (err)
+			goto error;
+		goto out;
+
 	default:
 		error_exit("'%s' is not a command", command);
 	}
@@ -555,6 +719,7 @@ int main(int argc, char *argv[])
 	//show_buffers(sb->rootdir->map);
 	//show_buffers(sb->volmap->map);
 	put_super(sb);
+out:
 	tux3_exit_mem();
 	free(argv2optv(args));	/* Free memory allocated by command_options() */
 	free(optv);
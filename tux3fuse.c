@@ -52,6 +52,22 @@
 struct tux3fuse {
 	struct sb *sb;
 	char *volname;
+	/* How long the kernel may cache attributes, names, and misses */
+	double attr_timeout;
+	double entry_timeout;
+	double negative_timeout;
+	struct tux3_policy policy;	/* delta/unify thresholds */
+	unsigned uring_depth;		/* io_uring queue depth, 0 is off */
+	int direct;			/* open volume with O_DIRECT */
+	char *cache_policy;		/* buffer replacement policy */
+	unsigned long cache_size;	/* buffer pool bytes */
+	int hugepages;			/* buffer pool on 2MB pages */
+	int compress_threads;		/* stride compressors, -1 is auto */
+	unsigned compress_min_saving;	/* percent a compressed stride saves */
+	char *compress;			/* default stride codec */
+	int compress_level;		/* level of default codec */
+	unsigned long stride_cache;	/* decompressed stride cache bytes */
+	unsigned commit_window;		/* usecs fsync waits for others to join */
 };
 
 static void tux3fuse_init(void *userdata, struct fuse_conn_info *conn)
@@ -88,9 +104,39 @@ static void tux3fuse_init(void *userdata, struct fuse_conn_info *conn)
 	err = load_sb(sb);
 	if (err)
 		goto error;
+	sb->policy = tux3fuse->policy;
+	sb->group_window = tux3fuse->commit_window;
 
 	dev->bits = sb->blockbits;
-	init_buffers(dev, 50 << 20, 2);
+	if (tux3fuse->direct) {
+		err = dev_enable_direct(dev);
+		if (err)
+			strerror_exit(1, -err, "O_DIRECT not usable on %s",
+				      volname);
+	}
+	if (tux3fuse->cache_policy) {
+		err = set_buffer_policy(tux3fuse->cache_policy);
+		if (err)
+			strerror_exit(1, -err, "unknown cache policy %s",
+				      tux3fuse->cache_policy);
+	}
+	set_buffer_hugepages(tux3fuse->hugepages);
+	err = init_buffers(dev, tux3fuse->cache_size, 0);
+	if (err)
+		strerror_exit(1, -err, "cache_size %lu too large",
+			      tux3fuse->cache_size);
+	set_compress_threads(tux3fuse->compress_threads);
+	set_compress_min_saving(tux3fuse->compress_min_saving);
+	err = set_compress_codec(tux3fuse->compress, tux3fuse->compress_level);
+	if (err)
+		strerror_exit(1, -err, "unknown codec %s", tux3fuse->compress);
+	set_stride_cache_size(tux3fuse->stride_cache);
+
+	if (tux3fuse->uring_depth) {
+		err = dev_init_uring(dev, tux3fuse->uring_depth);
+		if (err)
+			tux3_warn(sb, "io_uring unavailable (%d), using sync I/O", err);
+	}
 
 	struct replay *rp = tux3_init_fs(sb);
 	if (IS_ERR(rp)) {
@@ -102,8 +148,19 @@ static void tux3fuse_init(void *userdata, struct fuse_conn_info *conn)
 	if (err)
 		goto error;
 
+	/* Commit deltas in the background, not in the request that ended them */
+	err = tux3_start_flusher(sb);
+	if (err)
+		goto error;
+
 	tux3fuse->sb = sb;
 
+	/* Let ->write_buf take request data from a pipe */
+	if (conn->capable & FUSE_CAP_SPLICE_READ)
+		conn->want |= FUSE_CAP_SPLICE_READ;
+	/* Without this, ioctls on the mountpoint and directories get ENOTTY */
+	conn->want |= FUSE_CAP_IOCTL_DIR;
+
 	return;
 
 error:
@@ -119,8 +176,11 @@ static void tux3fuse_destroy(void *userdata)
 	}
 	struct tux3fuse *tux3fuse = userdata;
 	struct sb *sb = tux3fuse->sb;
+	/* Stop the flusher, so nothing races with the final commit */
+	tux3_exit_flusher(sb);
 	sync_super(sb);
 	put_super(sb);
+	dev_exit_uring(sb->dev);
 	tux3_exit_mem();
 
 	if (tux3fuse->sb->dev)
@@ -139,16 +199,27 @@ static struct sb *tux3fuse_get_sb(fuse_req_t req)
 	return tux3fuse->sb;
 }
 
-static struct inode *tux3fuse_iget(struct sb *sb, fuse_ino_t ino)
+/*
+ * Drop the kernel's cached attributes and data of an inode that tux3
+ * changed on its own. Must not be used from ->read/->write, where the
+ * kernel may hold locks the invalidation needs.
+ */
+static inum_t tux3fuse_inum(fuse_ino_t ino)
 {
 	if(DEBUG_MODE_U==1)
 	{
 		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	if (ino == FUSE_ROOT_ID)
-		ino = TUX_ROOTDIR_INO;
+	return ino == FUSE_ROOT_ID ? TUX_ROOTDIR_INO : ino;
+}
 
-	return tux3_iget(sb, ino);
+static struct inode *tux3fuse_iget(struct sb *sb, fuse_ino_t ino)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	return tux3_iget(sb, tux3fuse_inum(ino));
 }
 
 static void tux3fuse_fill_stat(struct stat *stat, struct inode *inode)
@@ -178,17 +249,20 @@ static void tux3fuse_fill_stat(struct stat *stat, struct inode *inode)
 	};
 }
 
-static void tux3fuse_fill_ep(struct fuse_entry_param *ep, struct inode *inode)
+static void tux3fuse_fill_ep(fuse_req_t req, struct fuse_entry_param *ep,
+			     struct inode *inode)
 {
 	if(DEBUG_MODE_U==1)
 	{
 		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
+	struct tux3fuse *tux3fuse = fuse_req_userdata(req);
+
 	*ep = (struct fuse_entry_param){
 		.ino		= tux_inode(inode)->inum,
 		.generation	= 1,
-		.attr_timeout	= 0.0,
-		.entry_timeout	= 0.0,
+		.attr_timeout	= tux3fuse->attr_timeout,
+		.entry_timeout	= tux3fuse->entry_timeout,
 	};
 	tux3fuse_fill_stat(&ep->attr, inode);
 }
@@ -200,11 +274,14 @@ static void tux3fuse_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
 	trace("(%lx, '%s')", parent, name);
-	struct sb *sb = tux3fuse_get_sb(req);
+	struct tux3fuse *tux3fuse = fuse_req_userdata(req);
+	struct sb *sb = tux3fuse->sb;
 	struct inode *dir, *inode;
 
+	tux3_lock_fs(sb);
 	dir = tux3fuse_iget(sb, parent);
 	if (IS_ERR(dir)) {
+		tux3_unlock_fs(sb);
 		fuse_reply_err(req, -PTR_ERR(dir));
 		return;
 	}
@@ -212,13 +289,23 @@ static void tux3fuse_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 	inode = tuxopen(dir, name, strlen(name));
 	iput(dir);
 	if (IS_ERR(inode)) {
+		tux3_unlock_fs(sb);
+		if (PTR_ERR(inode) == -ENOENT && tux3fuse->negative_timeout > 0.0) {
+			/* ino 0 lets the kernel cache the miss */
+			struct fuse_entry_param ep = {
+				.entry_timeout = tux3fuse->negative_timeout,
+			};
+			fuse_reply_entry(req, &ep);
+			return;
+		}
 		fuse_reply_err(req, -PTR_ERR(inode));
 		return;
 	}
 
 	struct fuse_entry_param ep;
-	tux3fuse_fill_ep(&ep, inode);
+	tux3fuse_fill_ep(req, &ep, inode);
 	iput(inode);
+	tux3_unlock_fs(sb);
 
 	fuse_reply_entry(req, &ep);
 }
@@ -241,11 +328,14 @@ static void tux3fuse_getattr(fuse_req_t req, fuse_ino_t ino,
 		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
 	trace("(%lx)", ino);
-	struct sb *sb = tux3fuse_get_sb(req);
+	struct tux3fuse *tux3fuse = fuse_req_userdata(req);
+	struct sb *sb = tux3fuse->sb;
 	struct inode *inode;
 
+	tux3_lock_fs(sb);
 	inode = tux3fuse_iget(sb, ino);
 	if (IS_ERR(inode)) {
+		tux3_unlock_fs(sb);
 		fuse_reply_err(req, -PTR_ERR(inode));
 		return;
 	}
@@ -254,7 +344,8 @@ static void tux3fuse_getattr(fuse_req_t req, fuse_ino_t ino,
 	tux3fuse_fill_stat(&stbuf, inode);
 
 	iput(inode);
-	fuse_reply_attr(req, &stbuf, 0.0);
+	tux3_unlock_fs(sb);
+	fuse_reply_attr(req, &stbuf, tux3fuse->attr_timeout);
 }
 
 static void tux3fuse_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
@@ -265,11 +356,14 @@ static void tux3fuse_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
 		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
 	trace("(%lx)", ino);
-	struct sb *sb = tux3fuse_get_sb(req);
+	struct tux3fuse *tux3fuse = fuse_req_userdata(req);
+	struct sb *sb = tux3fuse->sb;
 	struct inode *inode;
 
+	tux3_lock_fs(sb);
 	inode = tux3fuse_iget(sb, ino);
 	if (IS_ERR(inode)) {
+		tux3_unlock_fs(sb);
 		fuse_reply_err(req, -PTR_ERR(inode));
 		return;
 	}
@@ -298,8 +392,9 @@ static void tux3fuse_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
 	tux3fuse_fill_stat(&stbuf, inode);
 
 	iput(inode);
+	tux3_unlock_fs(sb);
 
-	fuse_reply_attr(req, &stbuf, 0.0);
+	fuse_reply_attr(req, &stbuf, tux3fuse->attr_timeout);
 }
 
 static void tux3fuse_readlink(fuse_req_t req, fuse_ino_t ino)
@@ -314,6 +409,7 @@ static void tux3fuse_readlink(fuse_req_t req, fuse_ino_t ino)
 
 	trace("(%lx)", ino);
 
+	tux3_lock_fs(sb);
 	inode = tux3fuse_iget(sb, ino);
 	if (IS_ERR(inode)) {
 		err = PTR_ERR(inode);
@@ -326,12 +422,17 @@ static void tux3fuse_readlink(fuse_req_t req, fuse_ino_t ino)
 		err = page_readlink(inode, buf, inode->i_size);
 		if (!err) {
 			buf[inode->i_size - 1] = '\0';
+			iput(inode);
+			tux3_unlock_fs(sb);
 			fuse_reply_readlink(req, buf);
+			free(buf);
+			return;
 		}
 		free(buf);
 	}
 	iput(inode);
 error:
+	tux3_unlock_fs(sb);
 	if (err)
 		fuse_reply_err(req, -err);
 }
@@ -369,20 +470,24 @@ static void tux3fuse_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
 		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
 	const struct fuse_ctx *ctx = fuse_req_ctx(req);
+	struct sb *sb = tux3fuse_get_sb(req);
 	struct inode *inode;
 
 	trace("(%lx, '%s', uid = %u, gid = %u, mode = %o, rdev %llx)",
 	      parent, name, ctx->uid, ctx->gid, mode, (u64)rdev);
 
+	tux3_lock_fs(sb);
 	inode = __tux3fuse_mknod(req, parent, name, mode, rdev);
 	if (IS_ERR(inode)) {
+		tux3_unlock_fs(sb);
 		fuse_reply_err(req, -PTR_ERR(inode));
 		return;
 	}
 
 	struct fuse_entry_param ep;
-	tux3fuse_fill_ep(&ep, inode);
+	tux3fuse_fill_ep(req, &ep, inode);
 	iput(inode);
+	tux3_unlock_fs(sb);
 
 	fuse_reply_entry(req, &ep);
 }
@@ -395,20 +500,24 @@ static void tux3fuse_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
 		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
 	const struct fuse_ctx *ctx = fuse_req_ctx(req);
+	struct sb *sb = tux3fuse_get_sb(req);
 	struct inode *inode;
 
 	trace("(%lx, '%s', uid = %u, gid = %u, mode = %o)",
 	      parent, name, ctx->uid, ctx->gid, mode);
 
+	tux3_lock_fs(sb);
 	inode = __tux3fuse_mknod(req, parent, name, S_IFDIR | mode, 0);
 	if (IS_ERR(inode)) {
+		tux3_unlock_fs(sb);
 		fuse_reply_err(req, -PTR_ERR(inode));
 		return;
 	}
 
 	struct fuse_entry_param ep;
-	tux3fuse_fill_ep(&ep, inode);
+	tux3fuse_fill_ep(req, &ep, inode);
 	iput(inode);
+	tux3_unlock_fs(sb);
 
 	fuse_reply_entry(req, &ep);
 }
@@ -426,6 +535,7 @@ static void tux3fuse_link(fuse_req_t req, fuse_ino_t ino,
 
 	trace("(%lx, %lx, '%s')", ino, newparent, newname);
 
+	tux3_lock_fs(sb);
 	src_inode = tux3fuse_iget(sb, ino);
 	if (IS_ERR(src_inode)) {
 		err = -PTR_ERR(src_inode);
@@ -438,14 +548,12 @@ static void tux3fuse_link(fuse_req_t req, fuse_ino_t ino,
 		goto error_inode;
 	}
 
+	struct fuse_entry_param ep;
 	inode = __tuxlink(src_inode, dir, newname, strlen(newname));
 	err = -PTR_ERR(inode);
 	if (!IS_ERR(inode)) {
-		struct fuse_entry_param ep;
-		tux3fuse_fill_ep(&ep, inode);
+		tux3fuse_fill_ep(req, &ep, inode);
 		iput(inode);
-
-		fuse_reply_entry(req, &ep);
 		err = 0;
 	}
 
@@ -453,8 +561,11 @@ static void tux3fuse_link(fuse_req_t req, fuse_ino_t ino,
 error_inode:
 	iput(src_inode);
 error:
+	tux3_unlock_fs(sb);
 	if (err)
 		fuse_reply_err(req, -err);
+	else
+		fuse_reply_entry(req, &ep);
 }
 
 static void tux3fuse_symlink(fuse_req_t req, const char *link,
@@ -475,26 +586,28 @@ static void tux3fuse_symlink(fuse_req_t req, const char *link,
 
 	trace("('%s', %lx, '%s')", link, parent, name);
 
+	tux3_lock_fs(sb);
 	dir = tux3fuse_iget(sb, parent);
 	if (IS_ERR(dir)) {
 		err = -PTR_ERR(dir);
 		goto error;
 	}
 
+	struct fuse_entry_param ep;
 	inode = __tuxsymlink(dir, name, strlen(name), &iattr, link);
 	err = PTR_ERR(inode);
 	if (!IS_ERR(inode)) {
-		struct fuse_entry_param ep;
-		tux3fuse_fill_ep(&ep, inode);
+		tux3fuse_fill_ep(req, &ep, inode);
 		iput(inode);
-
-		fuse_reply_entry(req, &ep);
 		err = 0;
 	}
 	iput(dir);
 error:
+	tux3_unlock_fs(sb);
 	if (err)
 		fuse_reply_err(req, -err);
+	else
+		fuse_reply_entry(req, &ep);
 }
 
 static void tux3fuse_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
@@ -509,12 +622,14 @@ static void tux3fuse_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
 
 	trace("(%lx, '%s')", parent, name);
 
+	tux3_lock_fs(sb);
 	dir = tux3fuse_iget(sb, parent);
 	err = PTR_ERR(dir);
 	if (!IS_ERR(dir)) {
 		err = tuxunlink(dir, name, strlen(name));
 		iput(dir);
 	}
+	tux3_unlock_fs(sb);
 	if (err)
 		tux3_warn(sb, "Eek! %s", strerror(-err));
 
@@ -533,12 +648,14 @@ static void tux3fuse_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
 
 	trace("(%lx, '%s')", parent, name);
 
+	tux3_lock_fs(sb);
 	dir = tux3fuse_iget(sb, parent);
 	err = PTR_ERR(dir);
 	if (!IS_ERR(dir)) {
 		err = tuxrmdir(dir, name, strlen(name));
 		iput(dir);
 	}
+	tux3_unlock_fs(sb);
 	if (err)
 		tux3_warn(sb, "Eek! %s", strerror(-err));
 
@@ -559,24 +676,26 @@ static void tux3fuse_rename(fuse_req_t req,
 
 	trace("(%lx, '%s', %lx, '%s')", parent, name, newparent, newname);
 
+	tux3_lock_fs(sb);
 	olddir = tux3fuse_iget(sb, parent);
 	if (IS_ERR(olddir)) {
 		err = PTR_ERR(olddir);
 		goto error;
 	}
-	newdir = tux3fuse_iget(sb, parent);
+	newdir = tux3fuse_iget(sb, newparent);
 	if (IS_ERR(newdir)) {
 		err = PTR_ERR(newdir);
 		goto error_old;
 	}
 
+	/* Kernel drops cached attributes (ctime) of the moved inode itself */
 	err = tuxrename(olddir, name, strlen(name), newdir, newname,
 			strlen(newname));
-
 	iput(newdir);
 error_old:
 	iput(olddir);
 error:
+	tux3_unlock_fs(sb);
 	fuse_reply_err(req, -err);
 }
 
@@ -588,19 +707,23 @@ static void tux3fuse_create(fuse_req_t req, fuse_ino_t parent, const char *name,
 		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
 	const struct fuse_ctx *ctx = fuse_req_ctx(req);
+	struct sb *sb = tux3fuse_get_sb(req);
 	struct inode *inode;
 
 	trace("(%lx, '%s', uid = %u, gid = %u, mode = %o)",
 	      parent, name, ctx->uid, ctx->gid, mode);
 
+	tux3_lock_fs(sb);
 	inode = __tux3fuse_mknod(req, parent, name, mode, 0);
 	if (IS_ERR(inode)) {
+		tux3_unlock_fs(sb);
 		fuse_reply_err(req, -PTR_ERR(inode));
 		return;
 	}
 
 	struct fuse_entry_param ep;
-	tux3fuse_fill_ep(&ep, inode);
+	tux3fuse_fill_ep(req, &ep, inode);
+	tux3_unlock_fs(sb);
 
 	fi->fh = (uint64_t)(unsigned long)inode;
 	fuse_reply_create(req, &ep, fi);
@@ -617,7 +740,9 @@ static void tux3fuse_open(fuse_req_t req, fuse_ino_t ino,
 	struct sb *sb = tux3fuse_get_sb(req);
 	struct inode *inode;
 
+	tux3_lock_fs(sb);
 	inode = tux3fuse_iget(sb, ino);
+	tux3_unlock_fs(sb);
 	if (IS_ERR(inode)) {
 		fuse_reply_err(req, -PTR_ERR(inode));
 		return;
@@ -646,7 +771,11 @@ static void tux3fuse_release(fuse_req_t req, fuse_ino_t ino,
 	}
 	trace("(%lx)", ino);
 	struct inode *inode = (struct inode *)(unsigned long)fi->fh;
+	struct sb *sb = tux_sb(inode->i_sb);
+
+	tux3_lock_fs(sb);
 	iput(inode);
+	tux3_unlock_fs(sb);
 	fuse_reply_err(req, 0);
 }
 
@@ -661,12 +790,14 @@ static void tux3fuse_read(fuse_req_t req, fuse_ino_t ino, size_t size,
 	trace("(%lx)", ino);
 	struct inode *inode = (struct inode *)(unsigned long)fi->fh;
 	struct file *file = &(struct file){ .f_inode = inode, };
+	struct sb *sb = tux_sb(inode->i_sb);
 	int err;
 
-	/* FIXME: better to use map_region() directly */
 	trace("userspace tries to seek to %Li\n", (s64)offset);
 	printf("SIZEOFFILE %u\n",(unsigned int)size);
-	if (offset >= inode->i_size) {
+	tux3_lock_fs(sb);
+	if (offset >= inode->i_size || !size) {
+		tux3_unlock_fs(sb);
 		fuse_reply_buf(req, NULL, 0);
 		return;
 	}
@@ -674,15 +805,40 @@ static void tux3fuse_read(fuse_req_t req, fuse_ino_t ino, size_t size,
 	if (offset + size > inode->i_size)
 		size = inode->i_size - offset;
 
+	/* Reply straight from the cached buffers */
+	if (!is_compressed_file(inode)) {
+		unsigned blocks = ((offset & sb->blockmask) + size +
+				   sb->blockmask) >> sb->blockbits;
+		struct buffer_head *buffers[blocks];
+		struct iovec iov[blocks];
+
+		int count = tuxread_pin(inode, offset, size, buffers, iov);
+		tux3_unlock_fs(sb);
+		if (count < 0) {
+			err = count;
+			trace("Eek! %s", strerror(-err));
+			fuse_reply_err(req, -err);
+			return;
+		}
+		fuse_reply_iov(req, iov, count);
+
+		tux3_lock_fs(sb);
+		tuxread_unpin(buffers, count);
+		tux3_unlock_fs(sb);
+		return;
+	}
+
 	tuxseek(file, offset);
 
-	char *buf = malloc(is_compressed_file(inode)?((((size/PAGE_SIZE_1)/COMPRESSION_STRIDE_LEN)+1)*PAGE_SIZE_1*COMPRESSION_STRIDE_LEN):size);
+	char *buf = malloc(size);
 	if (!buf) {
+		tux3_unlock_fs(sb);
 		fuse_reply_err(req, ENOMEM);
 		return;
 	}
 
 	int read = tuxread(file, buf, size);
+	tux3_unlock_fs(sb);
 	if (read < 0) {
 		err = read;
 		goto error;
@@ -708,13 +864,65 @@ static void tux3fuse_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
 	trace("(%lx)", ino);
 	struct inode *inode = (struct inode *)(unsigned long)fi->fh;
 	struct file *file = &(struct file){ .f_inode = inode };
+	struct sb *sb = tux_sb(inode->i_sb);
 
+	tux3_lock_fs(sb);
 	/* FIXME: better to use map_region() directly */
 	tuxseek(file, offset);
 
 	int written = tuxwrite(file, buf, size);
+	tux3_unlock_fs(sb);
 	if (written < 0) {
-		tux3_warn(tux_sb(inode->i_sb), "Eek! %s", strerror(-written));
+		tux3_warn(sb, "Eek! %s", strerror(-written));
+		fuse_reply_err(req, -written);
+		return;
+	}
+
+	fuse_reply_write(req, written);
+}
+
+/* Copy the next len bytes of the request straight into buffer data */
+static int tux3fuse_fill_buf(void *info, void *to, unsigned len)
+{
+	struct fuse_bufvec *src = info;
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(len);
+	ssize_t copied;
+
+	dst.buf[0].mem = to;
+	copied = fuse_buf_copy(&dst, src, 0);
+	if (copied < 0)
+		return copied;
+	if (copied != len)
+		return -EIO;
+	return 0;
+}
+
+/*
+ * Write without the intermediate copy done by ->write. If the kernel
+ * splices the request, bufv refers to a pipe and the data is read from
+ * it directly into the dirty buffers.
+ */
+static void tux3fuse_write_buf(fuse_req_t req, fuse_ino_t ino,
+			       struct fuse_bufvec *bufv, off_t offset,
+			       struct fuse_file_info *fi)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	trace("(%lx)", ino);
+	struct inode *inode = (struct inode *)(unsigned long)fi->fh;
+	struct file *file = &(struct file){ .f_inode = inode };
+	struct sb *sb = tux_sb(inode->i_sb);
+	size_t size = fuse_buf_size(bufv);
+
+	tux3_lock_fs(sb);
+	tuxseek(file, offset);
+
+	int written = tuxwrite_fill(file, size, tux3fuse_fill_buf, bufv);
+	tux3_unlock_fs(sb);
+	if (written < 0) {
+		tux3_warn(sb, "Eek! %s", strerror(-written));
 		fuse_reply_err(req, -written);
 		return;
 	}
@@ -744,7 +952,39 @@ static void tux3fuse_releasedir(fuse_req_t req, fuse_ino_t ino,
 	tux3fuse_release(req, ino, fi);
 }
 
-struct fillstate { char *dirent; int done; u64 ino; unsigned type; };
+/*
+ * An entry is kept pending until the position of the next one is known,
+ * since that position is what the kernel hands back to resume after it.
+ * Room for the pending entry is reserved when it is accepted.
+ */
+struct fillstate {
+	fuse_req_t req;
+	char *buf;
+	size_t size, used;
+	int pending;
+	char name[TUX_NAME_LEN + 1];
+	u64 ino;
+	unsigned type;
+};
+
+static void tux3fuse_fill_pending(struct fillstate *state, loff_t next)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct stat stbuf = {
+		.st_ino = state->ino,
+		.st_mode = state->type << 12,
+	};
+
+	if (!state->pending)
+		return;
+	state->used += fuse_add_direntry(state->req, state->buf + state->used,
+					 state->size - state->used,
+					 state->name, &stbuf, next);
+	state->pending = 0;
+}
 
 static int tux3fuse_filler(void *info, const char *name, int namelen,
 			   loff_t offset, u64 ino, unsigned type)
@@ -754,18 +994,26 @@ static int tux3fuse_filler(void *info, const char *name, int namelen,
 		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
 	struct fillstate *state = info;
-	if (state->done || namelen > TUX_NAME_LEN)
+	size_t len;
+
+	if (namelen > TUX_NAME_LEN)
 		return -EINVAL;
 	trace("'%.*s'\n", namelen, name);
-	memcpy(state->dirent, name, namelen);
-	state->dirent[namelen] = 0;
+
+	tux3fuse_fill_pending(state, offset);
+
+	memcpy(state->name, name, namelen);
+	state->name[namelen] = 0;
+	len = fuse_add_direntry(state->req, NULL, 0, state->name, NULL, 0);
+	if (state->used + len > state->size)
+		return -EINVAL;	/* full, resume from this entry */
+
 	state->ino = ino;
 	state->type = type;
-	state->done = 1;
+	state->pending = 1;
 	return 0;
 }
 
-/* FIXME: this should return more than one dirent per tux_readdir */
 static void tux3fuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
 			     off_t offset, struct fuse_file_info *fi)
 {
@@ -776,36 +1024,29 @@ static void tux3fuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
 	trace("(%lx)", ino);
 	struct inode *inode = (struct inode *)(unsigned long)fi->fh;
 	struct file *dirfile = &(struct file){ .f_inode = inode, .f_pos = offset };
-	char dirent[TUX_NAME_LEN + 1];
-	char *buf = malloc(size);
-	if (!buf) {
+	struct sb *sb = tux_sb(inode->i_sb);
+	struct fillstate fstate = { .req = req, .size = size };
+	int err = 0;
+
+	fstate.buf = malloc(size);
+	if (!fstate.buf) {
 		fuse_reply_err(req, ENOMEM);
 		return;
 	}
 
-	while (dirfile->f_pos < dirfile->f_inode->i_size) {
-		struct fillstate fstate = { .dirent = dirent };
-		int err;
-
+	tux3_lock_fs(sb);
+	if (dirfile->f_pos < dirfile->f_inode->i_size) {
 		err = tux_readdir(dirfile, &fstate, tux3fuse_filler);
-		if (err) {
-			fuse_reply_err(req, -err);
-			free(buf);
-			return;
-		}
-		struct stat stbuf = {
-			.st_ino = fstate.ino,
-			.st_mode = fstate.type,
-		};
-		size_t len = fuse_add_direntry(req, buf, size, dirent, &stbuf,
-					       dirfile->f_pos);
-		fuse_reply_buf(req, buf, len);
-		free(buf);
-		return;
+		if (!err)
+			tux3fuse_fill_pending(&fstate, dirfile->f_pos);
 	}
+	tux3_unlock_fs(sb);
 
-	fuse_reply_buf(req, NULL, 0);
-	free(buf);
+	if (err)
+		fuse_reply_err(req, -err);
+	else
+		fuse_reply_buf(req, fstate.buf, fstate.used);
+	free(fstate.buf);
 }
 
 static void tux3fuse_statfs(fuse_req_t req, fuse_ino_t ino)
@@ -815,6 +1056,8 @@ static void tux3fuse_statfs(fuse_req_t req, fuse_ino_t ino)
 		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
 	struct sb *sb = tux3fuse_get_sb(req);
+
+	tux3_lock_fs(sb);
 	struct statvfs statvfs = {
 		.f_bsize	= sb->blocksize,
 		.f_frsize	= sb->blocksize,
@@ -828,6 +1071,7 @@ static void tux3fuse_statfs(fuse_req_t req, fuse_ino_t ino)
 		//.f_flag	= ,
 		.f_namemax	= TUX_NAME_LEN,
 	};
+	tux3_unlock_fs(sb);
 
 	fuse_reply_statfs(req, &statvfs);
 }
@@ -850,8 +1094,10 @@ static void tux3fuse_fsyncdir(fuse_req_t req, fuse_ino_t ino,
 		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
 	struct sb *sb = tux3fuse_get_sb(req);
-	/* FIXME: we should flush only this dir */
+	/* Names depend on other inodes, so commit the whole delta */
+	tux3_lock_fs(sb);
 	sync_super(sb);
+	tux3_unlock_fs(sb);
 	fuse_reply_err(req, 0);
 }
 
@@ -862,10 +1108,12 @@ static void tux3fuse_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
 	{
 		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	struct sb *sb = tux3fuse_get_sb(req);
-	/* FIXME: we should flush only this file */
-	sync_super(sb);
-	fuse_reply_err(req, 0);
+	struct inode *inode = (struct inode *)(unsigned long)fi->fh;
+	struct sb *sb = tux_sb(inode->i_sb);
+
+	/* Concurrent fsyncs share one commit */
+	int err = tux3_group_sync(sb, inode);
+	fuse_reply_err(req, -err);
 }
 
 /*
@@ -910,14 +1158,17 @@ static void tux3fuse_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
 		return;
 	}
 
+	tux3_lock_fs(sb);
 	inode = tux3fuse_iget(sb, ino);
 	if (IS_ERR(inode)) {
+		tux3_unlock_fs(sb);
 		fuse_reply_err(req, -PTR_ERR(inode));
 		return;
 	}
 
 	err = set_xattr(inode, name, strlen(name), value, size, flags);
 	iput(inode);
+	tux3_unlock_fs(sb);
 
 	fuse_reply_err(req, -err);
 }
@@ -940,8 +1191,10 @@ static void tux3fuse_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
 		return;
 	}
 
+	tux3_lock_fs(sb);
 	inode = tux3fuse_iget(sb, ino);
 	if (IS_ERR(inode)) {
+		tux3_unlock_fs(sb);
 		fuse_reply_err(req, -PTR_ERR(inode));
 		return;
 	}
@@ -954,6 +1207,8 @@ static void tux3fuse_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
 		}
 	}
 	int size = get_xattr(inode, name, strlen(name), data, maxsize);
+	iput(inode);
+	tux3_unlock_fs(sb);
 	if (size < 0)
 		fuse_reply_err(req, -size);
 	else if (!maxsize)
@@ -963,8 +1218,10 @@ static void tux3fuse_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
 
 	if (data)
 		free(data);
+	return;
 out:
 	iput(inode);
+	tux3_unlock_fs(sb);
 }
 
 static void tux3fuse_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
@@ -977,8 +1234,10 @@ static void tux3fuse_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
 	struct sb *sb = tux3fuse_get_sb(req);
 	struct inode *inode;
 
+	tux3_lock_fs(sb);
 	inode = tux3fuse_iget(sb, ino);
 	if (IS_ERR(inode)) {
+		tux3_unlock_fs(sb);
 		fuse_reply_err(req, -PTR_ERR(inode));
 		return;
 	}
@@ -987,8 +1246,9 @@ static void tux3fuse_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
 	if (size) {
 		buf = malloc(size);
 		if (!buf) {
-			fuse_reply_err(req, ENOMEM);
 			iput(inode);
+			tux3_unlock_fs(sb);
+			fuse_reply_err(req, ENOMEM);
 			return;
 		}
 	}
@@ -996,6 +1256,7 @@ static void tux3fuse_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
 	int len = list_xattr(inode, buf, size);
 	trace("listxattr-buffer: %s", buf);
 	iput(inode);
+	tux3_unlock_fs(sb);
 
 	if (len < 0)
 		fuse_reply_err(req, -len);
@@ -1029,14 +1290,17 @@ static void tux3fuse_removexattr(fuse_req_t req, fuse_ino_t ino,
 		return;
 	}
 
+	tux3_lock_fs(sb);
 	inode = tux3fuse_iget(sb, ino);
 	if (IS_ERR(inode)) {
+		tux3_unlock_fs(sb);
 		fuse_reply_err(req, -PTR_ERR(inode));
 		return;
 	}
 
 	err = del_xattr(inode, name, strlen(name));
 	iput(inode);
+	tux3_unlock_fs(sb);
 
 	fuse_reply_err(req, -err);
 }
@@ -1096,14 +1360,140 @@ static void tux3fuse_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg,
 
 	switch (cmd) {
 	case FS_IOC_GETFLAGS:
-	case FS_IOC_SETFLAGS:
 #if BITS_PER_LONG == 64
 	case FS_IOC32_GETFLAGS:
+#endif
+	{
+		struct sb *sb = tux3fuse_get_sb(req);
+		struct inode *inode;
+		unsigned int iflags;
+
+		if (out_bufsz < sizeof(iflags)) {
+			fuse_reply_err(req, EINVAL);
+			return;
+		}
+		tux3_lock_fs(sb);
+		inode = tux3fuse_iget(sb, ino);
+		if (IS_ERR(inode)) {
+			tux3_unlock_fs(sb);
+			fuse_reply_err(req, -PTR_ERR(inode));
+			return;
+		}
+		iflags = tux_inode(inode)->i_flags & TUX3_FL_USER_MODIFIABLE;
+		iput(inode);
+		tux3_unlock_fs(sb);
+		fuse_reply_ioctl(req, 0, &iflags, sizeof(iflags));
+		return;
+	}
+	case FS_IOC_SETFLAGS:
+#if BITS_PER_LONG == 64
 	case FS_IOC32_SETFLAGS:
 #endif
-		fuse_reply_err(req, ENOTTY);
+	{
+		struct sb *sb = tux3fuse_get_sb(req);
+		unsigned int iflags;
+		int err;
+
+		if (in_bufsz < sizeof(iflags)) {
+			fuse_reply_err(req, EINVAL);
+			return;
+		}
+		memcpy(&iflags, in_buf, sizeof(iflags));
+		tux3_lock_fs(sb);
+		err = tuxsetflags(sb, tux3fuse_inum(ino), iflags);
+		tux3_unlock_fs(sb);
+		if (err)
+			fuse_reply_err(req, -err);
+		else
+			fuse_reply_ioctl(req, 0, NULL, 0);
+		return;
+	}
+	case TUX3_IOC_BUFFER_STATS: {
+		struct sb *sb = tux3fuse_get_sb(req);
+		struct buffer_stats stats;
+
+		if (out_bufsz < sizeof(stats)) {
+			fuse_reply_err(req, EINVAL);
+			return;
+		}
+		tux3_lock_fs(sb);
+		get_buffer_stats(&stats);
+		tux3_unlock_fs(sb);
+		fuse_reply_ioctl(req, 0, &stats, sizeof(stats));
+		return;
+	}
+	case TUX3_IOC_STRIDE_STATS: {
+		struct stride_cache_stats stats;
+
+		if (out_bufsz < sizeof(stats)) {
+			fuse_reply_err(req, EINVAL);
+			return;
+		}
+		get_stride_cache_stats(&stats);
+		fuse_reply_ioctl(req, 0, &stats, sizeof(stats));
 		return;
 	}
+	case TUX3_IOC_GET_CODEC: {
+		struct sb *sb = tux3fuse_get_sb(req);
+		struct inode *inode;
+		u32 codec;
+
+		if (out_bufsz < sizeof(codec)) {
+			fuse_reply_err(req, EINVAL);
+			return;
+		}
+		tux3_lock_fs(sb);
+		inode = tux3fuse_iget(sb, ino);
+		if (IS_ERR(inode)) {
+			tux3_unlock_fs(sb);
+			fuse_reply_err(req, -PTR_ERR(inode));
+			return;
+		}
+		codec = tux_inode(inode)->i_codec;
+		iput(inode);
+		tux3_unlock_fs(sb);
+		fuse_reply_ioctl(req, 0, &codec, sizeof(codec));
+		return;
+	}
+	case TUX3_IOC_SET_CODEC: {
+		struct sb *sb = tux3fuse_get_sb(req);
+		u32 codec;
+		int err;
+
+		if (in_bufsz < sizeof(codec)) {
+			fuse_reply_err(req, EINVAL);
+			return;
+		}
+		memcpy(&codec, in_buf, sizeof(codec));
+		tux3_lock_fs(sb);
+		err = tuxsetcodec(sb, tux3fuse_inum(ino), codec);
+		tux3_unlock_fs(sb);
+		if (err)
+			fuse_reply_err(req, -err);
+		else
+			fuse_reply_ioctl(req, 0, NULL, 0);
+		return;
+	}
+	case TUX3_IOC_RESIZE_BUFFERS: {
+		struct sb *sb = tux3fuse_get_sb(req);
+		u64 poolsize;
+		int err;
+
+		if (in_bufsz < sizeof(poolsize)) {
+			fuse_reply_err(req, EINVAL);
+			return;
+		}
+		memcpy(&poolsize, in_buf, sizeof(poolsize));
+		tux3_lock_fs(sb);
+		err = resize_buffers(poolsize);
+		tux3_unlock_fs(sb);
+		if (err)
+			fuse_reply_err(req, -err);
+		else
+			fuse_reply_ioctl(req, 0, NULL, 0);
+		return;
+	}
+	}
 
 	fuse_reply_err(req, ENOTTY);
 }
@@ -1126,6 +1516,7 @@ static struct fuse_lowlevel_ops tux3_ops = {
 	.open		= tux3fuse_open,
 	.read		= tux3fuse_read,
 	.write		= tux3fuse_write,
+	.write_buf	= tux3fuse_write_buf,
 	.flush		= tux3fuse_flush,
 	.release	= tux3fuse_release,
 	.fsync		= tux3fuse_fsync,
@@ -1154,7 +1545,28 @@ enum {
 	FUSE_OPT_KEY_TUX3_HELP,
 };
 
+#define TUX3FUSE_OPT(t, p) { t, offsetof(struct tux3fuse, p), 0 }
+
 static struct fuse_opt tux3fuse_options[] = {
+	TUX3FUSE_OPT("attr_timeout=%lf",	attr_timeout),
+	TUX3FUSE_OPT("entry_timeout=%lf",	entry_timeout),
+	TUX3FUSE_OPT("negative_timeout=%lf",	negative_timeout),
+	TUX3FUSE_OPT("commit_window=%u",	commit_window),
+	TUX3FUSE_OPT("delta_bytes=%lu",		policy.delta_bytes),
+	TUX3FUSE_OPT("delta_ratio=%u",		policy.delta_ratio),
+	TUX3FUSE_OPT("delta_interval=%u",	policy.delta_interval),
+	TUX3FUSE_OPT("unify_logblocks=%u",	policy.unify_logblocks),
+	TUX3FUSE_OPT("unify_interval=%u",	policy.unify_interval),
+	TUX3FUSE_OPT("uring=%u",		uring_depth),
+	{ "direct", offsetof(struct tux3fuse, direct), 1 },
+	TUX3FUSE_OPT("cache=%s",		cache_policy),
+	TUX3FUSE_OPT("cache_size=%lu",		cache_size),
+	{ "hugepages", offsetof(struct tux3fuse, hugepages), 1 },
+	TUX3FUSE_OPT("compress_threads=%d",	compress_threads),
+	TUX3FUSE_OPT("compress_min_saving=%u",	compress_min_saving),
+	TUX3FUSE_OPT("compress=%s",		compress),
+	TUX3FUSE_OPT("compress_level=%d",	compress_level),
+	TUX3FUSE_OPT("stride_cache=%lu",	stride_cache),
 	FUSE_OPT_KEY("-h",	FUSE_OPT_KEY_TUX3_HELP),
 	FUSE_OPT_KEY("--help",	FUSE_OPT_KEY_TUX3_HELP),
 	FUSE_OPT_END
@@ -1191,6 +1603,32 @@ static int tux3fuse_parse_options(void *data, const char *arg,
 			"    -o opt,[opt...]        mount options\n"
 			"    -h   --help            print help\n"
 			"    -V   --version         print version\n"
+			"\n"
+			"tux3fuse options:\n"
+			"    -o attr_timeout=T      cache attributes for T seconds (1.0)\n"
+			"    -o entry_timeout=T     cache names for T seconds (1.0)\n"
+			"    -o negative_timeout=T  cache failed lookups for T seconds (0.0)\n"
+			"    -o commit_window=U     batch fsyncs arriving within U usecs (0)\n"
+			"    -o delta_bytes=N       start a delta at N dirty bytes (8M)\n"
+			"    -o delta_ratio=P       ...or when P%% of the cache is dirty (50)\n"
+			"    -o delta_interval=M    ...or M msecs after the last delta (5000)\n"
+			"    -o unify_logblocks=N   unify when the log reaches N blocks (256)\n"
+			"    -o unify_interval=M    ...or M msecs after the last unify (30000)\n"
+			"                           (0 disables a limit)\n"
+			"    -o uring=N             write deltas by io_uring, N in flight (0)\n"
+			"    -o direct              bypass kernel page cache (O_DIRECT)\n"
+			"    -o cache=arc|lru       buffer replacement policy (arc)\n"
+			"    -o cache_size=N        buffer cache of N bytes (50M),\n"
+			"                           resizable by 'tux3 cache'\n"
+			"    -o hugepages           put preallocated cache on 2MB pages\n"
+			"    -o compress_threads=N  compress strides on N threads,\n"
+			"                           0 is inline (one per cpu but one)\n"
+			"    -o compress_min_saving=N  store stride raw unless\n"
+			"                           compression saves N%% (one block)\n"
+			"    -o compress=lzo|deflate  default stride codec (lzo),\n"
+			"                           settable per file by 'tux3 codec'\n"
+			"    -o compress_level=N    level of deflate, 0-9 (6)\n"
+			"    -o stride_cache=N      cache N bytes of decompressed strides (8M)\n"
 			"\n", outargs->argv[0]);
 		return fuse_opt_add_arg(outargs, "-ho");
 	}
@@ -1209,10 +1647,21 @@ int main(int argc, char *argv[])
 	struct fuse_chan *fc;
 	struct fuse_session *fs;
 	char *mountpoint;
-	int foreground;
+	int multithreaded, foreground;
 	int err = -1;
 
-	struct tux3fuse tux3fuse = {};
+	struct tux3fuse tux3fuse = {
+		.attr_timeout		= 1.0,
+		.entry_timeout		= 1.0,
+		.negative_timeout	= 0.0,
+		.commit_window		= 0,
+		.policy			= tux3_default_policy,
+		.cache_size		= 50 << 20,
+		.compress_threads	= -1,
+		.compress		= "lzo",
+		.compress_level		= -1,	/* codec default */
+		.stride_cache		= 8 << 20,
+	};
 
 	if (argc < 3) {
 		/* Print usage */
@@ -1228,7 +1677,8 @@ int main(int argc, char *argv[])
 			   tux3fuse_parse_options) == -1)
 		goto error;
 
-	if (fuse_parse_cmdline(&args, &mountpoint, NULL, &foreground) == -1)
+	if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded,
+			       &foreground) == -1)
 		goto error;
 
 	fc = fuse_mount(mountpoint, &args);
@@ -1244,7 +1694,16 @@ int main(int argc, char *argv[])
 				printf("Running in background\n");
 			fuse_daemonize(foreground);
 
-			err = fuse_session_loop(fs);
+			/*
+			 * Handlers serialize on sb->fs_lock, so the
+			 * worker threads overlap only in request I/O,
+			 * reply copying and file data reads (see
+			 * tuxread_pin()).
+			 */
+			if (multithreaded)
+				err = fuse_session_loop_mt(fs);
+			else
+				err = fuse_session_loop(fs);
 
 			fuse_remove_signal_handlers(fs);
 			fuse_session_remove_chan(fc);
@@ -13,6 +13,7 @@
 #include <fcntl.h>
 #include <time.h>
 #include <errno.h>
+#include <pthread.h>
 #include "buffer.h"
 #include "trace.h"
 #include "current_task.h"
@@ -94,16 +95,46 @@ static inline struct inode *file_inode(struct file *f)
 
 #define rapid_sb(x)	(&(struct sb){ .dev = x })
 
+/*
+ * The userland core (buffer cache, inode cache, delta machinery) has
+ * no fine grained locking, so multithreaded users have to serialize
+ * every call into it by this lock. The flusher thread releases it
+ * while writing the frozen delta (see tux3_flusher_unlock()).
+ */
+static inline void tux3_lock_fs(struct sb *sb)
+{
+	pthread_mutex_lock(&sb->fs_lock);
+}
+
+static inline void tux3_unlock_fs(struct sb *sb)
+{
+	pthread_mutex_unlock(&sb->fs_lock);
+}
+
 /* dir.c */
 void tux_dump_entries(struct buffer_head *buffer);
 
 /* filemap.c */
 int tuxread(struct file *file, void *data, unsigned len);
 int tuxwrite(struct file *file, const void *data, unsigned len);
+typedef int (*tuxio_fill_t)(void *info, void *to, unsigned len);
+int tuxwrite_fill(struct file *file, unsigned len, tuxio_fill_t fill,
+		  void *info);
 void tuxseek(struct file *file, loff_t pos);
+int tuxread_pin(struct inode *inode, loff_t pos, unsigned len,
+		struct buffer_head **buffers, struct iovec *iov);
+void tuxread_unpin(struct buffer_head **buffers, int count);
 int page_symlink(struct inode *inode, const char *symname, int len);
 int page_readlink(struct inode *inode, void *buf, unsigned size);
 
+/* compression.c */
+void free_compress_workspaces(struct sb *sb);
+int tux3_read_strides(struct inode *inode, loff_t pos, void *data,
+		      unsigned len);
+int tux3_prepare_write(struct inode *inode, loff_t pos, unsigned len);
+int tux3_prepare_resize(struct inode *inode, loff_t newsize);
+void tux3_invalidate_strides(struct inode *inode, block_t start, block_t end);
+
 /* inode.c */
 void inode_leak_check(void);
 void remove_inode_hash(struct inode *inode);
@@ -115,6 +146,8 @@ void i_size_write(struct inode *inode, loff_t i_size);
 void iput(struct inode *inode);
 int __tuxtruncate(struct inode *inode, loff_t size);
 int tuxtruncate(struct inode *inode, loff_t size);
+int tuxsetflags(struct sb *sb, inum_t inum, unsigned flags);
+int tuxsetcodec(struct sb *sb, inum_t inum, unsigned codec);
 
 /* namei.c */
 struct inode *tuxopen(struct inode *dir, const char *name, unsigned len);
@@ -145,6 +178,7 @@ void tux3_exit_mem(void);
 
 /* utility.c */
 void stacktrace(void);
+int dev_enable_direct(struct dev *dev);
 int devio(int rw, struct dev *dev, loff_t offset, void *data, unsigned len);
 int devio_vec(int rw, struct dev *dev, loff_t offset, struct iovec *iov,
 	      unsigned iovcnt);
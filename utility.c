@@ -10,12 +10,85 @@
 
 #include "kernel/utility.c"
 
+/*
+ * Switch dev to O_DIRECT. Blocks must be multiple of the device
+ * alignment, and this must be called before init_buffers() to align
+ * buffer data.
+ */
+int dev_enable_direct(struct dev *dev)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	unsigned align;
+	int flags;
+
+	if (fdalign(dev->fd, &align))
+		return -errno;
+	if (!dev->bits || (1 << dev->bits) % align)
+		return -EINVAL;
+
+	flags = fcntl(dev->fd, F_GETFL);
+	if (flags < 0 || fcntl(dev->fd, F_SETFL, flags | O_DIRECT) < 0)
+		return -errno;
+	dev->align = align;
+
+	return 0;
+}
+
+static int dev_aligned(struct dev *dev, const void *data, loff_t offset,
+		       size_t len)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	unsigned mask = dev->align - 1;
+	return !(((unsigned long)data | offset | len) & mask);
+}
+
+/* O_DIRECT I/O of unaligned range, through aligned bounce buffer */
+static int devio_bounce(int rw, struct dev *dev, loff_t offset, void *data,
+			unsigned len)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	unsigned mask = dev->align - 1;
+	loff_t start = offset & ~(loff_t)mask;
+	size_t size = ((offset + len + mask) & ~(loff_t)mask) - start;
+	void *bounce;
+	int err;
+
+	err = posix_memalign(&bounce, dev->align, size);
+	if (err)
+		return -err;
+
+	/* Read whole range, or only partial ends for write */
+	if (!rw || start != offset || size != len)
+		err = ioabs(dev->fd, bounce, size, 0, start);
+	if (!err) {
+		if (rw) {
+			memcpy(bounce + (offset - start), data, len);
+			err = ioabs(dev->fd, bounce, size, rw, start);
+		} else
+			memcpy(data, bounce + (offset - start), len);
+	}
+
+	free(bounce);
+	return err;
+}
+
 int devio(int rw, struct dev *dev, loff_t offset, void *data, unsigned len)
 {
 	if(DEBUG_MODE_U==1)
 	{
 		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
+	if (dev->align && !dev_aligned(dev, data, offset, len))
+		return devio_bounce(rw, dev, offset, data, len);
 	return ioabs(dev->fd, data, len, rw, offset);
 }
 
@@ -26,6 +99,38 @@ int devio_vec(int rw, struct dev *dev, loff_t offset, struct iovec *iov,
 	{
 		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
+	if (dev->align) {
+		size_t len = 0;
+		int aligned = dev_aligned(dev, NULL, offset, 0);
+		unsigned i;
+
+		for (i = 0; i < iovcnt; i++) {
+			aligned = aligned && dev_aligned(dev, iov[i].iov_base, 0,
+							 iov[i].iov_len);
+			len += iov[i].iov_len;
+		}
+		if (!aligned) {
+			/* Not from buffer pool, copy through linear buffer */
+			void *data = malloc(len), *pos;
+			int err;
+
+			if (!data)
+				return -ENOMEM;
+			if (rw) {
+				for (i = 0, pos = data; i < iovcnt; i++)
+					pos = mempcpy(pos, iov[i].iov_base, iov[i].iov_len);
+			}
+			err = devio(rw, dev, offset, data, len);
+			if (!err && !rw) {
+				for (i = 0, pos = data; i < iovcnt; i++) {
+					memcpy(iov[i].iov_base, pos, iov[i].iov_len);
+					pos += iov[i].iov_len;
+				}
+			}
+			free(data);
+			return err;
+		}
+	}
 	return iovabs(dev->fd, iov, iovcnt, rw, offset);
 }
 
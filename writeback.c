@@ -46,6 +46,36 @@ void mark_inode_dirty_sync(struct inode *inode)
 	__mark_inode_dirty(inode, I_DIRTY_SYNC);
 }
 
+/* Inputs of the delta/unify policy */
+unsigned long tux3_msecs(void)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+unsigned long tux3_dirty_bytes(struct sb *sb)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	return (unsigned long)dirty_buffer_count() << sb->blockbits;
+}
+
+unsigned tux3_dirty_ratio(struct sb *sb)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	return dirty_buffer_count() * 100 / max_buffer_count();
+}
+
 int sync_super(struct sb *sb)
 {
 	if(DEBUG_MODE_U==1)
@@ -54,3 +84,56 @@ int sync_super(struct sb *sb)
 	}
 	return force_delta(sb);
 }
+
+/*
+ * Commit inode for fsync, called without sb->fs_lock. Each caller takes
+ * a ticket. If a leader is already committing, wait for it: the commit
+ * after it covers every ticket taken meanwhile. The leader waits
+ * sb->group_window usecs for others to join, then commits once for
+ * all tickets taken so far.
+ */
+int tux3_group_sync(struct sb *sb, struct inode *inode)
+{
+	if(DEBUG_MODE_U==1)
+	{
+		printf("\t\t\t\t%25s[U]  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	unsigned long ticket, last;
+	int err;
+
+	pthread_mutex_lock(&sb->group_lock);
+	ticket = ++sb->group_next;
+	while (sb->group_done < ticket && sb->group_leader)
+		pthread_cond_wait(&sb->group_wait, &sb->group_lock);
+	if (sb->group_done >= ticket) {
+		err = sb->group_err;
+		pthread_mutex_unlock(&sb->group_lock);
+		return err;
+	}
+	sb->group_leader = 1;
+	pthread_mutex_unlock(&sb->group_lock);
+
+	/* Give other syncs a chance to join this commit */
+	if (sb->group_window)
+		usleep(sb->group_window);
+
+	pthread_mutex_lock(&sb->group_lock);
+	last = sb->group_next;
+	pthread_mutex_unlock(&sb->group_lock);
+
+	tux3_lock_fs(sb);
+	if (last == ticket)
+		err = tux3_sync_inode(sb, inode);
+	else
+		err = force_delta(sb);	/* one commit block for the group */
+	tux3_unlock_fs(sb);
+
+	pthread_mutex_lock(&sb->group_lock);
+	sb->group_done = last;
+	sb->group_err = err;
+	sb->group_leader = 0;
+	pthread_cond_broadcast(&sb->group_wait);
+	pthread_mutex_unlock(&sb->group_lock);
+
+	return err;
+}
@@ -18,5 +18,6 @@ void __mark_inode_dirty(struct inode *inode, unsigned flags);
 void mark_inode_dirty(struct inode *inode);
 void mark_inode_dirty_sync(struct inode *inode);
 int sync_super(struct sb *sb);
+int tux3_group_sync(struct sb *sb, struct inode *inode);
 
 #endif /* !TUX3_WRITEBACK_H */